@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "aligned_io.h"
+#include "file_io.h"
+
+#define BOUNCE_SIZE (1024U * 1024U)
+#define HUGE_PAGE_SIZE (2U * 1024U * 1024U)
+
+/* Partial-block writes lock the blocks they patch through a small hashed set
+ * of locks. NO_BLOCK stands for a block that doesn't need one. */
+#define BLOCK_LOCKS (64U)
+#define NO_BLOCK (BLOCK_LOCKS)
+
+struct aligned_io {
+    int fd;
+    size_t alignment;
+    size_t buffer_size;
+    char *pool;
+    size_t pool_size;
+    char **free_buffers;
+    size_t free_count;
+    pthread_mutex_t pool_lock;
+    pthread_cond_t pool_cond;
+    pthread_mutex_t block_locks[BLOCK_LOCKS];
+    pthread_rwlock_t size_lock;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static char * aligned_get_buffer(struct aligned_io *aio)
+{
+    char *result = NULL;
+
+    pthread_mutex_lock(&aio->pool_lock);
+
+    while (aio->free_count == 0) {
+        pthread_cond_wait(&aio->pool_cond, &aio->pool_lock);
+    }
+
+    result = aio->free_buffers[--aio->free_count];
+    pthread_mutex_unlock(&aio->pool_lock);
+    return result;
+}
+
+static void aligned_put_buffer(struct aligned_io *aio, char *buffer)
+{
+    pthread_mutex_lock(&aio->pool_lock);
+    aio->free_buffers[aio->free_count++] = buffer;
+    pthread_cond_signal(&aio->pool_cond);
+    pthread_mutex_unlock(&aio->pool_lock);
+}
+
+/* O_DIRECT transfers can't be resumed part-way through a block, so a short
+ * transfer is returned as-is instead of being retried like pread_count(). */
+static ssize_t aligned_pread(struct aligned_io *aio, char *buffer,
+                             size_t nbyte, uint64_t offset)
+{
+    ssize_t result = 0;
+
+    do {
+        result = pread(aio->fd, buffer, nbyte, (off_t) offset);
+    } while ((result < 0) && (errno == EINTR));
+
+    return result;
+}
+
+static ssize_t aligned_pwrite(struct aligned_io *aio, const char *buffer,
+                              size_t nbyte, uint64_t offset)
+{
+    ssize_t result = 0;
+
+    do {
+        result = pwrite(aio->fd, buffer, nbyte, (off_t) offset);
+    } while ((result < 0) && (errno == EINTR));
+
+    return result;
+}
+
+/* Reads the block at OFFSET into BLOCK, zero-filling anything past the end
+ * of FD. If the block runs past the end, lowers END to where FD stops. */
+static int aligned_read_block(struct aligned_io *aio, char *block,
+                              uint64_t offset, uint64_t *end)
+{
+    ssize_t result = aligned_pread(aio, block, aio->alignment, offset);
+
+    if (result < 0) {
+        return -1;
+    }
+
+    if ((size_t) result < aio->alignment) {
+        memset(block + result, 0, aio->alignment - (size_t) result);
+
+        if ((offset + (uint64_t) result) < *end) {
+            *end = offset + (uint64_t) result;
+        }
+    }
+
+    return 0;
+}
+
+static size_t aligned_block_slot(struct aligned_io *aio, uint64_t start)
+{
+    return (size_t) ((start / aio->alignment) % BLOCK_LOCKS);
+}
+
+/* Locks the slots of up to two blocks, lower slot first so that writers
+ * taking two can't deadlock. */
+static void aligned_lock_blocks(struct aligned_io *aio, size_t first,
+                                size_t second)
+{
+    size_t low = (first < second) ? first : second;
+    size_t high = (first < second) ? second : first;
+
+    if (low != NO_BLOCK) {
+        pthread_mutex_lock(&aio->block_locks[low]);
+    }
+
+    if ((high != NO_BLOCK) && (high != low)) {
+        pthread_mutex_lock(&aio->block_locks[high]);
+    }
+}
+
+static void aligned_unlock_blocks(struct aligned_io *aio, size_t first,
+                                  size_t second)
+{
+    if (first != NO_BLOCK) {
+        pthread_mutex_unlock(&aio->block_locks[first]);
+    }
+
+    if ((second != NO_BLOCK) && (second != first)) {
+        pthread_mutex_unlock(&aio->block_locks[second]);
+    }
+}
+
+/* Cuts FD back to STOP after a write padded it out to PADDED, unless another
+ * write has since taken it further. Called with the size lock held for
+ * writing. */
+static int aligned_trim(struct aligned_io *aio, uint64_t padded,
+                        uint64_t stop)
+{
+    struct stat stat_buffer = {0};
+
+    if (fstat(aio->fd, &stat_buffer) != 0) {
+        return -1;
+    }
+
+    if ((uint64_t) stat_buffer.st_size != padded) {
+        return 0;
+    }
+
+    return ftruncate(aio->fd, (off_t) stop);
+}
+
+/*----------------------------------------------------------------------------*/
+
+int aligned_io_create(struct aligned_io **aio, int fd, size_t buffer_count)
+{
+    struct aligned_io *result = NULL;
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t memory_alignment = 0;
+    size_t alignment = 0;
+    void *pool = NULL;
+    int error = 0;
+
+    if ((aio == NULL) || (buffer_count == 0) || (page_size <= 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((alignment = file_block_size(fd)) == 0) {
+        return -1;
+    }
+
+    /* The block size has to be a power of two no bigger than a bounce
+     * buffer, or there's no way to line requests up with it. */
+    if (((alignment & (alignment - 1)) != 0) || (alignment > BOUNCE_SIZE)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct aligned_io))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    result->alignment = alignment;
+    result->buffer_size = BOUNCE_SIZE;
+    result->pool_size = buffer_count * BOUNCE_SIZE;
+    pthread_mutex_init(&result->pool_lock, NULL);
+    pthread_cond_init(&result->pool_cond, NULL);
+    pthread_rwlock_init(&result->size_lock, NULL);
+
+    for (size_t x = 0; x < BLOCK_LOCKS; x++) {
+        pthread_mutex_init(&result->block_locks[x], NULL);
+    }
+
+    /* Big pools are aligned so that the kernel can back them with huge
+     * pages, which saves TLB misses on every copy in and out. */
+    memory_alignment = (result->pool_size >= HUGE_PAGE_SIZE) ?
+                       HUGE_PAGE_SIZE : (size_t) page_size;
+
+    if ((error = posix_memalign(&pool, memory_alignment,
+                                result->pool_size)) != 0) {
+        aligned_io_destroy(result);
+        errno = error;
+        return -1;
+    }
+
+    result->pool = pool;
+
+#ifdef MADV_HUGEPAGE
+    if (memory_alignment == HUGE_PAGE_SIZE) {
+        madvise(result->pool, result->pool_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    if ((result->free_buffers = calloc(buffer_count, sizeof(char *))) ==
+        NULL) {
+        aligned_io_destroy(result);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t x = 0; x < buffer_count; x++) {
+        result->free_buffers[x] = result->pool + (x * BOUNCE_SIZE);
+    }
+
+    result->free_count = buffer_count;
+
+    *aio = result;
+    return 0;
+}
+
+void aligned_io_destroy(struct aligned_io *aio)
+{
+    if (aio == NULL) {
+        return;
+    }
+
+    for (size_t x = 0; x < BLOCK_LOCKS; x++) {
+        pthread_mutex_destroy(&aio->block_locks[x]);
+    }
+
+    pthread_rwlock_destroy(&aio->size_lock);
+    pthread_cond_destroy(&aio->pool_cond);
+    pthread_mutex_destroy(&aio->pool_lock);
+    free(aio->free_buffers);
+    free(aio->pool);
+    free(aio);
+}
+
+ssize_t aligned_io_pread(struct aligned_io *aio, char *buf, size_t nbyte,
+                         off_t offset)
+{
+    char *buffer = aligned_get_buffer(aio);
+    size_t mask = aio->alignment - 1;
+    size_t total = 0;
+    ssize_t result = 0;
+
+    while (total < nbyte) {
+        uint64_t pos = (uint64_t) offset + total;
+        uint64_t start = pos & ~((uint64_t) mask);
+        size_t skip = (size_t) (pos - start);
+        size_t wanted = aio->buffer_size - skip;
+        size_t length = 0;
+
+        if (wanted > (nbyte - total)) {
+            wanted = nbyte - total;
+        }
+
+        length = (skip + wanted + mask) & ~mask;
+
+        if ((result = aligned_pread(aio, buffer, length, start)) < 0) {
+            break;
+        }
+
+        if ((size_t) result <= skip) {
+            break;
+        }
+
+        if (((size_t) result - skip) < wanted) {
+            /* End-of-file. */
+            wanted = (size_t) result - skip;
+            length = 0;
+        }
+
+        memcpy(buf + total, buffer + skip, wanted);
+        total += wanted;
+
+        if (length == 0) {
+            break;
+        }
+    }
+
+    aligned_put_buffer(aio, buffer);
+
+    if ((result < 0) && (total == 0)) {
+        return -1;
+    }
+
+    return (ssize_t) total;
+}
+
+ssize_t aligned_io_pwrite(struct aligned_io *aio, const char *buf,
+                          size_t nbyte, off_t offset)
+{
+    char *buffer = aligned_get_buffer(aio);
+    size_t mask = aio->alignment - 1;
+    size_t total = 0;
+    ssize_t result = 0;
+
+    while (total < nbyte) {
+        uint64_t pos = (uint64_t) offset + total;
+        uint64_t start = pos & ~((uint64_t) mask);
+        uint64_t end = UINT64_MAX;
+        size_t skip = (size_t) (pos - start);
+        size_t wanted = aio->buffer_size - skip;
+        size_t length = 0;
+        size_t written = 0;
+        size_t head = NO_BLOCK;
+        size_t tail = NO_BLOCK;
+
+        if (wanted > (nbyte - total)) {
+            wanted = nbyte - total;
+        }
+
+        length = (skip + wanted + mask) & ~mask;
+
+        /* Writers that patch the same block would each write back the
+         * other's half of it as they found it, so they take turns. Whole
+         * blocks are only ever replaced, and go straight through. */
+        if (skip != 0) {
+            head = aligned_block_slot(aio, start);
+        }
+
+        if ((skip + wanted) != length) {
+            tail = aligned_block_slot(aio, start + length - aio->alignment);
+        }
+
+        aligned_lock_blocks(aio, head, tail);
+        pthread_rwlock_rdlock(&aio->size_lock);
+
+        if ((skip != 0) &&
+            (aligned_read_block(aio, buffer, start, &end) != 0)) {
+            result = -1;
+        } else if (((skip + wanted) != length) &&
+                   ((skip == 0) || (length > aio->alignment)) &&
+                   (aligned_read_block(aio,
+                                       buffer + (length - aio->alignment),
+                                       start + (length - aio->alignment),
+                                       &end) != 0)) {
+            result = -1;
+        } else {
+            memcpy(buffer + skip, buf + total, wanted);
+            result = aligned_pwrite(aio, buffer, length, start);
+        }
+
+        pthread_rwlock_unlock(&aio->size_lock);
+
+        if (result >= 0) {
+            if ((size_t) result > skip) {
+                written = (size_t) result - skip;
+                written = (written < wanted) ? written : wanted;
+            }
+
+            /* The padding after the last byte mustn't make FD any longer
+             * than a byte-for-byte write would have. */
+            if (((size_t) result == length) && (end < (start + length))) {
+                uint64_t stop = pos + wanted;
+
+                pthread_rwlock_wrlock(&aio->size_lock);
+
+                if (aligned_trim(aio, start + length,
+                                 (end > stop) ? end : stop) != 0) {
+                    result = -1;
+                }
+
+                pthread_rwlock_unlock(&aio->size_lock);
+            }
+        }
+
+        aligned_unlock_blocks(aio, head, tail);
+
+        if (result < 0) {
+            break;
+        }
+
+        total += written;
+
+        if ((size_t) result < length) {
+            break;
+        }
+    }
+
+    aligned_put_buffer(aio, buffer);
+
+    if ((result < 0) && (total == 0)) {
+        return -1;
+    }
+
+    return (ssize_t) total;
+}
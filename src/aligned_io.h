@@ -0,0 +1,26 @@
+#ifndef ALIGNED_IO_H
+#define ALIGNED_IO_H
+
+#include <sys/types.h>
+
+struct aligned_io;
+
+/* Sets up BUFFER_COUNT aligned bounce buffers for FD, which must have been
+ * opened with O_DIRECT. Each thread doing I/O holds one buffer at a time, so
+ * BUFFER_COUNT should match the number of threads. Returns 0 on success, or
+ * -1 with errno set. */
+int aligned_io_create(struct aligned_io **aio, int fd, size_t buffer_count);
+
+void aligned_io_destroy(struct aligned_io *aio);
+
+/* Reads like pread_count(), for any OFFSET and NBYTE. */
+ssize_t aligned_io_pread(struct aligned_io *aio, char *buf, size_t nbyte,
+                         off_t offset);
+
+/* Writes like pwrite_count(), for any OFFSET and NBYTE. Partial blocks are
+ * read, patched and written back whole, and FD's size is kept as if the
+ * write had been done byte-for-byte. */
+ssize_t aligned_io_pwrite(struct aligned_io *aio, const char *buf,
+                          size_t nbyte, off_t offset);
+
+#endif
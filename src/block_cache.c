@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+#include "file_io.h"
+
+struct cache_entry {
+    uint64_t block;
+    size_t length;
+    int in_use;
+    char *data;
+    struct cache_entry *hash_next;
+    struct cache_entry *newer;
+    struct cache_entry *older;
+};
+
+struct block_cache {
+    int fd;
+    size_t block_size;
+    size_t entry_count;
+    char *data;
+    struct cache_entry *entries;
+    struct cache_entry *free_list;
+    struct cache_entry **buckets;
+    size_t bucket_mask;
+    struct cache_entry *newest;
+    struct cache_entry *oldest;
+    uint64_t generation;
+    pthread_mutex_t lock;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static struct cache_entry ** cache_bucket(struct block_cache *cache,
+                                          uint64_t block)
+{
+    /* Fibonacci hashing spreads out runs of neighbouring blocks. */
+    uint64_t hash = block * 0x9E3779B97F4A7C15ULL;
+    return &cache->buckets[(hash >> 32U) & cache->bucket_mask];
+}
+
+static struct cache_entry * cache_find(struct block_cache *cache,
+                                       uint64_t block)
+{
+    struct cache_entry *entry = *cache_bucket(cache, block);
+
+    while ((entry != NULL) && (entry->block != block)) {
+        entry = entry->hash_next;
+    }
+
+    return entry;
+}
+
+static void cache_unlink_lru(struct block_cache *cache,
+                             struct cache_entry *entry)
+{
+    if (entry->newer) {
+        entry->newer->older = entry->older;
+    } else {
+        cache->newest = entry->older;
+    }
+
+    if (entry->older) {
+        entry->older->newer = entry->newer;
+    } else {
+        cache->oldest = entry->newer;
+    }
+
+    entry->newer = NULL;
+    entry->older = NULL;
+}
+
+static void cache_push_lru(struct block_cache *cache,
+                           struct cache_entry *entry)
+{
+    entry->older = cache->newest;
+
+    if (cache->newest) {
+        cache->newest->newer = entry;
+    }
+
+    cache->newest = entry;
+
+    if (cache->oldest == NULL) {
+        cache->oldest = entry;
+    }
+}
+
+static void cache_touch(struct block_cache *cache, struct cache_entry *entry)
+{
+    if (cache->newest != entry) {
+        cache_unlink_lru(cache, entry);
+        cache_push_lru(cache, entry);
+    }
+}
+
+static void cache_remove(struct block_cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry **link = cache_bucket(cache, entry->block);
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+
+    *link = entry->hash_next;
+    cache_unlink_lru(cache, entry);
+    entry->in_use = 0;
+
+    entry->hash_next = cache->free_list;
+    cache->free_list = entry;
+}
+
+/* Adds an (empty) entry for BLOCK as the most-recently used, evicting the
+ * least-recently used block if the cache is full. */
+static struct cache_entry * cache_insert(struct block_cache *cache,
+                                         uint64_t block)
+{
+    struct cache_entry **bucket = cache_bucket(cache, block);
+    struct cache_entry *entry = NULL;
+
+    if (cache->free_list == NULL) {
+        cache_remove(cache, cache->oldest);
+    }
+
+    entry = cache->free_list;
+    cache->free_list = entry->hash_next;
+
+    entry->block = block;
+    entry->in_use = 1;
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    cache_push_lru(cache, entry);
+    return entry;
+}
+
+static ssize_t cache_read_block(struct block_cache *cache, char *buf,
+                                uint64_t block)
+{
+    return pread_count(cache->fd, buf, cache->block_size,
+                       (off_t) (block * cache->block_size));
+}
+
+/* Copies the part of a LENGTH-byte block that starts at SKIP into DEST, up
+ * to WANTED bytes. */
+static void cache_copy_out(char *dest, const char *block, size_t length,
+                           size_t skip, size_t wanted)
+{
+    if (length > skip) {
+        memcpy(dest, block + skip,
+               ((length - skip) < wanted) ? (length - skip) : wanted);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+int block_cache_create(struct block_cache **cache, int fd, size_t cache_size,
+                       size_t block_size)
+{
+    struct block_cache *result = NULL;
+    size_t bucket_count = 1;
+
+    if ((cache == NULL) || (block_size == 0) || (cache_size < block_size)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct block_cache))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    result->block_size = block_size;
+    result->entry_count = cache_size / block_size;
+    pthread_mutex_init(&result->lock, NULL);
+
+    while (bucket_count < result->entry_count) {
+        bucket_count *= 2;
+    }
+
+    result->bucket_mask = bucket_count - 1;
+    result->buckets = calloc(bucket_count, sizeof(struct cache_entry *));
+    result->entries = calloc(result->entry_count, sizeof(struct cache_entry));
+    result->data = malloc(result->entry_count * block_size);
+
+    if ((result->buckets == NULL) || (result->entries == NULL) ||
+        (result->data == NULL)) {
+        block_cache_destroy(result);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t x = 0; x < result->entry_count; x++) {
+        result->entries[x].data = result->data + (x * block_size);
+        result->entries[x].hash_next = result->free_list;
+        result->free_list = &result->entries[x];
+    }
+
+    *cache = result;
+    return 0;
+}
+
+void block_cache_destroy(struct block_cache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->entries);
+    free(cache->data);
+    free(cache);
+}
+
+ssize_t block_cache_pread(struct block_cache *cache, char *buf, size_t nbyte,
+                          off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+    char *scratch = NULL;
+    ssize_t result = 0;
+
+    while (pos < stop) {
+        uint64_t block = pos / cache->block_size;
+        size_t skip = (size_t) (pos % cache->block_size);
+        size_t wanted = cache->block_size - skip;
+        struct cache_entry *entry = NULL;
+        uint64_t generation = 0;
+        ssize_t length = 0;
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        pthread_mutex_lock(&cache->lock);
+
+        if ((entry = cache_find(cache, block)) != NULL) {
+            cache_touch(cache, entry);
+            length = (ssize_t) entry->length;
+            cache_copy_out(buf + (pos - (uint64_t) offset), entry->data,
+                           entry->length, skip, wanted);
+        }
+
+        generation = cache->generation;
+        pthread_mutex_unlock(&cache->lock);
+
+        if (entry == NULL) {
+            if ((scratch == NULL) &&
+                ((scratch = malloc(cache->block_size)) == NULL)) {
+                errno = ENOMEM;
+                result = -1;
+                break;
+            }
+
+            if ((length = cache_read_block(cache, scratch, block)) < 0) {
+                result = -1;
+                break;
+            }
+
+            cache_copy_out(buf + (pos - (uint64_t) offset), scratch,
+                           (size_t) length, skip, wanted);
+
+            /* Only keep the block if nothing was written while it was being
+             * read, since the write may have missed it. */
+            pthread_mutex_lock(&cache->lock);
+
+            if ((cache->generation == generation) &&
+                (cache_find(cache, block) == NULL)) {
+                entry = cache_insert(cache, block);
+                entry->length = (size_t) length;
+                memcpy(entry->data, scratch, (size_t) length);
+            }
+
+            pthread_mutex_unlock(&cache->lock);
+        }
+
+        if ((size_t) length < skip + wanted) {
+            /* End-of-file. */
+            if ((size_t) length > skip) {
+                pos += (size_t) length - skip;
+            }
+            break;
+        }
+
+        pos += wanted;
+    }
+
+    free(scratch);
+
+    if (result == 0) {
+        result = (ssize_t) (pos - (uint64_t) offset);
+    }
+
+    return result;
+}
+
+void block_cache_update(struct block_cache *cache, const char *buf,
+                        size_t nbyte, off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+
+    while (pos < stop) {
+        uint64_t block = pos / cache->block_size;
+        size_t skip = (size_t) (pos % cache->block_size);
+        size_t count = cache->block_size - skip;
+        struct cache_entry *entry = cache_find(cache, block);
+
+        if (count > (stop - pos)) {
+            count = (size_t) (stop - pos);
+        }
+
+        if (entry != NULL) {
+            if (skip > entry->length) {
+                /* The cached copy doesn't reach this far, so there'd be a
+                 * gap of unknown data. */
+                cache_remove(cache, entry);
+            } else {
+                memcpy(entry->data + skip, buf + (pos - (uint64_t) offset),
+                       count);
+
+                if ((skip + count) > entry->length) {
+                    entry->length = skip + count;
+                }
+            }
+        }
+
+        pos += count;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void block_cache_invalidate(struct block_cache *cache, size_t nbyte,
+                            off_t offset)
+{
+    uint64_t block = (uint64_t) offset / cache->block_size;
+    uint64_t stop = ((uint64_t) offset + nbyte + cache->block_size - 1) /
+                    cache->block_size;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->generation++;
+
+    /* Walk whichever is shorter: the range, or the cache itself. */
+    if ((stop - block) > cache->entry_count) {
+        for (size_t x = 0; x < cache->entry_count; x++) {
+            struct cache_entry *entry = &cache->entries[x];
+
+            if (entry->in_use && (entry->block >= block) &&
+                (entry->block < stop)) {
+                cache_remove(cache, entry);
+            }
+        }
+    } else {
+        for (; block < stop; block++) {
+            struct cache_entry *entry = cache_find(cache, block);
+
+            if (entry != NULL) {
+                cache_remove(cache, entry);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,30 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <sys/types.h>
+
+struct block_cache;
+
+/* Creates an LRU cache of FD's contents, holding up to CACHE_SIZE bytes in
+ * blocks of BLOCK_SIZE bytes. Returns 0 on success, or -1 with errno set. */
+int block_cache_create(struct block_cache **cache, int fd, size_t cache_size,
+                       size_t block_size);
+
+void block_cache_destroy(struct block_cache *cache);
+
+/* Reads like pread_count(): serves what it can from the cache, and reads
+ * (and caches) whole blocks from FD for the rest. Short only at end-of-file. */
+ssize_t block_cache_pread(struct block_cache *cache, char *buf, size_t nbyte,
+                          off_t offset);
+
+/* Copies NBYTE bytes that were just written to FD at OFFSET into any cached
+ * blocks that they overlap. */
+void block_cache_update(struct block_cache *cache, const char *buf,
+                        size_t nbyte, off_t offset);
+
+/* Drops every cached block that overlaps [OFFSET, OFFSET + NBYTE), for
+ * changes to FD whose data never passed through PartFS. */
+void block_cache_invalidate(struct block_cache *cache, size_t nbyte,
+                            off_t offset);
+
+#endif
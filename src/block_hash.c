@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <xxhash.h>
+
+#include "block_hash.h"
+#include "file_io.h"
+
+/* Sidecar layout, all little-endian: a header, then for each region its
+ * offset, size and block count, followed by one entry per block. */
+#define SIDECAR_MAGIC "PARTFSH1"
+#define HEADER_SIZE (40U)
+#define REGION_HEADER_SIZE (24U)
+#define ENTRY_SIZE (12U)
+#define ENTRIES_PER_CHUNK (4096U)
+
+/* Writes that keep landing on the blocks being hashed can hold a digest off
+ * indefinitely, so give up after this many passes. */
+#define DIGEST_PASSES (8U)
+
+/* LENGTH is the number of bytes that HASH covers, or 0 if the block has
+ * changed since. GENERATION moves on with every change, so that a hash read
+ * from before a change is never stored after it. */
+struct block_hash_entry {
+    uint64_t hash;
+    uint32_t length;
+    uint32_t generation;
+};
+
+struct block_hash_region {
+    uint64_t offset;
+    uint64_t size;
+    size_t count;
+    struct block_hash_entry *entries;
+};
+
+struct block_hash {
+    size_t block_size;
+    source_read_fn read_fn;
+    void *data;
+    struct block_hash_region *regions;
+    size_t region_count;
+    pthread_mutex_t lock;
+};
+
+/* What block_hash_fill() needs to write a sidecar. */
+struct block_hash_save {
+    struct block_hash *bh;
+    struct stat source;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static void block_hash_header(const struct block_hash *bh,
+                              const struct stat *source,
+                              unsigned char *header)
+{
+    memcpy(header, SIDECAR_MAGIC, 8);
+    put_le32(header + 8, (uint32_t) bh->block_size);
+    put_le32(header + 12, (uint32_t) bh->region_count);
+    put_le64(header + 16, (uint64_t) source->st_size);
+    put_le64(header + 24, (uint64_t) source->st_mtim.tv_sec);
+    put_le64(header + 32, (uint64_t) source->st_mtim.tv_nsec);
+}
+
+/* Reads COUNT saved entries at OFFSET into REGION. */
+static int block_hash_load_entries(struct block_hash *bh, int fd,
+                                   struct block_hash_region *region,
+                                   off_t offset)
+{
+    unsigned char *chunk = malloc(ENTRIES_PER_CHUNK * ENTRY_SIZE);
+    size_t done = 0;
+    int result = -1;
+
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    while (done < region->count) {
+        size_t count = region->count - done;
+
+        if (count > ENTRIES_PER_CHUNK) {
+            count = ENTRIES_PER_CHUNK;
+        }
+
+        if ((result = pread_exact(fd, chunk, count * ENTRY_SIZE,
+                                 offset + (off_t) (done * ENTRY_SIZE))) != 0) {
+            break;
+        }
+
+        for (size_t x = 0; x < count; x++) {
+            struct block_hash_entry *entry = &region->entries[done + x];
+            const unsigned char *saved = chunk + (x * ENTRY_SIZE);
+
+            entry->hash = get_le64(saved);
+            entry->length = get_le32(saved + 8);
+
+            if (entry->length > bh->block_size) {
+                entry->length = 0;
+            }
+        }
+
+        done += count;
+    }
+
+    free(chunk);
+    return result;
+}
+
+/* Writes the whole sidecar to FD for block_hash_save(). */
+static int block_hash_fill(void *data, int fd)
+{
+    struct block_hash_save *save = (struct block_hash_save *) data;
+    struct block_hash *bh = save->bh;
+    unsigned char *chunk = malloc(ENTRIES_PER_CHUNK * ENTRY_SIZE);
+    int result = -1;
+
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    block_hash_header(bh, &save->source, chunk);
+
+    if (write_all(fd, chunk, HEADER_SIZE) != 0) {
+        free(chunk);
+        return -1;
+    }
+
+    pthread_mutex_lock(&bh->lock);
+
+    for (size_t x = 0; x < bh->region_count; x++) {
+        struct block_hash_region *region = &bh->regions[x];
+        size_t done = 0;
+
+        put_le64(chunk, region->offset);
+        put_le64(chunk + 8, region->size);
+        put_le64(chunk + 16, region->count);
+
+        if (write_all(fd, chunk, REGION_HEADER_SIZE) != 0) {
+            goto cleanup;
+        }
+
+        while (done < region->count) {
+            size_t count = region->count - done;
+
+            if (count > ENTRIES_PER_CHUNK) {
+                count = ENTRIES_PER_CHUNK;
+            }
+
+            for (size_t y = 0; y < count; y++) {
+                struct block_hash_entry *entry = &region->entries[done + y];
+
+                put_le64(chunk + (y * ENTRY_SIZE), entry->hash);
+                put_le32(chunk + (y * ENTRY_SIZE) + 8, entry->length);
+            }
+
+            if (write_all(fd, chunk, count * ENTRY_SIZE) != 0) {
+                goto cleanup;
+            }
+
+            done += count;
+        }
+    }
+
+    result = 0;
+
+cleanup:
+    pthread_mutex_unlock(&bh->lock);
+    free(chunk);
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int block_hash_create(struct block_hash **bh, size_t region_count,
+                      size_t block_size, source_read_fn read_fn,
+                      void *data)
+{
+    struct block_hash *result = NULL;
+
+    if ((bh == NULL) || (block_size == 0) || (block_size > UINT32_MAX) ||
+        (region_count > UINT32_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct block_hash))) == NULL) {
+        return -1;
+    }
+
+    result->regions = calloc(region_count + 1,
+                             sizeof(struct block_hash_region));
+
+    if (result->regions == NULL) {
+        free(result);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    result->block_size = block_size;
+    result->read_fn = read_fn;
+    result->data = data;
+    result->region_count = region_count;
+    pthread_mutex_init(&result->lock, NULL);
+
+    *bh = result;
+    return 0;
+}
+
+void block_hash_destroy(struct block_hash *bh)
+{
+    if (bh == NULL) {
+        return;
+    }
+
+    for (size_t x = 0; x < bh->region_count; x++) {
+        free(bh->regions[x].entries);
+    }
+
+    pthread_mutex_destroy(&bh->lock);
+    free(bh->regions);
+    free(bh);
+}
+
+int block_hash_set_region(struct block_hash *bh, size_t index,
+                          uint64_t offset, uint64_t size)
+{
+    struct block_hash_region *region = NULL;
+    size_t count = (size_t) ((size + bh->block_size - 1) / bh->block_size);
+
+    if (index >= bh->region_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    region = &bh->regions[index];
+    free(region->entries);
+
+    if ((region->entries = calloc(count + 1,
+                                  sizeof(struct block_hash_entry))) == NULL) {
+        region->count = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    region->offset = offset;
+    region->size = size;
+    region->count = count;
+    return 0;
+}
+
+int block_hash_load(struct block_hash *bh, int dir_fd, const char *path,
+                    int source_fd)
+{
+    unsigned char expected[HEADER_SIZE];
+    unsigned char header[HEADER_SIZE];
+    struct stat source = {0};
+    off_t offset = HEADER_SIZE;
+    int result = -1;
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    if ((fstat(source_fd, &source) != 0) ||
+        ((result = pread_exact(fd, header, HEADER_SIZE, 0)) < 0)) {
+        goto cleanup;
+    }
+
+    block_hash_header(bh, &source, expected);
+
+    /* A stale sidecar is no worse than no sidecar. */
+    if ((result != 0) || (memcmp(header, expected, HEADER_SIZE) != 0)) {
+        result = 0;
+        goto cleanup;
+    }
+
+    for (size_t x = 0; x < bh->region_count; x++) {
+        struct block_hash_region *region = &bh->regions[x];
+        unsigned char saved[REGION_HEADER_SIZE];
+        uint64_t count = 0;
+
+        if ((result = pread_exact(fd, saved, REGION_HEADER_SIZE,
+                                 offset)) != 0) {
+            break;
+        }
+
+        count = get_le64(saved + 16);
+        offset += REGION_HEADER_SIZE;
+
+        if ((get_le64(saved) == region->offset) &&
+            (get_le64(saved + 8) == region->size) &&
+            (count == region->count) &&
+            ((result = block_hash_load_entries(bh, fd, region,
+                                               offset)) != 0)) {
+            break;
+        }
+
+        offset += (off_t) (count * ENTRY_SIZE);
+    }
+
+    if (result > 0) {
+        result = 0;
+    }
+
+cleanup:
+    if (result != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int block_hash_save(struct block_hash *bh, int dir_fd, const char *path,
+                    int source_fd)
+{
+    struct block_hash_save save = {bh, {0}};
+
+    if (fstat(source_fd, &save.source) != 0) {
+        return -1;
+    }
+
+    return file_replace(dir_fd, path, block_hash_fill, &save);
+}
+
+void block_hash_invalidate(struct block_hash *bh, size_t nbyte,
+                           off_t offset)
+{
+    uint64_t start = (uint64_t) offset;
+    uint64_t stop = start + nbyte;
+
+    if (nbyte == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&bh->lock);
+
+    for (size_t x = 0; x < bh->region_count; x++) {
+        struct block_hash_region *region = &bh->regions[x];
+        uint64_t region_stop = region->offset + region->size;
+        size_t first = 0;
+        size_t last = 0;
+
+        if ((stop <= region->offset) || (start >= region_stop)) {
+            continue;
+        }
+
+        first = (size_t) (((start > region->offset) ? start : region->offset) -
+                          region->offset) / bh->block_size;
+        last = (size_t) (((stop < region_stop) ? stop : region_stop) - 1 -
+                         region->offset) / bh->block_size;
+
+        for (size_t y = first; y <= last; y++) {
+            region->entries[y].length = 0;
+            region->entries[y].generation++;
+        }
+    }
+
+    pthread_mutex_unlock(&bh->lock);
+}
+
+int block_hash_digest(struct block_hash *bh, size_t index, uint64_t size,
+                      uint64_t *digest)
+{
+    struct block_hash_region *region = NULL;
+    XXH3_state_t *state = NULL;
+    char *buffer = NULL;
+    size_t count = 0;
+    size_t pending = 1;
+    int result = -1;
+
+    if ((index >= bh->region_count) ||
+        (size > bh->regions[index].size)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    region = &bh->regions[index];
+    count = (size_t) ((size + bh->block_size - 1) / bh->block_size);
+
+    if (((buffer = malloc(bh->block_size)) == NULL) ||
+        ((state = XXH3_createState()) == NULL)) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    for (unsigned int pass = 0; (pass < DIGEST_PASSES) && pending; pass++) {
+        pending = 0;
+
+        for (size_t x = 0; x < count; x++) {
+            struct block_hash_entry *entry = &region->entries[x];
+            uint64_t start = (uint64_t) x * bh->block_size;
+            size_t length = bh->block_size;
+            uint32_t generation = 0;
+            uint64_t hash = 0;
+            ssize_t read_result = 0;
+
+            if ((size - start) < length) {
+                length = (size_t) (size - start);
+            }
+
+            pthread_mutex_lock(&bh->lock);
+            generation = entry->generation;
+
+            if (entry->length == length) {
+                pthread_mutex_unlock(&bh->lock);
+                continue;
+            }
+
+            pthread_mutex_unlock(&bh->lock);
+
+            /* Read without the lock, so that writes can carry on. */
+            read_result = bh->read_fn(bh->data, buffer, length,
+                                      (off_t) (region->offset + start));
+
+            if (read_result < 0) {
+                goto cleanup;
+            }
+
+            if ((size_t) read_result < length) {
+                memset(buffer + read_result, 0,
+                       length - (size_t) read_result);
+            }
+
+            hash = XXH3_64bits(buffer, length);
+
+            pthread_mutex_lock(&bh->lock);
+
+            if (entry->generation == generation) {
+                entry->hash = hash;
+                entry->length = (uint32_t) length;
+            } else {
+                pending++;
+            }
+
+            pthread_mutex_unlock(&bh->lock);
+        }
+    }
+
+    if (pending) {
+        errno = EBUSY;
+        goto cleanup;
+    }
+
+    XXH3_64bits_reset(state);
+    pthread_mutex_lock(&bh->lock);
+
+    for (size_t x = 0; x < count; x++) {
+        unsigned char hash[8];
+
+        put_le64(hash, region->entries[x].hash);
+        XXH3_64bits_update(state, hash, sizeof(hash));
+    }
+
+    pthread_mutex_unlock(&bh->lock);
+
+    *digest = XXH3_64bits_digest(state);
+    result = 0;
+
+cleanup:
+    XXH3_freeState(state);
+    free(buffer);
+    return result;
+}
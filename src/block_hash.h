@@ -0,0 +1,48 @@
+#ifndef BLOCK_HASH_H
+#define BLOCK_HASH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+
+struct block_hash;
+
+/* Creates a table of per-block hashes for REGION_COUNT regions of SOURCE,
+ * each hashed in blocks of BLOCK_SIZE bytes. Blocks are read with READ_FN
+ * when they need hashing. Returns 0 on success, or -1 with errno set. */
+int block_hash_create(struct block_hash **bh, size_t region_count,
+                      size_t block_size, source_read_fn read_fn,
+                      void *data);
+
+void block_hash_destroy(struct block_hash *bh);
+
+/* Sets region INDEX to the SIZE bytes at SOURCE offset OFFSET. Every block in
+ * it starts out unhashed. */
+int block_hash_set_region(struct block_hash *bh, size_t index,
+                          uint64_t offset, uint64_t size);
+
+/* Picks up the hashes saved in PATH (relative to DIR_FD), for every region
+ * whose offset and size still match. Nothing is picked up if the file is
+ * missing, or if SOURCE_FD has been modified since the file was saved.
+ * Returns -1 with errno set only if PATH exists but can't be read. */
+int block_hash_load(struct block_hash *bh, int dir_fd, const char *path,
+                    int source_fd);
+
+/* Replaces PATH (relative to DIR_FD) with the current hashes, tagged with
+ * the current size and mtime of SOURCE_FD. Returns 0, or -1 with errno set. */
+int block_hash_save(struct block_hash *bh, int dir_fd, const char *path,
+                    int source_fd);
+
+/* Marks every block that overlaps [OFFSET, OFFSET + NBYTE) of SOURCE as
+ * changed, so that it's read and hashed again by the next digest. */
+void block_hash_invalidate(struct block_hash *bh, size_t nbyte,
+                           off_t offset);
+
+/* Computes the digest of the first SIZE bytes of region INDEX: the hash of
+ * its block hashes, in order. Only the blocks that changed since they were
+ * last hashed are read. Returns 0, or -1 with errno set. */
+int block_hash_digest(struct block_hash *bh, size_t index, uint64_t size,
+                      uint64_t *digest);
+
+#endif
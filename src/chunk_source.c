@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "chunk_source.h"
+
+/* Enough for any name that ends in a 64-bit number. */
+#define MAX_DIGITS (20U)
+
+struct chunk {
+    int fd;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct chunk_source {
+    struct chunk *chunks;
+    size_t chunk_count;
+    uint64_t size;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Adds the chunk at FD to the end of the table. */
+static int chunk_append(struct chunk_source *cs, int fd, size_t *alloc)
+{
+    struct stat stat_buffer = {0};
+
+    if (fstat(fd, &stat_buffer) != 0) {
+        return -1;
+    }
+
+    if (!S_ISREG(stat_buffer.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cs->chunk_count == *alloc) {
+        size_t new_alloc = (*alloc == 0) ? 16 : (*alloc * 2);
+        void *chunks = realloc(cs->chunks, new_alloc * sizeof(struct chunk));
+
+        if (chunks == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        cs->chunks = chunks;
+        *alloc = new_alloc;
+    }
+
+    cs->chunks[cs->chunk_count].fd = fd;
+    cs->chunks[cs->chunk_count].offset = cs->size;
+    cs->chunks[cs->chunk_count].size = (uint64_t) stat_buffer.st_size;
+    cs->chunk_count++;
+    cs->size += (uint64_t) stat_buffer.st_size;
+    return 0;
+}
+
+/* Returns the chunk that holds byte OFFSET, which has to be inside the
+ * image. Empty chunks share their offset with the next one, so this takes
+ * the last chunk that starts at or before OFFSET. */
+static struct chunk * chunk_find(const struct chunk_source *cs,
+                                 uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = cs->chunk_count;
+
+    while ((high - low) > 1) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (cs->chunks[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return &cs->chunks[low];
+}
+
+/*----------------------------------------------------------------------------*/
+
+int chunk_source_open(struct chunk_source **cs, int dir_fd, const char *path,
+                      int flags)
+{
+    struct chunk_source *result = NULL;
+    char *name = NULL;
+    size_t length = 0;
+    size_t width = 0;
+    size_t alloc = 0;
+    unsigned long long number = 0;
+    unsigned long long last = 0;
+    int error = 0;
+
+    if ((cs == NULL) || (path == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    length = strlen(path);
+
+    while ((width < length) && (path[length - width - 1] >= '0') &&
+           (path[length - width - 1] <= '9')) {
+        width++;
+    }
+
+    if ((width == 0) || (width > MAX_DIGITS)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    number = strtoull(path + length - width, NULL, 10);
+    last = 9;
+
+    for (size_t x = 1; (x < width) && (last < (~0ULL / 10)); x++) {
+        last = (last * 10) + 9;
+    }
+
+    if (number > last) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (((result = calloc(1, sizeof(struct chunk_source))) == NULL) ||
+        ((name = strdup(path)) == NULL)) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    for (;;) {
+        int fd = openat(dir_fd, name, flags | O_CLOEXEC);
+
+        if (fd < 0) {
+            /* The first missing chunk ends the image, but the first chunk
+             * has to be there. */
+            if ((errno == ENOENT) && (result->chunk_count != 0)) {
+                break;
+            }
+            goto fail;
+        }
+
+        if (chunk_append(result, fd, &alloc) != 0) {
+            error = errno;
+            close(fd);
+            errno = error;
+            goto fail;
+        }
+
+        if (number++ == last) {
+            break;
+        }
+
+        snprintf(name + length - width, width + 1, "%0*llu", (int) width,
+                 number);
+    }
+
+    free(name);
+    *cs = result;
+    return 0;
+
+fail:
+    error = errno;
+    free(name);
+    chunk_source_close(result);
+    errno = error;
+    return -1;
+}
+
+void chunk_source_close(struct chunk_source *cs)
+{
+    if (cs == NULL) {
+        return;
+    }
+
+    for (size_t x = 0; x < cs->chunk_count; x++) {
+        close(cs->chunks[x].fd);
+    }
+
+    free(cs->chunks);
+    free(cs);
+}
+
+uint64_t chunk_source_size(struct chunk_source *cs)
+{
+    return cs->size;
+}
+
+size_t chunk_source_count(struct chunk_source *cs)
+{
+    return cs->chunk_count;
+}
+
+ssize_t chunk_source_pread(struct chunk_source *cs, char *buf, size_t nbyte,
+                           off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    if (stop > cs->size) {
+        stop = cs->size;
+    }
+
+    while (pos < stop) {
+        struct chunk *chunk = chunk_find(cs, pos);
+        uint64_t skip = pos - chunk->offset;
+        size_t wanted = (size_t) (chunk->size - skip);
+        ssize_t result = 0;
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        result = pread(chunk->fd, buf + (pos - (uint64_t) offset), wanted,
+                       (off_t) skip);
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (pos == (uint64_t) offset) {
+                return -1;
+            }
+            break;
+        }
+
+        if (result == 0) {
+            /* The chunk shrank since it was opened. */
+            break;
+        }
+
+        pos += (uint64_t) result;
+    }
+
+    return (ssize_t) (pos - (uint64_t) offset);
+}
+
+ssize_t chunk_source_pwrite(struct chunk_source *cs, const char *buf,
+                            size_t nbyte, off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    if (stop > cs->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    while (pos < stop) {
+        struct chunk *chunk = chunk_find(cs, pos);
+        uint64_t skip = pos - chunk->offset;
+        size_t wanted = (size_t) (chunk->size - skip);
+        ssize_t result = 0;
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        result = pwrite(chunk->fd, buf + (pos - (uint64_t) offset), wanted,
+                        (off_t) skip);
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        pos += (uint64_t) result;
+    }
+
+    return (ssize_t) nbyte;
+}
+
+int chunk_source_fallocate(struct chunk_source *cs, int mode, off_t offset,
+                           off_t length)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + (uint64_t) length;
+
+    if (stop > cs->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    while (pos < stop) {
+        struct chunk *chunk = chunk_find(cs, pos);
+        uint64_t skip = pos - chunk->offset;
+        uint64_t wanted = chunk->size - skip;
+
+        if (wanted > (stop - pos)) {
+            wanted = stop - pos;
+        }
+
+        if (fallocate(chunk->fd, mode, (off_t) skip, (off_t) wanted) < 0) {
+            return -1;
+        }
+
+        pos += wanted;
+    }
+
+    return 0;
+}
+
+int chunk_source_sync(struct chunk_source *cs)
+{
+    for (size_t x = 0; x < cs->chunk_count; x++) {
+        if (fsync(cs->chunks[x].fd) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
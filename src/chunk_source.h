@@ -0,0 +1,42 @@
+#ifndef CHUNK_SOURCE_H
+#define CHUNK_SOURCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct chunk_source;
+
+/* Opens PATH (relative to DIR_FD) and the chunks that follow it, with FLAGS,
+ * as one image. PATH has to end in a number: the next chunk is the same name
+ * with that number plus one, in as many digits (so "image.000" is followed
+ * by "image.001"), up to the first one that doesn't exist. Returns 0 on
+ * success, or -1 with errno set (EINVAL if PATH doesn't end in a number). */
+int chunk_source_open(struct chunk_source **cs, int dir_fd, const char *path,
+                      int flags);
+
+void chunk_source_close(struct chunk_source *cs);
+
+/* Returns the combined size of the chunks. */
+uint64_t chunk_source_size(struct chunk_source *cs);
+
+/* Returns the number of chunks. */
+size_t chunk_source_count(struct chunk_source *cs);
+
+/* Reads like pread_count() from the chunks laid end to end. */
+ssize_t chunk_source_pread(struct chunk_source *cs, char *buf, size_t nbyte,
+                           off_t offset);
+
+/* Writes like pwrite_count(), splitting the write at chunk boundaries. The
+ * chunks never grow, so anything past the last one fails with ENOSPC. */
+ssize_t chunk_source_pwrite(struct chunk_source *cs, const char *buf,
+                            size_t nbyte, off_t offset);
+
+/* Calls fallocate(2) with MODE on each chunk that [OFFSET, OFFSET + LENGTH)
+ * covers. MODE has to include FALLOC_FL_KEEP_SIZE. */
+int chunk_source_fallocate(struct chunk_source *cs, int mode, off_t offset,
+                           off_t length);
+
+/* Calls fsync(2) on every chunk. Returns 0, or -1 with errno set. */
+int chunk_source_sync(struct chunk_source *cs);
+
+#endif
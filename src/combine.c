@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "combine.h"
+#include "file_io.h"
+
+/* Writes are widened to SOURCE's block size, up to this much. Past it, the
+ * extra reads would cost more than the partial-block writes they save. */
+#define MAX_ALIGNMENT (64U * 1024U)
+
+/* A run of pending bytes, [start, start + length). */
+struct combine_extent {
+    uint64_t start;
+    size_t length;
+    size_t alloc;
+    char *data;
+};
+
+struct combine {
+    int fd;
+    size_t alignment;
+    size_t capacity;
+    unsigned int max_age_ms;
+    struct combine_extent *extents;
+    size_t extent_count;
+    size_t extent_alloc;
+    size_t pending;
+    struct timespec oldest;
+    int error;
+    pthread_rwlock_t lock;
+    pthread_mutex_t timer_lock;
+    pthread_cond_t timer_cond;
+    pthread_t flusher;
+    int flusher_started;
+    int stopping;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t extent_end(const struct combine_extent *extent)
+{
+    return extent->start + extent->length;
+}
+
+/* Returns the index of the first extent that ends at or after OFFSET, which
+ * is the first one that a write starting at OFFSET could merge with. */
+static size_t combine_find(const struct combine *cb, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = cb->extent_count;
+
+    while (low < high) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (extent_end(&cb->extents[mid]) < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/* Writes out and drops every pending extent. Called with the lock held for
+ * writing. */
+static void combine_flush_locked(struct combine *cb)
+{
+    for (size_t x = 0; x < cb->extent_count; x++) {
+        struct combine_extent *extent = &cb->extents[x];
+
+        if (pwrite_count(cb->fd, extent->data, extent->length,
+                       (off_t) extent->start) < 0) {
+            /* Like the kernel's writeback, report the failure on the next
+             * flush or fsync instead of retrying forever. */
+            cb->error = errno;
+        }
+
+        free(extent->data);
+    }
+
+    cb->extent_count = 0;
+    cb->pending = 0;
+}
+
+/* Makes room for LENGTH bytes in EXTENT's buffer. Buffers grow
+ * geometrically, so that a run of small appends copies each byte a bounded
+ * number of times instead of once per append. */
+static int extent_reserve(struct combine_extent *extent, size_t length)
+{
+    size_t alloc = extent->alloc * 2;
+    char *data = NULL;
+
+    if (length <= extent->alloc) {
+        return 0;
+    }
+
+    if (alloc < length) {
+        alloc = length;
+    }
+
+    if ((data = realloc(extent->data, alloc)) == NULL) {
+        return -1;
+    }
+
+    extent->data = data;
+    extent->alloc = alloc;
+    return 0;
+}
+
+/* Merges [START, START + NBYTE) into the pending set, along with every
+ * extent that it overlaps or touches. The first of those keeps its buffer,
+ * and only the bytes of the others are copied into it. Called with the lock
+ * held for writing. */
+static int combine_insert(struct combine *cb, const char *buf, size_t nbyte,
+                          uint64_t start)
+{
+    uint64_t stop = start + nbyte;
+    size_t first = combine_find(cb, start);
+    size_t last = first;
+    struct combine_extent *base = NULL;
+    uint64_t merged_start = start;
+    uint64_t merged_stop = stop;
+
+    while ((last < cb->extent_count) && (cb->extents[last].start <= stop)) {
+        last++;
+    }
+
+    if (first == last) {
+        struct combine_extent extent = {.start = start, .length = nbyte};
+
+        if (cb->extent_count == cb->extent_alloc) {
+            size_t alloc = (cb->extent_alloc == 0) ? 64 :
+                           cb->extent_alloc * 2;
+            void *extents = realloc(cb->extents,
+                                    alloc * sizeof(struct combine_extent));
+
+            if (extents == NULL) {
+                return -1;
+            }
+
+            cb->extents = extents;
+            cb->extent_alloc = alloc;
+        }
+
+        if (extent_reserve(&extent, nbyte) != 0) {
+            return -1;
+        }
+
+        memcpy(extent.data, buf, nbyte);
+        memmove(&cb->extents[first + 1], &cb->extents[first],
+                (cb->extent_count - first) * sizeof(struct combine_extent));
+        cb->extents[first] = extent;
+        cb->extent_count++;
+        cb->pending += nbyte;
+        return 0;
+    }
+
+    base = &cb->extents[first];
+
+    if (base->start < merged_start) {
+        merged_start = base->start;
+    }
+
+    if (extent_end(&cb->extents[last - 1]) > merged_stop) {
+        merged_stop = extent_end(&cb->extents[last - 1]);
+    }
+
+    if (extent_reserve(base, (size_t) (merged_stop - merged_start)) != 0) {
+        return -1;
+    }
+
+    /* A write that starts before the base extent moves its data up. */
+    if (merged_start < base->start) {
+        memmove(base->data + (base->start - merged_start), base->data,
+                base->length);
+    }
+
+    cb->pending -= base->length;
+
+    for (size_t x = first + 1; x < last; x++) {
+        struct combine_extent *extent = &cb->extents[x];
+
+        memcpy(base->data + (extent->start - merged_start), extent->data,
+               extent->length);
+        cb->pending -= extent->length;
+        free(extent->data);
+    }
+
+    memcpy(base->data + (start - merged_start), buf, nbyte);
+
+    base->start = merged_start;
+    base->length = (size_t) (merged_stop - merged_start);
+    cb->pending += base->length;
+
+    memmove(&cb->extents[first + 1], &cb->extents[last],
+            (cb->extent_count - last) * sizeof(struct combine_extent));
+    cb->extent_count -= (last - first - 1);
+    return 0;
+}
+
+/* Reads like pread_count(), with any pending writes laid on top. A range
+ * that's all pending isn't read from FD at all. Called with the lock held. */
+static ssize_t combine_read_locked(struct combine *cb, char *buf,
+                                   size_t nbyte, uint64_t start)
+{
+    uint64_t stop = start + nbyte;
+    size_t first = combine_find(cb, start);
+    ssize_t result = 0;
+
+    if ((first < cb->extent_count) && (cb->extents[first].start <= start) &&
+        (extent_end(&cb->extents[first]) >= stop)) {
+        memcpy(buf, cb->extents[first].data +
+               (start - cb->extents[first].start), nbyte);
+        return (ssize_t) nbyte;
+    }
+
+    if ((result = pread_count(cb->fd, buf, nbyte, (off_t) start)) < 0) {
+        return -1;
+    }
+
+    for (size_t x = first;
+         (x < cb->extent_count) && (cb->extents[x].start < stop); x++) {
+        struct combine_extent *extent = &cb->extents[x];
+        uint64_t copy_start = (extent->start > start) ? extent->start : start;
+        uint64_t copy_stop = (extent_end(extent) < stop) ?
+                             extent_end(extent) : stop;
+
+        if (copy_stop <= copy_start) {
+            continue;
+        }
+
+        /* Pending data past the end of FD extends the read, and any gap
+         * before it reads as zeroes. */
+        if ((copy_start - start) > (uint64_t) result) {
+            memset(buf + result, 0, (size_t) (copy_start - start) -
+                   (size_t) result);
+        }
+
+        memcpy(buf + (copy_start - start),
+               extent->data + (copy_start - extent->start),
+               (size_t) (copy_stop - copy_start));
+
+        if ((copy_stop - start) > (uint64_t) result) {
+            result = (ssize_t) (copy_stop - start);
+        }
+    }
+
+    return result;
+}
+
+/* Queues NBYTE bytes at START, widened to whole blocks of FD with what's
+ * already there (pending or in FD), so that flushes don't make FD read back
+ * the blocks that they only partly cover. The tail is cut short at the end
+ * of FD rather than growing it. Called with the lock held for writing. */
+static int combine_insert_aligned(struct combine *cb, const char *buf,
+                                  size_t nbyte, uint64_t start)
+{
+    uint64_t stop = start + nbyte;
+    uint64_t block_start = start & ~((uint64_t) cb->alignment - 1);
+    uint64_t block_stop = (stop + cb->alignment - 1) &
+                          ~((uint64_t) cb->alignment - 1);
+    size_t head = (size_t) (start - block_start);
+    char *padded = NULL;
+    ssize_t count = 0;
+    int result = 0;
+
+    if ((head == 0) && (block_stop == stop)) {
+        return combine_insert(cb, buf, nbyte, start);
+    }
+
+    if ((padded = malloc((size_t) (block_stop - block_start))) == NULL) {
+        return combine_insert(cb, buf, nbyte, start);
+    }
+
+    if (head != 0) {
+        if ((count = combine_read_locked(cb, padded, head,
+                                         block_start)) < 0) {
+            /* Leave the write unaligned. */
+            head = 0;
+            block_start = start;
+        } else if ((size_t) count < head) {
+            /* Past the end of FD, which the write grows over anyway. */
+            memset(padded + count, 0, head - (size_t) count);
+        }
+    }
+
+    memcpy(padded + head, buf, nbyte);
+
+    if (block_stop != stop) {
+        count = combine_read_locked(cb, padded + head + nbyte,
+                                    (size_t) (block_stop - stop), stop);
+        block_stop = stop + (uint64_t) ((count < 0) ? 0 : count);
+    }
+
+    result = combine_insert(cb, padded, (size_t) (block_stop - block_start),
+                            block_start);
+    free(padded);
+    return result;
+}
+
+static int combine_take_error(struct combine *cb)
+{
+    int error = cb->error;
+
+    cb->error = 0;
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void * combine_flusher(void *data)
+{
+    struct combine *cb = (struct combine *) data;
+    uint64_t interval_ns = (uint64_t) cb->max_age_ms * 1000000ULL / 2;
+
+    pthread_mutex_lock(&cb->timer_lock);
+
+    while (cb->stopping == 0) {
+        struct timespec now = {0};
+        struct timespec wake = {0};
+        int64_t age_ms = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+        wake.tv_sec += (time_t) (interval_ns / 1000000000ULL);
+        wake.tv_nsec += (long) (interval_ns % 1000000000ULL);
+
+        if (wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
+        }
+
+        pthread_cond_timedwait(&cb->timer_cond, &cb->timer_lock, &wake);
+
+        if (cb->stopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&cb->timer_lock);
+        pthread_rwlock_wrlock(&cb->lock);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        age_ms = ((int64_t) (now.tv_sec - cb->oldest.tv_sec) * 1000) +
+                 ((now.tv_nsec - cb->oldest.tv_nsec) / 1000000);
+
+        if ((cb->pending != 0) && (age_ms >= (int64_t) cb->max_age_ms)) {
+            combine_flush_locked(cb);
+        }
+
+        pthread_rwlock_unlock(&cb->lock);
+        pthread_mutex_lock(&cb->timer_lock);
+    }
+
+    pthread_mutex_unlock(&cb->timer_lock);
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int combine_create(struct combine **cb, int fd, size_t capacity,
+                   unsigned int max_age_ms)
+{
+    struct combine *result = NULL;
+    pthread_condattr_t attr;
+
+    if ((cb == NULL) || (capacity == 0) || (max_age_ms == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct combine))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    result->alignment = file_block_size(fd);
+    result->capacity = capacity;
+
+    /* A block size that can't be lined up with isn't worth failing over. */
+    if ((result->alignment == 0) ||
+        ((result->alignment & (result->alignment - 1)) != 0)) {
+        result->alignment = 1;
+    } else if (result->alignment > MAX_ALIGNMENT) {
+        result->alignment = MAX_ALIGNMENT;
+    }
+
+    result->max_age_ms = max_age_ms;
+    pthread_rwlock_init(&result->lock, NULL);
+    pthread_mutex_init(&result->timer_lock, NULL);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&result->timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    *cb = result;
+    return 0;
+}
+
+void combine_destroy(struct combine *cb)
+{
+    if (cb == NULL) {
+        return;
+    }
+
+    combine_stop(cb);
+
+    pthread_cond_destroy(&cb->timer_cond);
+    pthread_mutex_destroy(&cb->timer_lock);
+    pthread_rwlock_destroy(&cb->lock);
+    free(cb->extents);
+    free(cb);
+}
+
+int combine_start(struct combine *cb)
+{
+    sigset_t oldset;
+    sigset_t newset;
+    int result = 0;
+
+    /* Leave signal handling to the threads that FUSE expects. */
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    result = pthread_create(&cb->flusher, NULL, combine_flusher, cb);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (result != 0) {
+        errno = result;
+        return -1;
+    }
+
+    cb->flusher_started = 1;
+    return 0;
+}
+
+void combine_stop(struct combine *cb)
+{
+    if (cb->flusher_started) {
+        pthread_mutex_lock(&cb->timer_lock);
+        cb->stopping = 1;
+        pthread_cond_signal(&cb->timer_cond);
+        pthread_mutex_unlock(&cb->timer_lock);
+
+        pthread_join(cb->flusher, NULL);
+        cb->flusher_started = 0;
+        cb->stopping = 0;
+    }
+
+    pthread_rwlock_wrlock(&cb->lock);
+    combine_flush_locked(cb);
+    pthread_rwlock_unlock(&cb->lock);
+}
+
+ssize_t combine_write(struct combine *cb, const char *buf, size_t nbyte,
+                      off_t offset)
+{
+    ssize_t result = (ssize_t) nbyte;
+
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    pthread_rwlock_wrlock(&cb->lock);
+
+    if (cb->pending == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &cb->oldest);
+    }
+
+    if (combine_insert_aligned(cb, buf, nbyte, (uint64_t) offset) != 0) {
+        /* Out of memory - fall back to writing straight through. */
+        combine_flush_locked(cb);
+
+        if (pwrite_count(cb->fd, buf, nbyte, offset) < 0) {
+            result = -1;
+        }
+    } else if (cb->pending >= cb->capacity) {
+        combine_flush_locked(cb);
+
+        if (combine_take_error(cb) != 0) {
+            result = -1;
+        }
+    }
+
+    pthread_rwlock_unlock(&cb->lock);
+    return result;
+}
+
+ssize_t combine_pread(struct combine *cb, char *buf, size_t nbyte,
+                      off_t offset)
+{
+    ssize_t result = 0;
+
+    pthread_rwlock_rdlock(&cb->lock);
+    result = combine_read_locked(cb, buf, nbyte, (uint64_t) offset);
+    pthread_rwlock_unlock(&cb->lock);
+
+    return result;
+}
+
+int combine_flush(struct combine *cb)
+{
+    int result = 0;
+
+    pthread_rwlock_wrlock(&cb->lock);
+    combine_flush_locked(cb);
+    result = combine_take_error(cb);
+    pthread_rwlock_unlock(&cb->lock);
+
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef COMBINE_H
+#define COMBINE_H
+
+#include <sys/types.h>
+
+struct combine;
+
+/* Creates a write-combining buffer in front of FD. Adjacent and overlapping
+ * writes are merged in memory, and written out once CAPACITY bytes are
+ * pending, or once the oldest pending data is MAX_AGE_MS old (if the flusher
+ * thread has been started). Writes are rounded out to FD's block size (see
+ * file_block_size()), so that what's written out covers whole blocks.
+ * Returns 0 on success, or -1 with errno set. */
+int combine_create(struct combine **cb, int fd, size_t capacity,
+                   unsigned int max_age_ms);
+
+/* Flushes anything still pending, then stops the flusher thread and frees
+ * CB. */
+void combine_destroy(struct combine *cb);
+
+/* Starts the thread that enforces MAX_AGE_MS. Returns 0 on success, or -1
+ * with errno set. */
+int combine_start(struct combine *cb);
+
+/* Stops the flusher thread (if running) after a final flush. */
+void combine_stop(struct combine *cb);
+
+/* Queues a write of NBYTE bytes at OFFSET. Returns NBYTE, or -1 with errno
+ * set if a flush that this write forced failed. */
+ssize_t combine_write(struct combine *cb, const char *buf, size_t nbyte,
+                      off_t offset);
+
+/* Reads like pread_count(), with any pending writes laid on top. */
+ssize_t combine_pread(struct combine *cb, char *buf, size_t nbyte,
+                      off_t offset);
+
+/* Writes out everything pending. Returns 0 on success. Returns -1 with errno
+ * set if this flush, or an earlier one from the flusher thread, failed. */
+int combine_flush(struct combine *cb);
+
+#endif
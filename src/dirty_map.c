@@ -0,0 +1,630 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "dirty_map.h"
+#include "file_io.h"
+
+/* Sidecar layout, all little-endian: a header with the magic, the block
+ * size, region count and state as 32-bit values (and 4 bytes of padding),
+ * then for each region its offset and size, followed by its bitmap in 64-bit
+ * words. */
+#define SIDECAR_MAGIC "PARTFSC2"
+#define HEADER_SIZE (24U)
+#define REGION_HEADER_SIZE (16U)
+#define SIDECAR_IN_USE (0U)
+#define SIDECAR_CLEAN (1U)
+
+/* Delta layout: a header, then a record header and the data for each run,
+ * ending with an all-zero record header. */
+#define DELTA_MAGIC "PARTFSD1"
+#define RECORD_SIZE (24U)
+#define EXPORT_CHUNK (1024U * 1024U)
+
+#define WORD_BITS (64U)
+
+/* Bitmap words are saved and loaded this many at a time. */
+#define WORDS_PER_CHUNK (4096U)
+#define WORD_SIZE (8U)
+
+struct dirty_map_region {
+    uint64_t offset;
+    uint64_t size;
+    size_t bits;
+    uint64_t *words;
+};
+
+/* CLEAN is set while the sidecar at PATH holds every marked block, and
+ * CHANGES counts the marks; both are only touched atomically. SAVE_LOCK
+ * keeps saves of the sidecar in order. */
+struct dirty_map {
+    size_t block_size;
+    struct dirty_map_region *regions;
+    size_t region_count;
+    int dir_fd;
+    char path[PATH_MAX];
+    int clean;
+    uint64_t changes;
+    pthread_mutex_t save_lock;
+};
+
+struct dirty_map_save {
+    struct dirty_map *dm;
+    uint32_t state;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static void dirty_map_append(char *buf, size_t size, size_t *length,
+                             const char *format, ...)
+{
+    va_list args;
+    int result = 0;
+
+    va_start(args, format);
+
+    if (*length < size) {
+        result = vsnprintf(buf + *length, size - *length, format, args);
+    } else {
+        result = vsnprintf(NULL, 0, format, args);
+    }
+
+    va_end(args);
+
+    if (result > 0) {
+        *length += (size_t) result;
+    }
+}
+
+static size_t dirty_map_word_count(const struct dirty_map_region *region)
+{
+    return (region->bits + WORD_BITS - 1) / WORD_BITS;
+}
+
+static uint64_t dirty_map_word(const struct dirty_map_region *region,
+                               size_t index)
+{
+    return __atomic_load_n(&region->words[index], __ATOMIC_RELAXED);
+}
+
+/* Finds the first run of marked blocks at or after *BIT, and stores its
+ * start and length in blocks. Returns 0 if there are no more. */
+static int dirty_map_next_run(const struct dirty_map_region *region,
+                              size_t *bit, size_t *count)
+{
+    size_t x = *bit;
+    size_t start = 0;
+
+    while (x < region->bits) {
+        uint64_t word = dirty_map_word(region, x / WORD_BITS);
+
+        if (((x % WORD_BITS) == 0) && (word == 0)) {
+            x += WORD_BITS;
+        } else if ((word >> (x % WORD_BITS)) & 1U) {
+            break;
+        } else {
+            x++;
+        }
+    }
+
+    if (x >= region->bits) {
+        return 0;
+    }
+
+    start = x;
+
+    while ((x < region->bits) &&
+           ((dirty_map_word(region, x / WORD_BITS) >> (x % WORD_BITS)) &
+            1U)) {
+        x++;
+    }
+
+    *bit = start;
+    *count = x - start;
+    return 1;
+}
+
+/* Converts a run of blocks into the bytes that it covers in REGION. */
+static void dirty_map_run_bytes(const struct dirty_map *dm,
+                                const struct dirty_map_region *region,
+                                size_t bit, size_t count, uint64_t *offset,
+                                uint64_t *length)
+{
+    *offset = (uint64_t) bit * dm->block_size;
+    *length = (uint64_t) count * dm->block_size;
+
+    if (*length > (region->size - *offset)) {
+        *length = region->size - *offset;
+    }
+}
+
+static int dirty_map_export_run(struct dirty_map *dm, int fd, char *buffer,
+                                size_t index, size_t bit, size_t count,
+                                source_read_fn read_fn, void *data)
+{
+    struct dirty_map_region *region = &dm->regions[index];
+    unsigned char record[RECORD_SIZE] = {0};
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint64_t done = 0;
+
+    dirty_map_run_bytes(dm, region, bit, count, &offset, &length);
+
+    put_le32(record, (uint32_t) index + 1);
+    put_le64(record + 8, offset);
+    put_le64(record + 16, length);
+
+    if (write_all(fd, record, RECORD_SIZE) != 0) {
+        return -1;
+    }
+
+    while (done < length) {
+        size_t chunk = EXPORT_CHUNK;
+        ssize_t result = 0;
+
+        if (chunk > (length - done)) {
+            chunk = (size_t) (length - done);
+        }
+
+        result = read_fn(data, buffer, chunk,
+                         (off_t) (region->offset + offset + done));
+
+        if (result < 0) {
+            return -1;
+        }
+
+        if ((size_t) result < chunk) {
+            memset(buffer + result, 0, chunk - (size_t) result);
+        }
+
+        if (write_all(fd, buffer, chunk) != 0) {
+            return -1;
+        }
+
+        done += chunk;
+    }
+
+    return 0;
+}
+
+/* Reads REGION's bitmap from FD at OFFSET, staging it through CHUNK. */
+static int dirty_map_load_words(struct dirty_map_region *region, int fd,
+                                off_t offset, unsigned char *chunk)
+{
+    size_t words = dirty_map_word_count(region);
+    size_t done = 0;
+    int result = 0;
+
+    while (done < words) {
+        size_t count = words - done;
+
+        if (count > WORDS_PER_CHUNK) {
+            count = WORDS_PER_CHUNK;
+        }
+
+        if ((result = pread_exact(fd, chunk, count * WORD_SIZE,
+                                  offset + (off_t) (done * WORD_SIZE))) != 0) {
+            break;
+        }
+
+        for (size_t x = 0; x < count; x++) {
+            __atomic_fetch_or(&region->words[done + x],
+                              get_le64(chunk + (x * WORD_SIZE)),
+                              __ATOMIC_RELAXED);
+        }
+
+        done += count;
+    }
+
+    return result;
+}
+
+/* Writes the whole sidecar to FD for dirty_map_store(). */
+static int dirty_map_fill(void *data, int fd)
+{
+    struct dirty_map_save *save = (struct dirty_map_save *) data;
+    struct dirty_map *dm = save->dm;
+    unsigned char *chunk = malloc(WORDS_PER_CHUNK * WORD_SIZE);
+    int result = -1;
+
+    if (chunk == NULL) {
+        return -1;
+    }
+
+    memcpy(chunk, SIDECAR_MAGIC, 8);
+    put_le32(chunk + 8, (uint32_t) dm->block_size);
+    put_le32(chunk + 12, (uint32_t) dm->region_count);
+    put_le32(chunk + 16, save->state);
+    put_le32(chunk + 20, 0);
+
+    if (write_all(fd, chunk, HEADER_SIZE) != 0) {
+        goto cleanup;
+    }
+
+    for (size_t x = 0; x < dm->region_count; x++) {
+        struct dirty_map_region *region = &dm->regions[x];
+        size_t words = dirty_map_word_count(region);
+        size_t done = 0;
+
+        put_le64(chunk, region->offset);
+        put_le64(chunk + 8, region->size);
+
+        if (write_all(fd, chunk, REGION_HEADER_SIZE) != 0) {
+            goto cleanup;
+        }
+
+        while (done < words) {
+            size_t count = words - done;
+
+            if (count > WORDS_PER_CHUNK) {
+                count = WORDS_PER_CHUNK;
+            }
+
+            for (size_t y = 0; y < count; y++) {
+                put_le64(chunk + (y * WORD_SIZE),
+                         dirty_map_word(region, done + y));
+            }
+
+            if (write_all(fd, chunk, count * WORD_SIZE) != 0) {
+                goto cleanup;
+            }
+
+            done += count;
+        }
+    }
+
+    result = 0;
+
+cleanup:
+    free(chunk);
+    return result;
+}
+
+static int dirty_map_store(struct dirty_map *dm, uint32_t state)
+{
+    struct dirty_map_save save = {dm, state};
+
+    return file_replace(dm->dir_fd, dm->path, dirty_map_fill, &save);
+}
+
+/* Marks every block of every region, for a sidecar that missed some. */
+static void dirty_map_mark_all(struct dirty_map *dm)
+{
+    for (size_t x = 0; x < dm->region_count; x++) {
+        struct dirty_map_region *region = &dm->regions[x];
+
+        for (size_t y = 0; y < region->bits; y += WORD_BITS) {
+            uint64_t word = ~0ULL;
+
+            if ((region->bits - y) < WORD_BITS) {
+                word = (1ULL << (region->bits - y)) - 1;
+            }
+
+            __atomic_fetch_or(&region->words[y / WORD_BITS], word,
+                              __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+int dirty_map_create(struct dirty_map **dm, size_t region_count,
+                     size_t block_size)
+{
+    struct dirty_map *result = NULL;
+
+    if ((dm == NULL) || (block_size == 0) || (block_size > UINT32_MAX) ||
+        (region_count > UINT32_MAX)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct dirty_map))) == NULL) {
+        return -1;
+    }
+
+    result->regions = calloc(region_count + 1,
+                             sizeof(struct dirty_map_region));
+
+    if (result->regions == NULL) {
+        free(result);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    result->block_size = block_size;
+    result->region_count = region_count;
+    result->dir_fd = -1;
+    pthread_mutex_init(&result->save_lock, NULL);
+
+    *dm = result;
+    return 0;
+}
+
+void dirty_map_destroy(struct dirty_map *dm)
+{
+    if (dm == NULL) {
+        return;
+    }
+
+    for (size_t x = 0; x < dm->region_count; x++) {
+        free(dm->regions[x].words);
+    }
+
+    pthread_mutex_destroy(&dm->save_lock);
+    free(dm->regions);
+    free(dm);
+}
+
+int dirty_map_set_region(struct dirty_map *dm, size_t index, uint64_t offset,
+                         uint64_t size)
+{
+    struct dirty_map_region *region = NULL;
+
+    if (index >= dm->region_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    region = &dm->regions[index];
+    free(region->words);
+
+    region->offset = offset;
+    region->size = size;
+    region->bits = (size_t) ((size + dm->block_size - 1) / dm->block_size);
+
+    if ((region->words = calloc(dirty_map_word_count(region) + 1,
+                                sizeof(uint64_t))) == NULL) {
+        region->bits = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+int dirty_map_load(struct dirty_map *dm, int dir_fd, const char *path)
+{
+    unsigned char header[HEADER_SIZE];
+    unsigned char *chunk = NULL;
+    off_t offset = HEADER_SIZE;
+    uint32_t state = 0;
+    int result = -1;
+    int fd = -1;
+
+    if (snprintf(dm->path, sizeof(dm->path), "%s", path) >=
+        (int) sizeof(dm->path)) {
+        dm->path[0] = '\0';
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    dm->dir_fd = dir_fd;
+    __atomic_store_n(&dm->clean, 1, __ATOMIC_SEQ_CST);
+
+    if ((fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    if ((result = pread_exact(fd, header, HEADER_SIZE, 0)) != 0) {
+        goto cleanup;
+    }
+
+    if ((memcmp(header, SIDECAR_MAGIC, 8) != 0) ||
+        (get_le32(header + 8) != dm->block_size) ||
+        (get_le32(header + 12) != dm->region_count) ||
+        ((state = get_le32(header + 16)) > SIDECAR_CLEAN)) {
+        result = 1;
+        goto cleanup;
+    }
+
+    if ((chunk = malloc(WORDS_PER_CHUNK * WORD_SIZE)) == NULL) {
+        result = -1;
+        goto cleanup;
+    }
+
+    for (size_t x = 0; (result == 0) && (x < dm->region_count); x++) {
+        struct dirty_map_region *region = &dm->regions[x];
+
+        if ((result = pread_exact(fd, chunk, REGION_HEADER_SIZE,
+                                  offset)) != 0) {
+            break;
+        }
+
+        offset += REGION_HEADER_SIZE;
+
+        if ((get_le64(chunk) != region->offset) ||
+            (get_le64(chunk + 8) != region->size)) {
+            result = 1;
+            break;
+        }
+
+        result = dirty_map_load_words(region, fd, offset, chunk);
+        offset += (off_t) (dirty_map_word_count(region) * WORD_SIZE);
+    }
+
+    /* A mount that never saved its bitmap may have written anywhere, and the
+     * sidecar already says so until the next save. */
+    if ((result == 0) && (state == SIDECAR_IN_USE)) {
+        dirty_map_mark_all(dm);
+        __atomic_store_n(&dm->clean, 0, __ATOMIC_SEQ_CST);
+    }
+
+cleanup:
+    free(chunk);
+
+    if (result > 0) {
+        errno = EINVAL;
+        result = -1;
+    }
+
+    if (result != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+int dirty_map_save(struct dirty_map *dm)
+{
+    uint64_t changes = 0;
+    int result = -1;
+
+    pthread_mutex_lock(&dm->save_lock);
+    changes = __atomic_load_n(&dm->changes, __ATOMIC_SEQ_CST);
+
+    if (dirty_map_store(dm, SIDECAR_CLEAN) != 0) {
+        goto cleanup;
+    }
+
+    /* A mark that came too late for the save either sees CLEAN and marks the
+     * sidecar in use itself, or shows up in CHANGES here. */
+    __atomic_store_n(&dm->clean, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&dm->changes, __ATOMIC_SEQ_CST) != changes) {
+        __atomic_store_n(&dm->clean, 0, __ATOMIC_SEQ_CST);
+
+        if (dirty_map_store(dm, SIDECAR_IN_USE) != 0) {
+            goto cleanup;
+        }
+    }
+
+    result = 0;
+
+cleanup:
+    pthread_mutex_unlock(&dm->save_lock);
+    return result;
+}
+
+int dirty_map_mark(struct dirty_map *dm, size_t nbyte, off_t offset)
+{
+    uint64_t start = (uint64_t) offset;
+    uint64_t stop = start + nbyte;
+    int result = 0;
+
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    for (size_t x = 0; x < dm->region_count; x++) {
+        struct dirty_map_region *region = &dm->regions[x];
+        uint64_t region_stop = region->offset + region->size;
+        size_t first = 0;
+        size_t last = 0;
+
+        if ((stop <= region->offset) || (start >= region_stop)) {
+            continue;
+        }
+
+        first = (size_t) (((start > region->offset) ? start : region->offset) -
+                          region->offset) / dm->block_size;
+        last = (size_t) (((stop < region_stop) ? stop : region_stop) - 1 -
+                         region->offset) / dm->block_size;
+
+        for (size_t y = first; y <= last; y++) {
+            __atomic_fetch_or(&region->words[y / WORD_BITS],
+                              1ULL << (y % WORD_BITS), __ATOMIC_RELAXED);
+        }
+    }
+
+    __atomic_fetch_add(&dm->changes, 1, __ATOMIC_SEQ_CST);
+
+    if ((dm->path[0] == '\0') ||
+        !__atomic_load_n(&dm->clean, __ATOMIC_SEQ_CST)) {
+        return 0;
+    }
+
+    /* The first mark since a save flags the sidecar in use, so that a crash
+     * before the next save can't pass the old bitmap off as complete. */
+    pthread_mutex_lock(&dm->save_lock);
+
+    if (__atomic_load_n(&dm->clean, __ATOMIC_SEQ_CST)) {
+        if ((result = dirty_map_store(dm, SIDECAR_IN_USE)) == 0) {
+            __atomic_store_n(&dm->clean, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    pthread_mutex_unlock(&dm->save_lock);
+    return result;
+}
+
+size_t dirty_map_format(struct dirty_map *dm, size_t index, char *buf,
+                        size_t size)
+{
+    struct dirty_map_region *region = &dm->regions[index];
+    size_t length = 0;
+    size_t bit = 0;
+    size_t count = 0;
+
+    if ((buf != NULL) && (size != 0)) {
+        buf[0] = '\0';
+    }
+
+    while (dirty_map_next_run(region, &bit, &count)) {
+        uint64_t offset = 0;
+        uint64_t run_length = 0;
+
+        dirty_map_run_bytes(dm, region, bit, count, &offset, &run_length);
+        dirty_map_append(buf, size, &length, "%llu %llu\n",
+                         (unsigned long long) offset,
+                         (unsigned long long) run_length);
+        bit += count;
+    }
+
+    return length;
+}
+
+int dirty_map_export(struct dirty_map *dm, int fd, source_read_fn read_fn,
+                     void *data)
+{
+    unsigned char header[16];
+    unsigned char end[RECORD_SIZE] = {0};
+    char *buffer = malloc(EXPORT_CHUNK);
+    int result = -1;
+
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    memcpy(header, DELTA_MAGIC, 8);
+    put_le32(header + 8, (uint32_t) dm->block_size);
+    put_le32(header + 12, (uint32_t) dm->region_count);
+
+    if (write_all(fd, header, sizeof(header)) != 0) {
+        goto cleanup;
+    }
+
+    for (size_t x = 0; x < dm->region_count; x++) {
+        size_t bit = 0;
+        size_t count = 0;
+
+        while (dirty_map_next_run(&dm->regions[x], &bit, &count)) {
+            if (dirty_map_export_run(dm, fd, buffer, x, bit, count, read_fn,
+                                     data) != 0) {
+                goto cleanup;
+            }
+
+            bit += count;
+        }
+    }
+
+    result = write_all(fd, end, RECORD_SIZE);
+
+cleanup:
+    free(buffer);
+    return result;
+}
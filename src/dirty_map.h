@@ -0,0 +1,50 @@
+#ifndef DIRTY_MAP_H
+#define DIRTY_MAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+
+struct dirty_map;
+
+/* Creates a bitmap of changed blocks for REGION_COUNT regions of SOURCE, in
+ * blocks of BLOCK_SIZE bytes. Returns 0 on success, or -1 with errno set. */
+int dirty_map_create(struct dirty_map **dm, size_t region_count,
+                     size_t block_size);
+
+void dirty_map_destroy(struct dirty_map *dm);
+
+/* Sets region INDEX to the SIZE bytes at SOURCE offset OFFSET, with no blocks
+ * marked. */
+int dirty_map_set_region(struct dirty_map *dm, size_t index, uint64_t offset,
+                         uint64_t size);
+
+/* Marks the blocks saved in PATH (relative to DIR_FD) again, and keeps the
+ * bitmap in PATH from then on. A missing file is fine, but one saved for
+ * different regions or a different block size fails with EINVAL, rather
+ * than losing track of its changes. One that was still in use (after a
+ * crash) marks every block. */
+int dirty_map_load(struct dirty_map *dm, int dir_fd, const char *path);
+
+/* Replaces the loaded PATH with the current bitmap. Safe to call from
+ * several threads. Returns 0, or -1 with errno set. */
+int dirty_map_save(struct dirty_map *dm);
+
+/* Marks every block that overlaps [OFFSET, OFFSET + NBYTE) of SOURCE. Call it
+ * before writing them: the first mark after a save flags PATH in use first.
+ * Returns 0, or -1 with errno set if that failed. */
+int dirty_map_mark(struct dirty_map *dm, size_t nbyte, off_t offset);
+
+/* Formats region INDEX's runs of marked blocks into BUF like snprintf(), as
+ * one "OFFSET LENGTH" line each, relative to the start of the region.
+ * Returns the full length. */
+size_t dirty_map_format(struct dirty_map *dm, size_t index, char *buf,
+                        size_t size);
+
+/* Writes every run of marked blocks to FD as a delta (see the man page),
+ * reading the data with READ_FN. Returns 0, or -1 with errno set. */
+int dirty_map_export(struct dirty_map *dm, int fd, source_read_fn read_fn,
+                     void *data);
+
+#endif
@@ -0,0 +1,573 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "disk_label.h"
+#include "file_io.h"
+
+/* The MBR, and a GPT header at LBA 1 for 512- and 4096-byte sectors. */
+#define HEAD_SIZE (8192U)
+#define MBR_SIZE (512U)
+#define MBR_DISK_ID (440U)
+#define MBR_TABLE (446U)
+#define MBR_ENTRY_SIZE (16U)
+#define MBR_SIGNATURE (0xAA55U)
+#define MBR_PROTECTIVE (0xEEU)
+
+/* EBR chains are walked this far at most, so that a loop ends. */
+#define MAX_LOGICAL (256U)
+
+#define GPT_SIGNATURE "EFI PART"
+#define GPT_HEADER_MIN (92U)
+#define GPT_ENTRY_MIN (128U)
+#define GPT_NAME_UNITS (36U)
+#define MAX_GPT_ENTRIES (1024U * 1024U)
+
+#define UUID_LENGTH (36U)
+
+struct label_entry {
+    uint64_t start;
+    uint64_t length;
+    char name[(GPT_NAME_UNITS * 3) + 1];
+    char uuid[UUID_LENGTH + 1];
+    char type[UUID_LENGTH + 1];
+};
+
+struct label_list {
+    struct label_entry *entries;
+    size_t count;
+    size_t alloc;
+};
+
+struct type_name {
+    const char *key;
+    const char *name;
+};
+
+/* Names as libfdisk gives them, so that --print-partitions doesn't change
+ * with the parser that read the table. */
+static const struct type_name gpt_types[] = {
+    {"C12A7328-F81F-11D2-BA4B-00A0C93EC93B", "EFI System"},
+    {"21686148-6449-6E6F-744E-656564454649", "BIOS boot"},
+    {"0FC63DAF-8483-4772-8E79-3D69D8477DE4", "Linux filesystem"},
+    {"0657FD6D-A4AB-43C4-84E5-0933C84B4F4F", "Linux swap"},
+    {"E6D6D379-F507-44C2-A23C-238F2A3DF928", "Linux LVM"},
+    {"A19D880F-05FC-4D3B-A006-743F0F84911E", "Linux RAID"},
+    {"4F68BCE3-E8CD-4DB1-96E7-FBCAF984B709", "Linux root (x86-64)"},
+    {"B921B045-1DF0-41C3-AF44-4C6F280D3FAE", "Linux root (ARM-64)"},
+    {"BC13C2FF-59E6-4262-A352-B275FD6F7172", "Linux extended boot"},
+    {"933AC7E1-2EB4-4F13-B844-0E14E2AEF915", "Linux home"},
+    {"EBD0A0A2-B9E5-4433-87C0-68B6B72699C7", "Microsoft basic data"},
+    {"E3C9E316-0B5C-4DB8-817D-F92DF00215AE", "Microsoft reserved"},
+    {"DE94BBA4-06D1-4D40-A16A-BFD50179D6AC", "Windows recovery environment"},
+    {"48465300-0000-11AA-AA11-00306543ECAC", "Apple HFS/HFS+"},
+    {"7C3457EF-0000-11AA-AA11-00306543ECAC", "Apple APFS"},
+};
+
+static const struct type_name mbr_types[] = {
+    {"\x01", "FAT12"},
+    {"\x04", "FAT16 <32M"},
+    {"\x05", "Extended"},
+    {"\x06", "FAT16"},
+    {"\x07", "HPFS/NTFS/exFAT"},
+    {"\x0b", "W95 FAT32"},
+    {"\x0c", "W95 FAT32 (LBA)"},
+    {"\x0e", "W95 FAT16 (LBA)"},
+    {"\x0f", "W95 Ext'd (LBA)"},
+    {"\x82", "Linux swap / Solaris"},
+    {"\x83", "Linux"},
+    {"\x85", "Linux extended"},
+    {"\x8e", "Linux LVM"},
+    {"\xee", "GPT"},
+    {"\xef", "EFI (FAT-12/16/32)"},
+    {"\xfd", "Linux raid autodetect"},
+};
+
+/* CRC-32 (as used by GPT and zlib), four bits at a time. */
+static const uint32_t crc_nibbles[16] = {
+    0x00000000U, 0x1DB71064U, 0x3B6E20C8U, 0x26D930ACU,
+    0x76DC4190U, 0x6B6B51F4U, 0x4DB26158U, 0x5005713CU,
+    0xEDB88320U, 0xF00F9344U, 0xD6D6A3E8U, 0xCB61B38CU,
+    0x9B64C2B0U, 0x86D3D2D4U, 0xA00AE278U, 0xBDBDF21CU
+};
+
+/*----------------------------------------------------------------------------*/
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *data,
+                             size_t length)
+{
+    for (size_t x = 0; x < length; x++) {
+        crc ^= data[x];
+        crc = (crc >> 4U) ^ crc_nibbles[crc & 0x0FU];
+        crc = (crc >> 4U) ^ crc_nibbles[crc & 0x0FU];
+    }
+
+    return crc;
+}
+
+static int read_exact(source_read_fn read_fn, void *data, void *buf,
+                      size_t nbyte, uint64_t offset)
+{
+    ssize_t result = read_fn(data, buf, nbyte, (off_t) offset);
+
+    return ((result < 0) || ((size_t) result != nbyte)) ? -1 : 0;
+}
+
+/* Formats a GUID the way it's usually written, with the first three fields
+ * stored little-endian. */
+static void format_guid(const unsigned char *guid, char *out)
+{
+    snprintf(out, UUID_LENGTH + 1,
+             "%08" PRIX32 "-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+             get_le32(guid), (unsigned int) get_le16(guid + 4),
+             (unsigned int) get_le16(guid + 6), guid[8], guid[9], guid[10],
+             guid[11], guid[12], guid[13], guid[14], guid[15]);
+}
+
+/* Converts a GPT name from UTF-16LE, up to its first NUL. Anything that
+ * isn't valid UTF-16 becomes U+FFFD. */
+static void convert_name(const unsigned char *in, char *out)
+{
+    size_t length = 0;
+
+    for (size_t x = 0; x < GPT_NAME_UNITS; x++) {
+        uint32_t code = get_le16(in + (x * 2));
+
+        if (code == 0) {
+            break;
+        }
+
+        if ((code >= 0xD800U) && (code < 0xDC00U) &&
+            ((x + 1) < GPT_NAME_UNITS) &&
+            (get_le16(in + ((x + 1) * 2)) >= 0xDC00U) &&
+            (get_le16(in + ((x + 1) * 2)) < 0xE000U)) {
+            code = 0x10000U + ((code - 0xD800U) << 10U) +
+                   (get_le16(in + ((x + 1) * 2)) - 0xDC00U);
+            x++;
+        } else if ((code >= 0xD800U) && (code < 0xE000U)) {
+            code = 0xFFFDU;
+        }
+
+        if (code < 0x80U) {
+            out[length++] = (char) code;
+        } else if (code < 0x800U) {
+            out[length++] = (char) (0xC0U | (code >> 6U));
+            out[length++] = (char) (0x80U | (code & 0x3FU));
+        } else if (code < 0x10000U) {
+            out[length++] = (char) (0xE0U | (code >> 12U));
+            out[length++] = (char) (0x80U | ((code >> 6U) & 0x3FU));
+            out[length++] = (char) (0x80U | (code & 0x3FU));
+        } else {
+            out[length++] = (char) (0xF0U | (code >> 18U));
+            out[length++] = (char) (0x80U | ((code >> 12U) & 0x3FU));
+            out[length++] = (char) (0x80U | ((code >> 6U) & 0x3FU));
+            out[length++] = (char) (0x80U | (code & 0x3FU));
+        }
+    }
+
+    out[length] = '\0';
+}
+
+static struct label_entry * label_append(struct label_list *list,
+                                         uint64_t start, uint64_t length)
+{
+    struct label_entry *entry = NULL;
+
+    if (list->count == list->alloc) {
+        size_t alloc = (list->alloc == 0) ? 16 : (list->alloc * 2);
+        void *entries = realloc(list->entries,
+                                alloc * sizeof(struct label_entry));
+
+        if (entries == NULL) {
+            return NULL;
+        }
+
+        list->entries = entries;
+        list->alloc = alloc;
+    }
+
+    entry = &list->entries[list->count++];
+    memset(entry, 0, sizeof(struct label_entry));
+    entry->start = start;
+    entry->length = length;
+    return entry;
+}
+
+static int mbr_is_extended(unsigned int type)
+{
+    return (type == 0x05U) || (type == 0x0FU) || (type == 0x85U);
+}
+
+/* Adds the partition in the 16-byte MBR entry at RAW, whose start counts
+ * from sector BASE. Empty entries are skipped. */
+static int mbr_add_entry(struct label_list *list, const unsigned char *raw,
+                         uint64_t base, uint32_t disk_id,
+                         unsigned int number)
+{
+    struct label_entry *entry = NULL;
+    uint64_t start = base + get_le32(raw + 8);
+    uint64_t length = get_le32(raw + 12);
+
+    if ((raw[4] == 0) || (length == 0)) {
+        return 0;
+    }
+
+    if ((entry = label_append(list, start * MBR_SIZE,
+                              length * MBR_SIZE)) == NULL) {
+        return FDISK_ALLOC_FAILURE;
+    }
+
+    /* The PARTUUID that blkid makes up for MBR partitions. */
+    snprintf(entry->uuid, sizeof(entry->uuid), "%08" PRIx32 "-%02x", disk_id,
+             number);
+    snprintf(entry->type, sizeof(entry->type), "0x%02x", raw[4]);
+
+    for (size_t x = 0; x < (sizeof(mbr_types) / sizeof(mbr_types[0])); x++) {
+        if ((unsigned char) mbr_types[x].key[0] == raw[4]) {
+            snprintf(entry->type, sizeof(entry->type), "%s",
+                     mbr_types[x].name);
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/* Reads the four primary entries of MBR, then the logical partitions in the
+ * EBR chain of the first extended one. Numbering follows fdisk: primaries
+ * are 1 to 4 by slot, and logical partitions start at 5. */
+static int mbr_parse(source_read_fn read_fn, void *data,
+                     const unsigned char *mbr, struct label_list *list)
+{
+    uint32_t disk_id = get_le32(mbr + MBR_DISK_ID);
+    uint64_t extended = 0;
+    uint64_t ebr = 0;
+    unsigned int number = 5;
+    int result = 0;
+
+    for (unsigned int x = 0; x < 4; x++) {
+        const unsigned char *raw = mbr + MBR_TABLE + (x * MBR_ENTRY_SIZE);
+
+        if ((result = mbr_add_entry(list, raw, 0, disk_id, x + 1)) != 0) {
+            return result;
+        }
+
+        if ((extended == 0) && mbr_is_extended(raw[4]) &&
+            (get_le32(raw + 12) != 0)) {
+            extended = get_le32(raw + 8);
+        }
+    }
+
+    ebr = extended;
+
+    for (unsigned int x = 0; (extended != 0) && (x < MAX_LOGICAL); x++) {
+        unsigned char sector[MBR_SIZE];
+        const unsigned char *link = sector + MBR_TABLE + MBR_ENTRY_SIZE;
+        uint64_t next = 0;
+
+        /* A chain that runs off the image or into garbage just ends, the
+         * way fdisk reads it. */
+        if ((read_exact(read_fn, data, sector, MBR_SIZE,
+                        ebr * MBR_SIZE) != 0) ||
+            (get_le16(sector + 510) != MBR_SIGNATURE)) {
+            break;
+        }
+
+        /* Only EBRs that hold a partition use up a number. */
+        if ((sector[MBR_TABLE + 4] != 0) &&
+            (get_le32(sector + MBR_TABLE + 12) != 0) &&
+            ((result = mbr_add_entry(list, sector + MBR_TABLE, ebr, disk_id,
+                                     number++)) != 0)) {
+            return result;
+        }
+
+        if (!mbr_is_extended(link[4]) || (get_le32(link + 12) == 0)) {
+            break;
+        }
+
+        /* Links count from the start of the extended partition. */
+        next = extended + get_le32(link + 8);
+
+        if (next == ebr) {
+            break;
+        }
+
+        ebr = next;
+    }
+
+    return 0;
+}
+
+/* Checks the GPT header at LBA (in SECTOR-byte sectors) and its entries,
+ * and adds the used entries. HEAD holds the first HEAD_LENGTH bytes of the
+ * image, which saves a read for the primary header. */
+static int gpt_load(source_read_fn read_fn, void *data, uint64_t size,
+                    const unsigned char *head, size_t head_length,
+                    uint32_t sector, uint64_t lba, struct label_list *list)
+{
+    unsigned char header[4096];
+    unsigned char *entries = NULL;
+    uint64_t sectors = size / sector;
+    uint64_t entries_lba = 0;
+    uint32_t header_size = 0;
+    uint32_t header_crc = 0;
+    uint32_t entry_count = 0;
+    uint32_t entry_size = 0;
+    size_t entries_size = 0;
+    int result = FDISK_CORRUPT_PARTITION;
+
+    if ((lba + 1) > sectors) {
+        return FDISK_CORRUPT_PARTITION;
+    }
+
+    if (((lba + 1) * sector) <= head_length) {
+        memcpy(header, head + (lba * sector), sector);
+    } else if (read_exact(read_fn, data, header, sector, lba * sector) != 0) {
+        return FDISK_ACCESS_DEVICE;
+    }
+
+    header_size = get_le32(header + 12);
+    header_crc = get_le32(header + 16);
+    entries_lba = get_le64(header + 72);
+    entry_count = get_le32(header + 80);
+    entry_size = get_le32(header + 84);
+
+    if ((memcmp(header, GPT_SIGNATURE, 8) != 0) ||
+        (header_size < GPT_HEADER_MIN) || (header_size > sector) ||
+        (get_le64(header + 24) != lba)) {
+        return FDISK_CORRUPT_PARTITION;
+    }
+
+    /* The header's CRC covers itself as zero. */
+    memset(header + 16, 0, 4);
+
+    if ((~crc32_update(~0U, header, header_size) != header_crc) ||
+        (entry_size < GPT_ENTRY_MIN) || ((entry_size % GPT_ENTRY_MIN) != 0) ||
+        (entry_count > (MAX_GPT_ENTRIES / entry_size)) ||
+        (entries_lba >= sectors)) {
+        return FDISK_CORRUPT_PARTITION;
+    }
+
+    entries_size = (size_t) entry_count * entry_size;
+
+    if (entries_size > ((sectors - entries_lba) * sector)) {
+        return FDISK_CORRUPT_PARTITION;
+    }
+
+    if ((entries = malloc(entries_size + 1)) == NULL) {
+        return FDISK_ALLOC_FAILURE;
+    }
+
+    if (read_exact(read_fn, data, entries, entries_size,
+                   entries_lba * sector) != 0) {
+        result = FDISK_ACCESS_DEVICE;
+        goto cleanup;
+    }
+
+    if (~crc32_update(~0U, entries, entries_size) != get_le32(header + 88)) {
+        goto cleanup;
+    }
+
+    for (uint32_t x = 0; x < entry_count; x++) {
+        static const unsigned char unused[16] = {0};
+        const unsigned char *raw = entries + ((size_t) x * entry_size);
+        uint64_t first = get_le64(raw + 32);
+        uint64_t last = get_le64(raw + 40);
+        struct label_entry *entry = NULL;
+
+        if (memcmp(raw, unused, sizeof(unused)) == 0) {
+            continue;
+        }
+
+        if ((first > last) || (last >= sectors)) {
+            goto cleanup;
+        }
+
+        if ((entry = label_append(list, first * sector,
+                                  (last - first + 1) * sector)) == NULL) {
+            result = FDISK_ALLOC_FAILURE;
+            goto cleanup;
+        }
+
+        format_guid(raw + 16, entry->uuid);
+        format_guid(raw, entry->type);
+        convert_name(raw + 56, entry->name);
+
+        for (size_t y = 0; y < (sizeof(gpt_types) / sizeof(gpt_types[0]));
+             y++) {
+            if (strcmp(gpt_types[y].key, entry->type) == 0) {
+                snprintf(entry->type, sizeof(entry->type), "%s",
+                         gpt_types[y].name);
+                break;
+            }
+        }
+    }
+
+    result = 0;
+
+cleanup:
+    /* Entries from a copy that didn't check out mustn't mix with the other
+     * copy's. */
+    if (result != 0) {
+        list->count = 0;
+    }
+
+    free(entries);
+    return result;
+}
+
+/* Reads the primary GPT, or the backup in the image's last sector if the
+ * primary one is damaged. The sector size is whichever of 512 and 4096 has a
+ * header at LBA 1. */
+static int gpt_parse(source_read_fn read_fn, void *data, uint64_t size,
+                     const unsigned char *head, size_t head_length,
+                     struct label_list *list)
+{
+    static const uint32_t sector_sizes[] = {512U, 4096U};
+    int result = FDISK_CORRUPT_PARTITION;
+
+    for (size_t x = 0; (result != 0) && (x < 2); x++) {
+        uint32_t sector = sector_sizes[x];
+
+        if (((sector * 2) <= head_length) &&
+            (memcmp(head + sector, GPT_SIGNATURE, 8) == 0)) {
+            result = gpt_load(read_fn, data, size, head, head_length, sector,
+                              1, list);
+        }
+    }
+
+    for (size_t x = 0; (result != 0) && (x < 2); x++) {
+        uint32_t sector = sector_sizes[x];
+
+        if ((result != FDISK_ALLOC_FAILURE) && ((size / sector) > 2)) {
+            result = gpt_load(read_fn, data, size, head, head_length, sector,
+                              (size / sector) - 1, list);
+        }
+    }
+
+    return result;
+}
+
+/* Moves LIST into one allocation laid out like partition_read_table()'s. */
+static int label_pack(struct label_list *list, struct part_info **table)
+{
+    size_t pool_size = 1;
+    char *pool = NULL;
+
+    for (size_t x = 0; x < list->count; x++) {
+        pool_size += strlen(list->entries[x].name) + 1;
+        pool_size += strlen(list->entries[x].uuid) + 1;
+        pool_size += strlen(list->entries[x].type) + 1;
+    }
+
+    *table = malloc((list->count * sizeof(struct part_info)) + pool_size);
+
+    if (*table == NULL) {
+        return FDISK_ALLOC_FAILURE;
+    }
+
+    pool = (char *) (*table + list->count);
+
+    for (size_t x = 0; x < list->count; x++) {
+        struct label_entry *entry = &list->entries[x];
+        struct part_info *info = &(*table)[x];
+        const char *fields[3] = {entry->name, entry->uuid, entry->type};
+        char **targets[3] = {&info->name, &info->uuid, &info->type};
+
+        info->start = (off_t) entry->start;
+        info->length = (off_t) entry->length;
+
+        for (size_t y = 0; y < 3; y++) {
+            size_t length = strlen(fields[y]) + 1;
+
+            memcpy(pool, fields[y], length);
+            *targets[y] = pool;
+            pool += length;
+        }
+    }
+
+    return (int) list->count;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int disk_label_read(source_read_fn read_fn, void *data, uint64_t size,
+                    struct part_info **table)
+{
+    unsigned char head[HEAD_SIZE];
+    struct label_list list = {0};
+    ssize_t head_length = 0;
+    int protective = 0;
+    int result = 0;
+
+    if ((read_fn == NULL) || (table == NULL)) {
+        return FDISK_NULL_PTR;
+    }
+
+    *table = NULL;
+
+    if (size < HEAD_SIZE) {
+        head_length = read_fn(data, (char *) head, (size_t) size, 0);
+    } else {
+        head_length = read_fn(data, (char *) head, HEAD_SIZE, 0);
+    }
+
+    if (head_length < 0) {
+        return FDISK_ACCESS_DEVICE;
+    }
+
+    if ((head_length < (ssize_t) MBR_SIZE) ||
+        (get_le16(head + 510) != MBR_SIGNATURE)) {
+        return FDISK_READ_PARTITIONS;
+    }
+
+    /* Boot flags other than these mean that the sector is a boot record of
+     * some other kind, such as a FAT filesystem's. */
+    for (unsigned int x = 0; x < 4; x++) {
+        const unsigned char *raw = head + MBR_TABLE + (x * MBR_ENTRY_SIZE);
+
+        if ((raw[0] != 0x00U) && (raw[0] != 0x80U)) {
+            return FDISK_READ_PARTITIONS;
+        }
+
+        protective |= (raw[4] == MBR_PROTECTIVE);
+    }
+
+    if (protective) {
+        result = gpt_parse(read_fn, data, size, head, (size_t) head_length,
+                           &list);
+    } else {
+        result = mbr_parse(read_fn, data, head, &list);
+    }
+
+    if (result == 0) {
+        result = label_pack(&list, table);
+    }
+
+    free(list.entries);
+    return result;
+}
+
+int disk_label_find(const struct part_info *table, int count,
+                    const char *name, const char *uuid)
+{
+    for (int x = 0; x < count; x++) {
+        if (((name != NULL) && (strcmp(table[x].name, name) == 0)) ||
+            ((uuid != NULL) && (strcasecmp(table[x].uuid, uuid) == 0))) {
+            return x;
+        }
+    }
+
+    return -1;
+}
+
+void partition_dealloc_table(struct part_info *table)
+{
+    free(table);
+}
@@ -0,0 +1,26 @@
+#ifndef DISK_LABEL_H
+#define DISK_LABEL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fdisk_access.h"
+#include "file_io.h"
+
+/* Reads the GPT, or the MBR and the EBR chain of its extended partition, of
+ * a SIZE-byte image through READ_FN, in a few small reads. GPT headers and
+ * entries are checked against their CRCs, and the backup GPT at the end of
+ * the image is used if the primary one doesn't check out. Entries come back
+ * the way partition_read_table() returns them. Returns
+ * FDISK_READ_PARTITIONS if there's no MBR or GPT to read, or
+ * FDISK_CORRUPT_PARTITION if neither GPT copy is intact. */
+int disk_label_read(source_read_fn read_fn, void *data, uint64_t size,
+                    struct part_info **table);
+
+/* Returns the index of the first of COUNT entries in TABLE that's named
+ * NAME, or whose UUID is UUID (in any case), or -1 if there isn't one.
+ * Either of NAME and UUID may be NULL. */
+int disk_label_find(const struct part_info *table, int count,
+                    const char *name, const char *uuid);
+
+#endif
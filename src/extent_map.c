@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "extent_map.h"
+
+/* Marks an extent that isn't backed by FD. */
+#define HOLE (UINT64_MAX)
+
+#define FIEMAP_BATCH (256U)
+
+/* Extents without a plain, aligned physical location can't be read through
+ * FD. */
+#define FIEMAP_UNSUPPORTED (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | \
+                            FIEMAP_EXTENT_ENCODED | \
+                            FIEMAP_EXTENT_DATA_ENCRYPTED | \
+                            FIEMAP_EXTENT_NOT_ALIGNED | \
+                            FIEMAP_EXTENT_DATA_INLINE | \
+                            FIEMAP_EXTENT_DATA_TAIL)
+
+struct extent {
+    uint64_t offset;
+    uint64_t source_offset;
+    uint64_t length;
+};
+
+struct extent_map {
+    int fd;
+    uint64_t source_size;
+    struct extent *extents;
+    size_t extent_count;
+    size_t extent_alloc;
+    uint64_t size;
+};
+
+/*----------------------------------------------------------------------------*/
+
+static int extent_append(struct extent_map *em, uint64_t source_offset,
+                         uint64_t length)
+{
+    struct extent *last = NULL;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    if ((length > (UINT64_MAX - em->size)) ||
+        ((source_offset != HOLE) &&
+         ((source_offset > em->source_size) ||
+          (length > (em->source_size - source_offset))))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (em->extent_count != 0) {
+        last = &em->extents[em->extent_count - 1];
+
+        /* Keep the table short where the list is more contiguous than it
+         * was written down. */
+        if (((last->source_offset == HOLE) && (source_offset == HOLE)) ||
+            ((last->source_offset != HOLE) && (source_offset != HOLE) &&
+             ((last->source_offset + last->length) == source_offset))) {
+            last->length += length;
+            em->size += length;
+            return 0;
+        }
+    }
+
+    if (em->extent_count == em->extent_alloc) {
+        size_t alloc = (em->extent_alloc == 0) ? 64 : (em->extent_alloc * 2);
+        void *extents = realloc(em->extents, alloc * sizeof(struct extent));
+
+        if (extents == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        em->extents = extents;
+        em->extent_alloc = alloc;
+    }
+
+    em->extents[em->extent_count].offset = em->size;
+    em->extents[em->extent_count].source_offset = source_offset;
+    em->extents[em->extent_count].length = length;
+    em->extent_count++;
+    em->size += length;
+    return 0;
+}
+
+/* Returns the extent that holds byte OFFSET, which has to be inside the
+ * map. */
+static struct extent * extent_find(const struct extent_map *em,
+                                   uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = em->extent_count;
+
+    while ((high - low) > 1) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (em->extents[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return &em->extents[low];
+}
+
+static int extent_parse_line(struct extent_map *em, char *line)
+{
+    unsigned long long source_offset = 0;
+    unsigned long long length = 0;
+    char *end = NULL;
+
+    while ((*line == ' ') || (*line == '\t')) {
+        line++;
+    }
+
+    if ((*line == '\0') || (*line == '#')) {
+        return 0;
+    }
+
+    errno = 0;
+    source_offset = strtoull(line, &end, 0);
+
+    if ((errno != 0) || (end == line) || (*line == '-')) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    line = end;
+    length = strtoull(line, &end, 0);
+
+    if ((errno != 0) || (end == line) || (length == 0) ||
+        (strchr(line, '-') != NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while ((*end == ' ') || (*end == '\t') || (*end == '\r')) {
+        end++;
+    }
+
+    if (*end != '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return extent_append(em, source_offset, length);
+}
+
+/*----------------------------------------------------------------------------*/
+
+int extent_map_create(struct extent_map **em, int fd, uint64_t source_size)
+{
+    struct extent_map *result = NULL;
+
+    if (em == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct extent_map))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    result->source_size = source_size;
+
+    *em = result;
+    return 0;
+}
+
+void extent_map_destroy(struct extent_map *em)
+{
+    if (em == NULL) {
+        return;
+    }
+
+    free(em->extents);
+    free(em);
+}
+
+int extent_map_load(struct extent_map *em, int dir_fd, const char *path)
+{
+    FILE *file = NULL;
+    char *line = NULL;
+    size_t line_alloc = 0;
+    ssize_t length = 0;
+    int result = 0;
+    int error = 0;
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if ((file = fdopen(fd, "r")) == NULL) {
+        error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    while ((length = getline(&line, &line_alloc, file)) >= 0) {
+        if ((length != 0) && (line[length - 1] == '\n')) {
+            line[length - 1] = '\0';
+        }
+
+        if ((result = extent_parse_line(em, line)) != 0) {
+            break;
+        }
+    }
+
+    if ((result == 0) && ferror(file)) {
+        result = -1;
+    }
+
+    error = errno;
+    free(line);
+    fclose(file);
+    errno = error;
+    return result;
+}
+
+int extent_map_fiemap(struct extent_map *em, int dir_fd, const char *path)
+{
+    struct fiemap *map = NULL;
+    struct stat stat_buffer = {0};
+    uint64_t pos = 0;
+    int result = -1;
+    int done = 0;
+    int error = 0;
+    int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (fstat(fd, &stat_buffer) != 0) {
+        goto cleanup;
+    }
+
+    map = malloc(sizeof(struct fiemap) +
+                 (FIEMAP_BATCH * sizeof(struct fiemap_extent)));
+
+    if (map == NULL) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    while (!done && (pos < (uint64_t) stat_buffer.st_size)) {
+        uint64_t batch_start = pos;
+
+        memset(map, 0, sizeof(struct fiemap));
+        map->fm_start = pos;
+        map->fm_length = (uint64_t) stat_buffer.st_size - pos;
+        map->fm_flags = FIEMAP_FLAG_SYNC;
+        map->fm_extent_count = FIEMAP_BATCH;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, map) < 0) {
+            goto cleanup;
+        }
+
+        if (map->fm_mapped_extents == 0) {
+            break;
+        }
+
+        for (unsigned int x = 0; x < map->fm_mapped_extents; x++) {
+            struct fiemap_extent *extent = &map->fm_extents[x];
+            uint64_t start = extent->fe_logical;
+            uint64_t physical = extent->fe_physical;
+            uint64_t stop = start + extent->fe_length;
+
+            if (extent->fe_flags & FIEMAP_EXTENT_LAST) {
+                done = 1;
+            }
+
+            if (extent->fe_flags & FIEMAP_UNSUPPORTED) {
+                errno = ENOTSUP;
+                goto cleanup;
+            }
+
+            /* The first extent may start before the range asked for. */
+            if (start < pos) {
+                physical += pos - start;
+                start = pos;
+            }
+
+            if (stop > (uint64_t) stat_buffer.st_size) {
+                stop = (uint64_t) stat_buffer.st_size;
+            }
+
+            if (stop <= start) {
+                continue;
+            }
+
+            if ((extent_append(em, HOLE, start - pos) != 0) ||
+                (extent_append(em, (extent->fe_flags &
+                                    FIEMAP_EXTENT_UNWRITTEN) ? HOLE : physical,
+                               stop - start) != 0)) {
+                goto cleanup;
+            }
+
+            pos = stop;
+        }
+
+        if (pos == batch_start) {
+            break;
+        }
+    }
+
+    /* Anything after the last extent is a hole. */
+    if ((pos < (uint64_t) stat_buffer.st_size) &&
+        (extent_append(em, HOLE, (uint64_t) stat_buffer.st_size - pos) != 0)) {
+        goto cleanup;
+    }
+
+    result = 0;
+
+cleanup:
+    error = errno;
+    free(map);
+    close(fd);
+    errno = error;
+    return result;
+}
+
+uint64_t extent_map_size(struct extent_map *em)
+{
+    return em->size;
+}
+
+ssize_t extent_map_pread(struct extent_map *em, char *buf, size_t nbyte,
+                         off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    if (stop > em->size) {
+        stop = em->size;
+    }
+
+    while (pos < stop) {
+        struct extent *extent = extent_find(em, pos);
+        uint64_t skip = pos - extent->offset;
+        size_t wanted = (size_t) (extent->length - skip);
+        char *dest = buf + (pos - (uint64_t) offset);
+        ssize_t result = 0;
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        if (extent->source_offset == HOLE) {
+            memset(dest, 0, wanted);
+            pos += wanted;
+            continue;
+        }
+
+        result = pread(em->fd, dest, wanted,
+                       (off_t) (extent->source_offset + skip));
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (pos == (uint64_t) offset) {
+                return -1;
+            }
+            break;
+        }
+
+        if (result == 0) {
+            /* SOURCE shrank since the extents were checked. */
+            break;
+        }
+
+        pos += (uint64_t) result;
+    }
+
+    return (ssize_t) (pos - (uint64_t) offset);
+}
+
+ssize_t extent_map_pwrite(struct extent_map *em, const char *buf,
+                          size_t nbyte, off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    if (stop > em->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    while (pos < stop) {
+        struct extent *extent = extent_find(em, pos);
+        uint64_t skip = pos - extent->offset;
+        size_t wanted = (size_t) (extent->length - skip);
+        ssize_t result = 0;
+
+        if (extent->source_offset == HOLE) {
+            errno = ENOSPC;
+            return -1;
+        }
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        result = pwrite(em->fd, buf + (pos - (uint64_t) offset), wanted,
+                        (off_t) (extent->source_offset + skip));
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        pos += (uint64_t) result;
+    }
+
+    return (ssize_t) nbyte;
+}
+
+int extent_map_fallocate(struct extent_map *em, int mode, off_t offset,
+                         off_t length)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + (uint64_t) length;
+    int clear = mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE);
+
+    if (stop > em->size) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    while (pos < stop) {
+        struct extent *extent = extent_find(em, pos);
+        uint64_t skip = pos - extent->offset;
+        uint64_t wanted = extent->length - skip;
+
+        if (wanted > (stop - pos)) {
+            wanted = stop - pos;
+        }
+
+        if (extent->source_offset == HOLE) {
+            if (!clear) {
+                errno = ENOSPC;
+                return -1;
+            }
+        } else if (fallocate(em->fd, mode,
+                             (off_t) (extent->source_offset + skip),
+                             (off_t) wanted) < 0) {
+            return -1;
+        }
+
+        pos += wanted;
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef EXTENT_MAP_H
+#define EXTENT_MAP_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct extent_map;
+
+/* Creates an empty list of extents of FD, which is SOURCE_SIZE bytes long.
+ * Returns 0 on success, or -1 with errno set. */
+int extent_map_create(struct extent_map **em, int fd, uint64_t source_size);
+
+void extent_map_destroy(struct extent_map *em);
+
+/* Reads extents from the text file PATH (relative to DIR_FD), one
+ * "OFFSET LENGTH" pair of FD offsets per line, and appends them in order.
+ * Blank lines and lines starting with '#' are skipped. Returns 0, or -1
+ * with errno set (EINVAL if a line doesn't parse or an extent runs past the
+ * end of FD). */
+int extent_map_load(struct extent_map *em, int dir_fd, const char *path);
+
+/* Appends the extents of the file PATH (relative to DIR_FD), as reported by
+ * FIEMAP, taking their physical offsets as offsets into FD. Holes and
+ * unwritten extents read as zeros. Returns 0, or -1 with errno set (ENOTSUP
+ * if the file has extents without a plain physical location). */
+int extent_map_fiemap(struct extent_map *em, int dir_fd, const char *path);
+
+/* Returns the combined length of the extents. */
+uint64_t extent_map_size(struct extent_map *em);
+
+/* Reads like pread_count() from the extents laid end to end. */
+ssize_t extent_map_pread(struct extent_map *em, char *buf, size_t nbyte,
+                         off_t offset);
+
+/* Writes like pwrite_count(), splitting the write at extent boundaries.
+ * Writes into holes, or past the last extent, fail with ENOSPC. */
+ssize_t extent_map_pwrite(struct extent_map *em, const char *buf,
+                          size_t nbyte, off_t offset);
+
+/* Calls fallocate(2) with MODE on the parts of FD that [OFFSET,
+ * OFFSET + LENGTH) maps to. Holes are already clear, but can't be
+ * allocated. MODE has to include FALLOC_FL_KEEP_SIZE. */
+int extent_map_fallocate(struct extent_map *em, int mode, off_t offset,
+                         off_t length);
+
+#endif
@@ -12,80 +12,52 @@
 
 #include "fdisk_access.h"
 
-enum {
-    buffer_size = 1024
-};
-
-int partition_count(const char *devname)
+static const char * safe_string(const char *input)
 {
-    int prev_errno = errno;
-    int result = 0;
-    struct fdisk_table *table = NULL;
-    struct fdisk_context *ctx = NULL;
-    errno = 0;
-
-    if (devname == NULL) {
-        result = FDISK_NULL_PTR;
-        goto cleanup;
-    }
-
-    if ((ctx = fdisk_new_context()) == NULL) {
-        result = FDISK_CONTEXT_FAIL;
-        goto cleanup;
-    }
-
-    if (access(devname, R_OK) != 0) {
-        result = FDISK_INVALID_FILE;
-        goto cleanup;
-    }
+    return (input == NULL) ? "" : input;
+}
 
-    if (fdisk_assign_device(ctx, devname, true) != 0) {
-        result = FDISK_ACCESS_DEVICE;
-        goto cleanup;
-    }
+static const char * partition_type_name(struct fdisk_partition *partition)
+{
+    struct fdisk_parttype *type = fdisk_partition_get_type(partition);
 
-    if (fdisk_get_partitions(ctx, &table) != 0) {
-        result = FDISK_READ_PARTITIONS;
-        goto cleanup;
+    if (type == NULL) {
+        return NULL;
     }
 
-    result = (int) fdisk_table_get_nents(table);
-
-cleanup:
-    if (table) {
-        fdisk_unref_table(table);
-    }
-    if (ctx) {
-        fdisk_unref_context(ctx);
-    }
+    return safe_string(fdisk_parttype_get_name(type));
+}
 
-    if (errno == 0) {
-        errno = prev_errno;
-    } else {
-        fprintf(stderr, "Error accessing %s: %s.\n", devname, strerror(errno));
-    }
+static char * copy_string(char **pool, const char *input)
+{
+    char *result = *pool;
+    size_t length = strlen(input) + 1;
 
+    memcpy(result, input, length);
+    *pool += length;
     return result;
 }
 
-int partition_get_info(const char *devname, unsigned int partnum,
-                       struct part_info **info)
+int partition_read_table(const char *devname, struct part_info **table)
 {
     int prev_errno = errno;
     int result = 0;
-    struct fdisk_table *table = NULL;
+    size_t count = 0;
+    size_t pool_size = 0;
+    unsigned long ssize = 0;
+    char *pool = NULL;
+    struct fdisk_table *fdisk_table = NULL;
     struct fdisk_context *ctx = NULL;
     struct fdisk_partition *partition = NULL;
-    struct fdisk_parttype *type = NULL;
-    unsigned long ssize = 0;
-    const char *buffer = NULL;
     errno = 0;
 
-    if ((devname == NULL) || (info == NULL)) {
+    if ((devname == NULL) || (table == NULL)) {
         result = FDISK_NULL_PTR;
         goto cleanup;
     }
 
+    *table = NULL;
+
     if ((ctx = fdisk_new_context()) == NULL) {
         result = FDISK_CONTEXT_FAIL;
         goto cleanup;
@@ -101,85 +73,63 @@ int partition_get_info(const char *devname, unsigned int partnum,
         goto cleanup;
     }
 
-    if (fdisk_get_partitions(ctx, &table) != 0) {
+    if (fdisk_get_partitions(ctx, &fdisk_table) != 0) {
         result = FDISK_READ_PARTITIONS;
         goto cleanup;
     }
 
-    if (partnum >= fdisk_table_get_nents(table)) {
-        result = FDISK_MISSING_PARTITION;
-        goto cleanup;
-    }
-
-    if ((partition = fdisk_table_get_partition(table, partnum)) == NULL) {
-        result = FDISK_CORRUPT_PARTITION;
-        goto cleanup;
-    }
-
-    if (fdisk_partition_has_start(partition) == false) {
-        result = FDISK_CORRUPT_PARTITION;
-        goto cleanup;
-    }
-
-    if (fdisk_partition_has_size(partition) == false) {
-        result = FDISK_CORRUPT_PARTITION;
-        goto cleanup;
-    }
-
-    *info = calloc(1, sizeof(struct part_info));
-    if (*info == NULL) {
-        result = FDISK_ALLOC_FAILURE;
-        goto cleanup;
-    }
+    count = fdisk_table_get_nents(fdisk_table);
 
-    ssize = fdisk_get_sector_size(ctx);
-    (*info)->start = (off_t) (fdisk_partition_get_start(partition) * ssize);
-    (*info)->length = (off_t) (fdisk_partition_get_size(partition) * ssize);
+    /* First pass: validate every entry and size up the string pool, so that
+     * the whole table fits in a single allocation. */
+    for (size_t x = 0; x < count; x++) {
+        partition = fdisk_table_get_partition(fdisk_table, x);
 
-    if ((type = fdisk_partition_get_type(partition)) == NULL) {
-        result = FDISK_CORRUPT_PARTITION;
-        goto cleanup;
-    }
+        if ((partition == NULL) ||
+            (fdisk_partition_has_start(partition) == false) ||
+            (fdisk_partition_has_size(partition) == false) ||
+            (partition_type_name(partition) == NULL)) {
+            result = FDISK_CORRUPT_PARTITION;
+            goto cleanup;
+        }
 
-    if (((*info)->name = calloc(1, buffer_size)) == NULL) {
-        result = FDISK_ALLOC_FAILURE;
-        goto cleanup;
+        pool_size += strlen(partition_type_name(partition)) + 1;
+        pool_size += strlen(safe_string(fdisk_partition_get_name(partition)));
+        pool_size += strlen(safe_string(fdisk_partition_get_uuid(partition)));
+        pool_size += 2;
     }
 
-    if (((*info)->uuid = calloc(1, buffer_size)) == NULL) {
-        result = FDISK_ALLOC_FAILURE;
-        goto cleanup;
-    }
+    *table = malloc((count * sizeof(struct part_info)) + pool_size);
 
-    if (((*info)->type = calloc(1, buffer_size)) == NULL) {
+    if (*table == NULL) {
         result = FDISK_ALLOC_FAILURE;
         goto cleanup;
     }
 
-    ((*info)->name)[0] = '\x00';
-    ((*info)->name)[buffer_size - 1] = '\x00';
-    ((*info)->uuid)[0] = '\x00';
-    ((*info)->uuid)[buffer_size - 1] = '\x00';
-    ((*info)->type)[0] = '\x00';
-    ((*info)->type)[buffer_size - 1] = '\x00';
+    pool = (char *) (*table + count);
+    ssize = fdisk_get_sector_size(ctx);
 
-    if ((buffer = fdisk_parttype_get_name(type)) != NULL) {
-        strncpy((*info)->type, buffer, strnlen(buffer, buffer_size - 1));
-    }
+    for (size_t x = 0; x < count; x++) {
+        struct part_info *info = &(*table)[x];
+        const char *name = NULL;
+        const char *uuid = NULL;
 
-    if ((buffer = fdisk_partition_get_name(partition)) != NULL) {
-        strncpy((*info)->name, buffer, strnlen(buffer, buffer_size - 1));
-    }
+        partition = fdisk_table_get_partition(fdisk_table, x);
+        name = safe_string(fdisk_partition_get_name(partition));
+        uuid = safe_string(fdisk_partition_get_uuid(partition));
 
-    if ((buffer = fdisk_partition_get_uuid(partition)) != NULL) {
-        strncpy((*info)->uuid, buffer, strnlen(buffer, buffer_size - 1));
+        info->start = (off_t) (fdisk_partition_get_start(partition) * ssize);
+        info->length = (off_t) (fdisk_partition_get_size(partition) * ssize);
+        info->type = copy_string(&pool, partition_type_name(partition));
+        info->name = copy_string(&pool, name);
+        info->uuid = copy_string(&pool, uuid);
     }
 
-    result = 0;
+    result = (int) count;
 
 cleanup:
-    if (table) {
-        fdisk_unref_table(table);
+    if (fdisk_table) {
+        fdisk_unref_table(fdisk_table);
     }
     if (ctx) {
         fdisk_unref_context(ctx);
@@ -193,24 +143,3 @@ cleanup:
 
     return result;
 }
-
-void partition_dealloc_info(struct part_info *info)
-{
-    if (info == NULL) {
-        return;
-    }
-
-    if (info->name != NULL) {
-        free(info->name);
-    }
-
-    if (info->uuid != NULL) {
-        free(info->uuid);
-    }
-
-    if (info->type != NULL) {
-        free(info->type);
-    }
-
-    free(info);
-}
@@ -22,11 +22,12 @@ struct part_info {
     char *type;
 };
 
-int partition_count(const char *devname);
+/* Reads every entry of DEVNAME's partition table in one pass. On success,
+ * returns the number of entries and points *table at a single allocation
+ * that holds all of them (strings included). Release it with
+ * partition_dealloc_table(). Returns a negative FDISK_* code on failure. */
+int partition_read_table(const char *devname, struct part_info **table);
 
-int partition_get_info(const char *devname, unsigned int partnum,
-                       struct part_info **info);
-
-void partition_dealloc_info(struct part_info *info);
+void partition_dealloc_table(struct part_info *table);
 
 #endif
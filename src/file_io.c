@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "file_io.h"
+
+/* Each path's temporary file is fixed, so replacements take turns. */
+static pthread_mutex_t file_replace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*----------------------------------------------------------------------------*/
+
+uint16_t get_le16(const unsigned char *data)
+{
+    return (uint16_t) (data[0] | (data[1] << 8U));
+}
+
+uint32_t get_le32(const unsigned char *data)
+{
+    return (uint32_t) data[0] | ((uint32_t) data[1] << 8U) |
+           ((uint32_t) data[2] << 16U) | ((uint32_t) data[3] << 24U);
+}
+
+uint64_t get_le64(const unsigned char *data)
+{
+    return (uint64_t) get_le32(data) |
+           ((uint64_t) get_le32(data + 4) << 32U);
+}
+
+uint32_t get_be32(const unsigned char *data)
+{
+    return ((uint32_t) data[0] << 24U) | ((uint32_t) data[1] << 16U) |
+           ((uint32_t) data[2] << 8U) | (uint32_t) data[3];
+}
+
+uint64_t get_be64(const unsigned char *data)
+{
+    return ((uint64_t) get_be32(data) << 32U) | get_be32(data + 4);
+}
+
+void put_le32(unsigned char *data, uint32_t value)
+{
+    for (unsigned int x = 0; x < 4; x++) {
+        data[x] = (unsigned char) (value >> (x * 8U));
+    }
+}
+
+void put_le64(unsigned char *data, uint64_t value)
+{
+    put_le32(data, (uint32_t) value);
+    put_le32(data + 4, (uint32_t) (value >> 32U));
+}
+
+ssize_t pread_noeintr(int fildes, void *buf, size_t nbyte, off_t offset)
+{
+    ssize_t result = 0;
+
+    do {
+        result = pread(fildes, buf, nbyte, offset);
+    } while ((result == -1) && (errno == EINTR));
+
+    return result;
+}
+
+ssize_t pwrite_noeintr(int fildes, const void *buf, size_t nbyte,
+                       off_t offset)
+{
+    ssize_t result = 0;
+
+    do {
+        result = pwrite(fildes, buf, nbyte, offset);
+    } while ((result == -1) && (errno == EINTR));
+
+    return result;
+}
+
+ssize_t pread_count(int fildes, char *buf, size_t nbyte, off_t offset)
+{
+    size_t total = 0;
+
+    while (total < nbyte) {
+        ssize_t result = pread_noeintr(fildes, buf + total, (nbyte - total),
+                                       offset + (off_t) total);
+
+        if (result < 0) {
+            return result;
+        }
+
+        if (result == 0) {
+            /* Source ended early. */
+            break;
+        }
+
+        total += (size_t) result;
+    }
+
+    return (ssize_t) total;
+}
+
+ssize_t pwrite_count(int fildes, const char *buf, size_t nbyte,
+                     off_t offset)
+{
+    size_t remaining = nbyte;
+
+    while (remaining != 0) {
+        ssize_t result = pwrite_noeintr(fildes, buf, remaining, offset);
+
+        if (result < 0) {
+            return result;
+        }
+
+        remaining -= (size_t) result;
+        buf += result;
+        offset += (off_t) result;
+    }
+
+    return (ssize_t) nbyte;
+}
+
+int pread_exact(int fildes, void *buf, size_t nbyte, off_t offset)
+{
+    ssize_t result = pread_count(fildes, (char *) buf, nbyte, offset);
+
+    if (result < 0) {
+        return -1;
+    }
+
+    if ((size_t) result < nbyte) {
+        errno = EIO;
+        return 1;
+    }
+
+    return 0;
+}
+
+int write_all(int fildes, const void *buf, size_t nbyte)
+{
+    size_t total = 0;
+
+    while (total < nbyte) {
+        ssize_t result = write(fildes, (const char *) buf + total,
+                               nbyte - total);
+
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        total += (size_t) result;
+    }
+
+    return 0;
+}
+
+size_t file_block_size(int fd)
+{
+    struct stat stat_buffer = {0};
+    int sector_size = 0;
+
+    if (fstat(fd, &stat_buffer) != 0) {
+        return 0;
+    }
+
+    if (S_ISBLK(stat_buffer.st_mode)) {
+        if (ioctl(fd, BLKSSZGET, &sector_size) != 0) {
+            return 0;
+        }
+
+        return (size_t) sector_size;
+    }
+
+    return (size_t) stat_buffer.st_blksize;
+}
+
+int file_replace(int dir_fd, const char *path, file_replace_fill fill,
+                 void *data)
+{
+    char temp_path[PATH_MAX];
+    int result = -1;
+    int fd = -1;
+
+    if (snprintf(temp_path, sizeof(temp_path), "%s.tmp", path) >=
+        (int) sizeof(temp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    pthread_mutex_lock(&file_replace_lock);
+
+    fd = openat(dir_fd, temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+
+    if ((fd >= 0) && (fill(data, fd) == 0) && (fsync(fd) == 0)) {
+        result = renameat(dir_fd, temp_path, dir_fd, path);
+    }
+
+    if (fd >= 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+    }
+
+    pthread_mutex_unlock(&file_replace_lock);
+    return result;
+}
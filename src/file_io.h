@@ -0,0 +1,60 @@
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Fixed-width fields of the on-disk formats that PartFS reads and writes. */
+uint16_t get_le16(const unsigned char *data);
+uint32_t get_le32(const unsigned char *data);
+uint64_t get_le64(const unsigned char *data);
+uint32_t get_be32(const unsigned char *data);
+uint64_t get_be64(const unsigned char *data);
+void put_le32(unsigned char *data, uint32_t value);
+void put_le64(unsigned char *data, uint64_t value);
+
+/* pread() and pwrite(), retried after EINTR. */
+ssize_t pread_noeintr(int fildes, void *buf, size_t nbyte, off_t offset);
+ssize_t pwrite_noeintr(int fildes, const void *buf, size_t nbyte,
+                       off_t offset);
+
+/* Reads NBYTE bytes at OFFSET, carrying on after short reads. Returns how
+ * many were read, which is only fewer at end-of-file, or -1 with errno set. */
+ssize_t pread_count(int fildes, char *buf, size_t nbyte, off_t offset);
+
+/* Writes all NBYTE bytes at OFFSET. Returns NBYTE, or -1 with errno set. */
+ssize_t pwrite_count(int fildes, const char *buf, size_t nbyte,
+                     off_t offset);
+
+/* Like pread_count(), but returns 0 once all NBYTE bytes have been read, 1
+ * (with errno set to EIO) if the file ends first, and -1 with errno set on
+ * error. */
+int pread_exact(int fildes, void *buf, size_t nbyte, off_t offset);
+
+/* Writes all NBYTE bytes at FILDES's file offset, for files that might not
+ * be seekable. Returns 0, or -1 with errno set. */
+int write_all(int fildes, const void *buf, size_t nbyte);
+
+/* Returns the size of block that FD is best written in: the logical sector
+ * size of a block device, or the preferred I/O size of anything else, which
+ * filesystems keep to a multiple of theirs. Returns 0 with errno set on
+ * failure. */
+size_t file_block_size(int fd);
+
+/* Reads like pread_count() from the view of SOURCE that DATA stands for:
+ * translated, or as the mount sees it. */
+typedef ssize_t (*source_read_fn)(void *data, char *buf, size_t nbyte,
+                                  off_t offset);
+
+/* Writes the new contents of a file to FD for file_replace(). Returns 0, or
+ * -1 with errno set. */
+typedef int (*file_replace_fill)(void *data, int fd);
+
+/* Replaces PATH (relative to DIR_FD) in one go: FILL writes the new contents
+ * to PATH.tmp, which is flushed and renamed over PATH, so that neither a
+ * reader nor a crash ever sees half of it. Safe to call from several
+ * threads. Returns 0, or -1 with errno set. */
+int file_replace(int dir_fd, const char *path, file_replace_fill fill,
+                 void *data);
+
+#endif
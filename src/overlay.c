@@ -0,0 +1,661 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "overlay.h"
+
+#define MIN_BLOCK_SIZE (4096U)
+#define MAX_BLOCK_SIZE (64U * 1024U * 1024U)
+
+/* The extent index is kept next to the delta, in PATH.map: the magic, the
+ * block size and state as 32-bit little-endian values, the extent count as a
+ * 64-bit one, then each extent's start and end block. */
+#define MAP_MAGIC "PARTFSO1"
+#define MAP_HEADER_SIZE (24U)
+#define MAP_EXTENT_SIZE (16U)
+#define MAP_IN_USE (0U)
+#define MAP_CLEAN (1U)
+
+/* Writes that patch part of a block lock it through a small hashed set of
+ * locks. NO_BLOCK stands for a block that doesn't need one. */
+#define BLOCK_LOCKS (64U)
+#define NO_BLOCK (BLOCK_LOCKS)
+
+/* A run of delta blocks, [start, end). */
+struct overlay_extent {
+    uint64_t start;
+    uint64_t end;
+};
+
+/* LOCK only guards the index (EXTENTS, CLEAN and CHANGES); the delta's data
+ * is read and written outside it. SAVE_LOCK keeps saves of the index in
+ * order. */
+struct overlay {
+    int delta_fd;
+    int source_fd;
+    int dir_fd;
+    int clean;
+    uint64_t changes;
+    char map_path[PATH_MAX];
+    size_t block_size;
+    struct overlay_extent *extents;
+    size_t extent_count;
+    size_t extent_alloc;
+    pthread_rwlock_t lock;
+    pthread_mutex_t save_lock;
+    pthread_mutex_t block_locks[BLOCK_LOCKS];
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Reads like pread_count(), with zeroes for anything past the end of FD. */
+static int overlay_read(int fd, char *buf, size_t nbyte, off_t offset)
+{
+    ssize_t result = pread_count(fd, buf, nbyte, offset);
+
+    if (result < 0) {
+        return -1;
+    }
+
+    memset(buf + result, 0, nbyte - (size_t) result);
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+/* Returns the index of the first extent that ends after BLOCK, which is
+ * either the extent holding BLOCK or the next one above it. */
+static size_t overlay_find(const struct overlay *ovl, uint64_t block)
+{
+    size_t low = 0;
+    size_t high = ovl->extent_count;
+
+    while (low < high) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (ovl->extents[mid].end <= block) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static int overlay_covered(const struct overlay *ovl, uint64_t block)
+{
+    size_t index = overlay_find(ovl, block);
+
+    return (index < ovl->extent_count) &&
+           (ovl->extents[index].start <= block);
+}
+
+/* Marks [start, end) as present in the delta, merging with any extents that
+ * it touches or overlaps. */
+static int overlay_insert(struct overlay *ovl, uint64_t start, uint64_t end)
+{
+    size_t first = overlay_find(ovl, (start == 0) ? 0 : start - 1);
+    size_t last = first;
+
+    while ((last < ovl->extent_count) && (ovl->extents[last].start <= end)) {
+        last++;
+    }
+
+    if (first != last) {
+        if (ovl->extents[first].start < start) {
+            start = ovl->extents[first].start;
+        }
+
+        if (ovl->extents[last - 1].end > end) {
+            end = ovl->extents[last - 1].end;
+        }
+
+        ovl->extents[first].start = start;
+        ovl->extents[first].end = end;
+        memmove(&ovl->extents[first + 1], &ovl->extents[last],
+                (ovl->extent_count - last) * sizeof(struct overlay_extent));
+        ovl->extent_count -= (last - first - 1);
+        return 0;
+    }
+
+    if (ovl->extent_count == ovl->extent_alloc) {
+        size_t alloc = (ovl->extent_alloc == 0) ? 64 : ovl->extent_alloc * 2;
+        void *extents = realloc(ovl->extents,
+                                alloc * sizeof(struct overlay_extent));
+
+        if (extents == NULL) {
+            return -1;
+        }
+
+        ovl->extents = extents;
+        ovl->extent_alloc = alloc;
+    }
+
+    memmove(&ovl->extents[first + 1], &ovl->extents[first],
+            (ovl->extent_count - first) * sizeof(struct overlay_extent));
+    ovl->extents[first].start = start;
+    ovl->extents[first].end = end;
+    ovl->extent_count++;
+    return 0;
+}
+
+/* Loads the extent index saved next to a delta of DELTA_SIZE bytes. Every
+ * block in a saved index was written and flushed before the save, and later
+ * writes only add blocks, so an index left in use by a crash still lists
+ * nothing that isn't there; the blocks first written after it was saved are
+ * lost, like any other unsynced write. Nothing else on disk says which
+ * blocks were written, so a delta with data but no index fails with EINVAL
+ * rather than being guessed at. */
+static int overlay_load(struct overlay *ovl, off_t delta_size)
+{
+    unsigned char header[MAP_HEADER_SIZE];
+    unsigned char *saved = NULL;
+    struct stat map_stat = {0};
+    uint64_t count = 0;
+    uint32_t block_size = 0;
+    uint32_t state = 0;
+    int result = -1;
+    int fd = openat(ovl->dir_fd, ovl->map_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        /* A missing index is as good as an empty one that's up to date. */
+        if ((errno == ENOENT) && (delta_size == 0)) {
+            ovl->clean = 1;
+            return 0;
+        }
+
+        if (errno == ENOENT) {
+            errno = EINVAL;
+        }
+
+        return -1;
+    }
+
+    if ((fstat(fd, &map_stat) < 0) ||
+        (pread_exact(fd, header, MAP_HEADER_SIZE, 0) != 0)) {
+        goto cleanup;
+    }
+
+    block_size = get_le32(header + 8);
+    state = get_le32(header + 12);
+    count = get_le64(header + 16);
+    errno = EINVAL;
+
+    if ((memcmp(header, MAP_MAGIC, 8) != 0) ||
+        ((state != MAP_CLEAN) && (state != MAP_IN_USE)) ||
+        (block_size < MIN_BLOCK_SIZE) || (block_size > MAX_BLOCK_SIZE) ||
+        ((block_size % MIN_BLOCK_SIZE) != 0) ||
+        (count > ((uint64_t) map_stat.st_size / MAP_EXTENT_SIZE)) ||
+        ((uint64_t) map_stat.st_size !=
+         (MAP_HEADER_SIZE + (count * MAP_EXTENT_SIZE)))) {
+        goto cleanup;
+    }
+
+    ovl->block_size = block_size;
+
+    if (count == 0) {
+        result = 0;
+        goto cleanup;
+    }
+
+    if (((saved = malloc(count * MAP_EXTENT_SIZE)) == NULL) ||
+        ((ovl->extents = calloc(count, sizeof(struct overlay_extent))) ==
+         NULL)) {
+        goto cleanup;
+    }
+
+    if (pread_exact(fd, saved, count * MAP_EXTENT_SIZE,
+                    MAP_HEADER_SIZE) != 0) {
+        goto cleanup;
+    }
+
+    ovl->extent_alloc = count;
+
+    for (uint64_t x = 0; x < count; x++) {
+        struct overlay_extent *extent = &ovl->extents[x];
+
+        extent->start = get_le64(saved + (x * MAP_EXTENT_SIZE));
+        extent->end = get_le64(saved + (x * MAP_EXTENT_SIZE) + 8);
+
+        /* Extents are kept sorted, and the ones that touch are merged. */
+        if ((extent->start >= extent->end) ||
+            ((x > 0) && (extent->start <= extent[-1].end))) {
+            errno = EINVAL;
+            goto cleanup;
+        }
+    }
+
+    ovl->extent_count = count;
+    result = 0;
+
+cleanup:
+    if (result != 0) {
+        int error = errno;
+        close(fd);
+        free(saved);
+        errno = error;
+        return -1;
+    }
+
+    close(fd);
+    free(saved);
+    ovl->clean = (state == MAP_CLEAN);
+    return 0;
+}
+
+/* Encodes the index as it stands, marked STATE, and notes the number of
+ * changes that it holds in CHANGES. Returns NULL with errno set if there's
+ * no memory for it. */
+static unsigned char * overlay_encode(struct overlay *ovl, uint32_t state,
+                                      size_t *length, uint64_t *changes)
+{
+    unsigned char *saved = NULL;
+
+    pthread_rwlock_rdlock(&ovl->lock);
+    *length = MAP_HEADER_SIZE + (ovl->extent_count * MAP_EXTENT_SIZE);
+    *changes = ovl->changes;
+
+    if ((saved = malloc(*length)) != NULL) {
+        memcpy(saved, MAP_MAGIC, 8);
+        put_le32(saved + 8, (uint32_t) ovl->block_size);
+        put_le32(saved + 12, state);
+        put_le64(saved + 16, ovl->extent_count);
+
+        for (size_t x = 0; x < ovl->extent_count; x++) {
+            unsigned char *extent = saved + MAP_HEADER_SIZE +
+                                    (x * MAP_EXTENT_SIZE);
+
+            put_le64(extent, ovl->extents[x].start);
+            put_le64(extent + 8, ovl->extents[x].end);
+        }
+    }
+
+    pthread_rwlock_unlock(&ovl->lock);
+    return saved;
+}
+
+/* An encoded index, for overlay_fill(). */
+struct overlay_map {
+    const unsigned char *data;
+    size_t length;
+};
+
+static int overlay_fill(void *data, int fd)
+{
+    struct overlay_map *map = (struct overlay_map *) data;
+
+    return write_all(fd, map->data, map->length);
+}
+
+/* Replaces the saved index with the LENGTH bytes at SAVED. Called with the
+ * save lock held. */
+static int overlay_save(struct overlay *ovl, const unsigned char *saved,
+                        size_t length)
+{
+    struct overlay_map map = {saved, length};
+
+    return file_replace(ovl->dir_fd, ovl->map_path, overlay_fill, &map);
+}
+
+/* Saves an index that matches the delta. It's taken before the flush, so it
+ * only lists blocks whose writes had finished, and the flush makes them all
+ * durable before the index names them. */
+static int overlay_checkpoint(struct overlay *ovl)
+{
+    unsigned char *saved = NULL;
+    uint64_t changes = 0;
+    size_t length = 0;
+    int result = -1;
+
+    pthread_mutex_lock(&ovl->save_lock);
+
+    if ((saved = overlay_encode(ovl, MAP_CLEAN, &length, &changes)) == NULL) {
+        goto cleanup;
+    }
+
+    if ((fsync(ovl->delta_fd) != 0) ||
+        (overlay_save(ovl, saved, length) != 0)) {
+        goto cleanup;
+    }
+
+    /* Writes that finished in the meantime still need a save. */
+    pthread_rwlock_wrlock(&ovl->lock);
+    ovl->clean = (ovl->changes == changes);
+    pthread_rwlock_unlock(&ovl->lock);
+    result = 0;
+
+cleanup:
+    pthread_mutex_unlock(&ovl->save_lock);
+    free(saved);
+    return result;
+}
+
+/* Marks the saved index as in use before the first write since it was saved.
+ * A new delta gets its first index here, so that a crash never leaves one
+ * with data but no index. */
+static int overlay_mark_in_use(struct overlay *ovl)
+{
+    unsigned char *saved = NULL;
+    uint64_t changes = 0;
+    size_t length = 0;
+    int clean = 0;
+    int result = 0;
+
+    pthread_rwlock_rdlock(&ovl->lock);
+    clean = ovl->clean;
+    pthread_rwlock_unlock(&ovl->lock);
+
+    if (!clean) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ovl->save_lock);
+    pthread_rwlock_rdlock(&ovl->lock);
+    clean = ovl->clean;
+    pthread_rwlock_unlock(&ovl->lock);
+
+    if (clean) {
+        saved = overlay_encode(ovl, MAP_IN_USE, &length, &changes);
+        result = -1;
+
+        if ((saved != NULL) && (overlay_save(ovl, saved, length) == 0)) {
+            pthread_rwlock_wrlock(&ovl->lock);
+            ovl->clean = 0;
+            pthread_rwlock_unlock(&ovl->lock);
+            result = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&ovl->save_lock);
+    free(saved);
+    return result;
+}
+
+static size_t overlay_block_slot(uint64_t block)
+{
+    return (size_t) (block % BLOCK_LOCKS);
+}
+
+/* Locks the slots of up to two blocks, lower slot first so that writers
+ * taking two can't deadlock. */
+static void overlay_lock_blocks(struct overlay *ovl, size_t first,
+                                size_t second)
+{
+    size_t low = (first < second) ? first : second;
+    size_t high = (first < second) ? second : first;
+
+    if (low != NO_BLOCK) {
+        pthread_mutex_lock(&ovl->block_locks[low]);
+    }
+
+    if ((high != NO_BLOCK) && (high != low)) {
+        pthread_mutex_lock(&ovl->block_locks[high]);
+    }
+}
+
+static void overlay_unlock_blocks(struct overlay *ovl, size_t first,
+                                  size_t second)
+{
+    if (first != NO_BLOCK) {
+        pthread_mutex_unlock(&ovl->block_locks[first]);
+    }
+
+    if ((second != NO_BLOCK) && (second != first)) {
+        pthread_mutex_unlock(&ovl->block_locks[second]);
+    }
+}
+
+/* Seeds the delta with SOURCE's copy of BLOCK, so that a partial write to it
+ * doesn't leave the rest of the block zeroed. Called with BLOCK's slot
+ * locked. */
+static int overlay_fill_block(struct overlay *ovl, uint64_t block)
+{
+    off_t offset = (off_t) (block * ovl->block_size);
+    char *bounce = NULL;
+    int covered = 0;
+    int result = -1;
+
+    pthread_rwlock_rdlock(&ovl->lock);
+    covered = overlay_covered(ovl, block);
+    pthread_rwlock_unlock(&ovl->lock);
+
+    if (covered) {
+        return 0;
+    }
+
+    if ((bounce = malloc(ovl->block_size)) == NULL) {
+        return -1;
+    }
+
+    if ((overlay_read(ovl->source_fd, bounce, ovl->block_size, offset) == 0) &&
+        (pwrite_count(ovl->delta_fd, bounce, ovl->block_size, offset) >= 0)) {
+        result = 0;
+    }
+
+    free(bounce);
+    return result;
+}
+
+static void overlay_free(struct overlay *ovl)
+{
+    if (ovl == NULL) {
+        return;
+    }
+
+    if (ovl->delta_fd >= 0) {
+        close(ovl->delta_fd);
+    }
+
+    for (size_t x = 0; x < BLOCK_LOCKS; x++) {
+        pthread_mutex_destroy(&ovl->block_locks[x]);
+    }
+
+    pthread_mutex_destroy(&ovl->save_lock);
+    pthread_rwlock_destroy(&ovl->lock);
+    free(ovl->extents);
+    free(ovl);
+}
+
+/*----------------------------------------------------------------------------*/
+
+int overlay_open(struct overlay **ovl, int dir_fd, const char *path,
+                 int source_fd)
+{
+    struct overlay *result = NULL;
+    struct stat delta_stat = {0};
+    int prev_errno = 0;
+
+    if ((ovl == NULL) || (path == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct overlay))) == NULL) {
+        return -1;
+    }
+
+    result->source_fd = source_fd;
+    result->dir_fd = dir_fd;
+    result->delta_fd = openat(dir_fd, path, O_RDWR | O_CREAT, 0644);
+    pthread_rwlock_init(&result->lock, NULL);
+    pthread_mutex_init(&result->save_lock, NULL);
+
+    for (size_t x = 0; x < BLOCK_LOCKS; x++) {
+        pthread_mutex_init(&result->block_locks[x], NULL);
+    }
+
+    if (result->delta_fd < 0) {
+        goto cleanup;
+    }
+
+    if (fstat(result->delta_fd, &delta_stat) < 0) {
+        goto cleanup;
+    }
+
+    if (S_ISREG(delta_stat.st_mode) == 0) {
+        errno = EINVAL;
+        goto cleanup;
+    }
+
+    result->block_size = MIN_BLOCK_SIZE;
+
+    if ((size_t) delta_stat.st_blksize > result->block_size) {
+        result->block_size = (size_t) delta_stat.st_blksize;
+    }
+
+    if (snprintf(result->map_path, sizeof(result->map_path), "%s.map",
+                 path) >= (int) sizeof(result->map_path)) {
+        errno = ENAMETOOLONG;
+        goto cleanup;
+    }
+
+    if (overlay_load(result, delta_stat.st_size) != 0) {
+        goto cleanup;
+    }
+
+    *ovl = result;
+    return 0;
+
+cleanup:
+    prev_errno = errno;
+    overlay_free(result);
+    errno = prev_errno;
+    return -1;
+}
+
+void overlay_close(struct overlay *ovl)
+{
+    if (ovl == NULL) {
+        return;
+    }
+
+    if (!ovl->clean) {
+        overlay_checkpoint(ovl);
+    }
+
+    overlay_free(ovl);
+}
+
+ssize_t overlay_pread(struct overlay *ovl, char *buf, size_t nbyte,
+                      off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    /* Extents are only ever added, so a block found missing here was at
+     * worst written while this read was going on. */
+    while (pos < stop) {
+        uint64_t block = pos / ovl->block_size;
+        uint64_t chunk_end = stop;
+        int fd = ovl->source_fd;
+        size_t index = 0;
+
+        pthread_rwlock_rdlock(&ovl->lock);
+        index = overlay_find(ovl, block);
+
+        if (index < ovl->extent_count) {
+            struct overlay_extent *extent = &ovl->extents[index];
+
+            if (extent->start <= block) {
+                fd = ovl->delta_fd;
+                chunk_end = extent->end * ovl->block_size;
+            } else {
+                chunk_end = extent->start * ovl->block_size;
+            }
+
+            if (chunk_end > stop) {
+                chunk_end = stop;
+            }
+        }
+
+        pthread_rwlock_unlock(&ovl->lock);
+
+        if (overlay_read(fd, buf + (pos - (uint64_t) offset),
+                         (size_t) (chunk_end - pos), (off_t) pos) != 0) {
+            return -1;
+        }
+
+        pos = chunk_end;
+    }
+
+    return (ssize_t) nbyte;
+}
+
+ssize_t overlay_pwrite(struct overlay *ovl, const char *buf, size_t nbyte,
+                       off_t offset)
+{
+    uint64_t start = (uint64_t) offset;
+    uint64_t stop = start + nbyte;
+    uint64_t first = start / ovl->block_size;
+    uint64_t last = 0;
+    size_t head = NO_BLOCK;
+    size_t tail = NO_BLOCK;
+    ssize_t result = -1;
+
+    if (nbyte == 0) {
+        return 0;
+    }
+
+    last = (stop - 1) / ovl->block_size;
+
+    if (overlay_mark_in_use(ovl) != 0) {
+        return -1;
+    }
+
+    /* Writers that patch the same block take turns, so that one can't seed
+     * it from SOURCE over the other's data. Only the index is locked for
+     * everyone, and only once the data is in the delta. */
+    if (((start % ovl->block_size) != 0) ||
+        ((first == last) && ((stop % ovl->block_size) != 0))) {
+        head = overlay_block_slot(first);
+    }
+
+    if ((last != first) && ((stop % ovl->block_size) != 0)) {
+        tail = overlay_block_slot(last);
+    }
+
+    overlay_lock_blocks(ovl, head, tail);
+
+    if ((head != NO_BLOCK) && (overlay_fill_block(ovl, first) != 0)) {
+        goto cleanup;
+    }
+
+    if ((tail != NO_BLOCK) && (overlay_fill_block(ovl, last) != 0)) {
+        goto cleanup;
+    }
+
+    if (pwrite_count(ovl->delta_fd, buf, nbyte, offset) < 0) {
+        goto cleanup;
+    }
+
+    pthread_rwlock_wrlock(&ovl->lock);
+
+    if (overlay_insert(ovl, first, last + 1) == 0) {
+        ovl->changes++;
+        ovl->clean = 0;
+        result = (ssize_t) nbyte;
+    }
+
+    pthread_rwlock_unlock(&ovl->lock);
+
+cleanup:
+    overlay_unlock_blocks(ovl, head, tail);
+    return result;
+}
+
+int overlay_sync(struct overlay *ovl)
+{
+    return overlay_checkpoint(ovl);
+}
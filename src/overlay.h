@@ -0,0 +1,33 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <sys/types.h>
+
+struct overlay;
+
+/* Opens (or creates) the sparse delta file PATH relative to DIR_FD, and
+ * layers it on top of SOURCE_FD. The blocks written to it are listed in
+ * PATH.map, which is saved on every sync and on close and loaded here, so an
+ * overlay can be reused across mounts, even after a crash (which loses the
+ * writes since the last sync). A delta with data but no map fails with
+ * EINVAL. Returns 0 on success, or -1 with errno set. */
+int overlay_open(struct overlay **ovl, int dir_fd, const char *path,
+                 int source_fd);
+
+void overlay_close(struct overlay *ovl);
+
+/* Reads NBYTE bytes at absolute SOURCE offset OFFSET, taking every block
+ * that has been written from the delta file and everything else from SOURCE.
+ * Bytes that exist in neither are returned as zeroes. */
+ssize_t overlay_pread(struct overlay *ovl, char *buf, size_t nbyte,
+                      off_t offset);
+
+/* Writes NBYTE bytes at absolute SOURCE offset OFFSET into the delta file.
+ * SOURCE is only ever read from. */
+ssize_t overlay_pwrite(struct overlay *ovl, const char *buf, size_t nbyte,
+                       off_t offset);
+
+/* Flushes the delta file and saves its map. */
+int overlay_sync(struct overlay *ovl);
+
+#endif
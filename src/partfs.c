@@ -16,56 +16,199 @@
  *
  *  Copyright 2018, Nicholas Clark */
 
-#define _POSIX_C_SOURCE 200809L
-#define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
 
+#include <dirent.h>
 #include <errno.h>
-#include <fuse.h>
+#include <fcntl.h>
+#include <fuse3/fuse_lowlevel.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "aligned_io.h"
+#include "block_cache.h"
+#include "chunk_source.h"
+#include "combine.h"
 #include "config.h"
+#include "dirty_map.h"
+#include "disk_label.h"
+#include "extent_map.h"
 #include "fdisk_access.h"
+#include "file_io.h"
+#include "overlay.h"
+#include "prefetch.h"
+#include "qcow2_source.h"
+#include "stats.h"
+#include "table_view.h"
+
+#ifdef ENABLE_HASHES
+#include "block_hash.h"
+#endif
+
+#ifdef ENABLE_URING
+#include "uring_io.h"
+#endif
+
+#ifdef ENABLE_ZSTD
+#include "zstd_source.h"
+#endif
 
 #define DISABLE_WRITES (~0222U)
 #define DEFAULT_PERMS (0644U)
+#define DEFAULT_DIR_PERMS (0755U)
+#define FIRST_WINDOW_INO (FUSE_ROOT_ID + 1)
+#define CONTROL_NAME ".control"
+#define CONTROL_INO (FIRST_WINDOW_INO)
+#define DEFAULT_MAX_WINDOWS (64U)
+#define MAX_WINDOWS (65536U)
+#define MAX_THREADS (256U)
+#define MAX_URING_DEPTH (4096U)
+#define DEFAULT_URING_DEPTH (64U)
+#define DEFAULT_CACHE_BLOCK (64U * 1024U)
+#define DEFAULT_COMBINE_AGE (500U)
+#define MAX_COMBINE_AGE (60U * 1000U)
+#define STATS_XATTR "user.partfs.stats"
+#define STATS_XATTR_SLACK (1024U)
+#define DIGEST_XATTR "user.partfs.digest"
+#define DEFAULT_HASH_BLOCK (1024U * 1024U)
+#define MAX_HASH_BLOCK (64U * 1024U * 1024U)
+#define CHANGES_XATTR "user.partfs.changes"
+#define DEFAULT_CBT_BLOCK (64U * 1024U)
+#define MAX_CBT_BLOCK (64U * 1024U * 1024U)
+#define ATTR_TIMEOUT (1.0)
 
 #define KILO (0x1ULL << 10U)
 #define MEGA (0x1ULL << 20U)
 #define GIGA (0x1ULL << 30U)
 #define TERA (0x1ULL << 40U)
 
+#define MAX_IO_SIZE (MEGA)
+
 /*----------------------------------------------------------------------------*/
 
 static char progname[NAME_MAX + 1] = {0};
 
+struct partfs_window {
+    char name[NAME_MAX + 1];
+    fuse_ino_t ino;
+    size_t max_size;
+    size_t source_offset;
+    size_t current_size;
+    pthread_mutex_t size_lock;
+    char *map;
+    size_t map_length;
+    size_t map_skew;
+    size_t next_read;
+    int advice;
+    unsigned int generation;
+    unsigned int open_count;
+};
+
 struct partfs_context {
     const char *created_file;
+    int created_flags;
     int dir_fd;
+    int directory;
     int read_only;
+    int splice;
+    int writeback;
+    int direct_io;
+    int kernel_cache;
     int source_fd;
     mode_t source_mode;
-    size_t max_size;
-    size_t source_offset;
-    size_t current_size;
+    struct overlay *overlay;
+    struct block_cache *cache;
+    struct prefetch *prefetch;
+    struct combine *combine;
+    struct aligned_io *direct;
+    struct stats *stats;
+    const char *stats_file;
+    int stats_xattr;
+    struct block_hash *hashes;
+    const char *hash_file;
+    struct dirty_map *dirty;
+    const char *cbt_file;
+    struct zstd_source *zstd;
+    struct qcow2_source *qcow2;
+    struct chunk_source *chunks;
+    struct extent_map *extents;
+    struct uring_engine *uring;
+    size_t uring_depth;
+    int uring_fixed;
+    struct partfs_window *windows;
+    size_t window_count;
+    int control;
+    pthread_mutex_t control_lock;
+    size_t next_slot;
+    uint64_t source_size;
     struct fuse_args *args;
 };
 
 struct partfs_config {
     size_t offset;
     size_t size;
+    size_t threads;
+    size_t cache_size;
+    size_t cache_block;
+    size_t readahead;
+    size_t combine_size;
+    size_t combine_age;
+    size_t hash_block;
+    size_t cbt_block;
+    size_t max_windows;
     int read_only;
     int nonempty;
+    int all_partitions;
+    int splice;
+    int writeback;
+    int direct_io;
+    int kernel_cache;
+    int mmap;
+    int uring;
+    int uring_fixed;
+    int source_direct;
+    int stats_xattr;
+    int cbt;
+    int zstd;
+    int qcow2;
+    int chunks;
+    int control;
     int print_table;
     char *offset_string;
     char *size_string;
     char *partition_string;
+    char *partlabel;
+    char *partuuid;
+    char *threads_string;
+    char *overlay_string;
+    char *uring_depth_string;
+    char *cache_size_string;
+    char *cache_block_string;
+    char *readahead_string;
+    char *combine_size_string;
+    char *combine_age_string;
+    char *stats_file;
+    char *hash_file;
+    char *hash_block_string;
+    char *cbt_file;
+    char *cbt_block_string;
+    char *cbt_export;
+    char *extents;
+    char *fiemap;
+    char *max_windows_string;
     char source[PATH_MAX + 1];
     char mountpoint[PATH_MAX + 1];
 };
@@ -82,8 +225,43 @@ static struct fuse_opt partfs_opts[] = {
     PARTFS_OPT("offset=%s", offset_string, 0),
     PARTFS_OPT("sizelimit=%s", size_string, 0),
     PARTFS_OPT("partition=%s", partition_string, 0),
+    PARTFS_OPT("partlabel=%s", partlabel, 0),
+    PARTFS_OPT("partuuid=%s", partuuid, 0),
+    PARTFS_OPT("threads=%s", threads_string, 0),
+    PARTFS_OPT("overlay=%s", overlay_string, 0),
+    PARTFS_OPT("cache_size=%s", cache_size_string, 0),
+    PARTFS_OPT("cache_block=%s", cache_block_string, 0),
+    PARTFS_OPT("readahead=%s", readahead_string, 0),
+    PARTFS_OPT("combine=%s", combine_size_string, 0),
+    PARTFS_OPT("combine_age=%s", combine_age_string, 0),
+    PARTFS_OPT("stats_file=%s", stats_file, 0),
+    PARTFS_OPT("stats_xattr", stats_xattr, 1),
+    PARTFS_OPT("hash_file=%s", hash_file, 0),
+    PARTFS_OPT("hash_block=%s", hash_block_string, 0),
+    PARTFS_OPT("cbt", cbt, 1),
+    PARTFS_OPT("cbt_file=%s", cbt_file, 0),
+    PARTFS_OPT("cbt_block=%s", cbt_block_string, 0),
+    PARTFS_OPT("cbt_export=%s", cbt_export, 0),
+    PARTFS_OPT("zstd", zstd, 1),
+    PARTFS_OPT("qcow2", qcow2, 1),
+    PARTFS_OPT("chunks", chunks, 1),
+    PARTFS_OPT("extents=%s", extents, 0),
+    PARTFS_OPT("fiemap=%s", fiemap, 0),
+    PARTFS_OPT("control", control, 1),
+    PARTFS_OPT("max_windows=%s", max_windows_string, 0),
     PARTFS_OPT("ro", read_only, 1),
     PARTFS_OPT("nonempty", nonempty, 1),
+    PARTFS_OPT("all_partitions", all_partitions, 1),
+    PARTFS_OPT("splice", splice, 1),
+    PARTFS_OPT("source_direct", source_direct, 1),
+    PARTFS_OPT("writeback", writeback, 1),
+    PARTFS_OPT("direct_io", direct_io, 1),
+    PARTFS_OPT("kernel_cache", kernel_cache, 1),
+    PARTFS_OPT("mmap", mmap, 1),
+    PARTFS_OPT("uring", uring, 1),
+    PARTFS_OPT("uring_depth=%s", uring_depth_string, 0),
+    PARTFS_OPT("uring_fixed", uring_fixed, 1),
+    FUSE_OPT_KEY("use_ino", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("-p", KEY_PRINT_PARTITION),
     FUSE_OPT_KEY("--print-partitions", KEY_PRINT_PARTITION),
     FUSE_OPT_KEY("-V", KEY_VERSION),
@@ -164,6 +342,70 @@ static void controlled_exit(struct partfs_context *ctx, int exit_code)
         exit(exit_code);
     }
 
+    if (ctx->combine != NULL) {
+        combine_destroy(ctx->combine);
+        ctx->combine = NULL;
+    }
+
+    if (ctx->overlay != NULL) {
+        overlay_close(ctx->overlay);
+        ctx->overlay = NULL;
+    }
+
+    if (ctx->cache != NULL) {
+        block_cache_destroy(ctx->cache);
+        ctx->cache = NULL;
+    }
+
+    if (ctx->prefetch != NULL) {
+        prefetch_destroy(ctx->prefetch);
+        ctx->prefetch = NULL;
+    }
+
+    if (ctx->direct != NULL) {
+        aligned_io_destroy(ctx->direct);
+        ctx->direct = NULL;
+    }
+
+    if (ctx->stats != NULL) {
+        stats_destroy(ctx->stats);
+        ctx->stats = NULL;
+    }
+
+    if (ctx->dirty != NULL) {
+        dirty_map_destroy(ctx->dirty);
+        ctx->dirty = NULL;
+    }
+
+#ifdef ENABLE_HASHES
+    if (ctx->hashes != NULL) {
+        block_hash_destroy(ctx->hashes);
+        ctx->hashes = NULL;
+    }
+#endif
+
+#ifdef ENABLE_ZSTD
+    if (ctx->zstd != NULL) {
+        zstd_source_close(ctx->zstd);
+        ctx->zstd = NULL;
+    }
+#endif
+
+    if (ctx->qcow2 != NULL) {
+        qcow2_source_close(ctx->qcow2);
+        ctx->qcow2 = NULL;
+    }
+
+    if (ctx->chunks != NULL) {
+        chunk_source_close(ctx->chunks);
+        ctx->chunks = NULL;
+    }
+
+    if (ctx->extents != NULL) {
+        extent_map_destroy(ctx->extents);
+        ctx->extents = NULL;
+    }
+
     if (ctx->source_fd >= 0) {
         close(ctx->source_fd);
         ctx->source_fd = -1;
@@ -173,9 +415,23 @@ static void controlled_exit(struct partfs_context *ctx, int exit_code)
         fuse_opt_free_args(ctx->args);
     }
 
+    if (ctx->windows != NULL) {
+        for (size_t x = 0; x < ctx->window_count; x++) {
+            if (ctx->windows[x].map != NULL) {
+                munmap(ctx->windows[x].map, ctx->windows[x].map_length);
+            }
+
+            pthread_mutex_destroy(&ctx->windows[x].size_lock);
+        }
+
+        free(ctx->windows);
+        ctx->windows = NULL;
+    }
+
     if (ctx->dir_fd >= 0) {
         if (ctx->created_file) {
-            if (unlinkat(ctx->dir_fd, ctx->created_file, 0)) {
+            if (unlinkat(ctx->dir_fd, ctx->created_file,
+                         ctx->created_flags)) {
                 fprintf(stderr, "warning: couldn't remove tempfile [%s]",
                         ctx->created_file);
                 fprintf(stderr, " (%s)\n", strerror(errno));
@@ -191,76 +447,63 @@ static void controlled_exit(struct partfs_context *ctx, int exit_code)
     exit(exit_code);
 }
 
-static ssize_t read_noeintr(int fildes, void *buf, size_t nbyte)
+static int directory_is_empty(int dir_fd, const char *path)
 {
-    ssize_t result = 0;
+    struct dirent *entry = NULL;
+    DIR *dir = NULL;
+    int result = 1;
+    int fd = openat(dir_fd, path, O_RDONLY | O_DIRECTORY);
 
-    do {
-        result = read(fildes, buf, nbyte);
-    } while ((result == -1) && (errno == EINTR));
-
-    return result;
-}
+    if (fd < 0) {
+        return 0;
+    }
 
-static ssize_t write_noeintr(int fildes, const void *buf, size_t nbyte)
-{
-    ssize_t result = 0;
+    if ((dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return 0;
+    }
 
-    do {
-        result = write(fildes, buf, nbyte);
-    } while ((result == -1) && (errno == EINTR));
+    while ((entry = readdir(dir)) != NULL) {
+        if ((strcmp(entry->d_name, ".") != 0) &&
+            (strcmp(entry->d_name, "..") != 0)) {
+            result = 0;
+            break;
+        }
+    }
 
+    closedir(dir);
     return result;
 }
 
-static ssize_t read_count(int filedes, char *buf, size_t nbyte)
+static inline void safecopy(char *dest, const char *src, unsigned int maxlen)
 {
-    size_t total = 0;
-
-    while (total < nbyte) {
-        ssize_t result = read_noeintr(filedes, buf, (nbyte - total));
-
-        if (result < 0) {
-            return result;
-        }
-
-        total += (size_t) result;
-    }
-
-    return (ssize_t) nbyte;
+    size_t length = strnlen(src, maxlen - 1);
+    memcpy(dest, src, length);
+    dest[length] = '\x00';
 }
 
-static ssize_t write_count(int filedes, const char *buf, size_t nbyte)
+static void window_make_name(char *dest, size_t maxlen, unsigned int number,
+                             const char *label)
 {
-    size_t remaining = nbyte;
-
-    while (remaining != 0) {
-        ssize_t result = write_noeintr(filedes, buf, remaining);
-
-        if (result < 0) {
-            return result;
-        }
+    int length = 0;
 
-        remaining -= (size_t) result;
-        buf += result;
+    if ((label == NULL) || (label[0] == '\x00')) {
+        snprintf(dest, maxlen, "%u", number);
+        return;
     }
 
-    return (ssize_t) nbyte;
-}
+    length = snprintf(dest, maxlen, "%u-%s", number, label);
 
-static inline void safecopy(char *dest, const char *src, unsigned int maxlen)
-{
-    size_t length = strnlen(src, maxlen - 1);
-    memcpy(dest, src, length);
-    dest[length] = '\x00';
+    /* Labels can hold characters that don't belong in a filename. */
+    for (int x = 0; (x < length) && (dest[x] != '\x00'); x++) {
+        if ((dest[x] == '/') || ((unsigned char) dest[x] < 0x20)) {
+            dest[x] = '_';
+        }
+    }
 }
 
 static void exit_help(void)
 {
-    const struct fuse_operations dummy_ops = {0};
-    char help_opt[4] = "-ho";
-    char *argv[2] = {progname, help_opt};
-
     const char *partfs_help =
         "Mount part of SOURCE as a different file at MOUNTPOINT.\n"
         "\n"
@@ -273,17 +516,64 @@ static void exit_help(void)
         "\n"
         "PartFS options:\n"
         "    -o offset=NBYTES       offset into SOURCE (in bytes)\n"
-        "    -o sizelimit=NBYTES    max length of MOUNT (in bytes)"
-#ifdef ENABLE_PARTITIONS
+        "    -o sizelimit=NBYTES    max length of MOUNT (in bytes)\n"
+        "    -o threads=NTHREADS    number of worker threads (default: 1)\n"
+        "    -o overlay=FILE        send writes to FILE, leaving SOURCE as-is\n"
+        "    -o cache_size=NBYTES   size of the in-memory block cache\n"
+        "    -o cache_block=NBYTES  block size of the cache (default: 64k)\n"
+        "    -o readahead=NBYTES    max prefetch ahead of sequential readers\n"
+        "    -o combine=NBYTES      merge up to NBYTES of small writes\n"
+        "    -o combine_age=MSEC    max age of merged writes (default: 500)\n"
+        "    -o splice              zero-copy I/O between SOURCE and kernel\n"
+        "    -o writeback           enable the kernel's writeback cache\n"
+        "    -o direct_io           bypass the kernel's page cache\n"
+        "    -o source_direct       open SOURCE with O_DIRECT\n"
+        "    -o stats_file=FILE     write statistics to FILE on SIGUSR1\n"
+        "    -o stats_xattr         expose statistics as user.partfs.stats\n"
+        "    -o cbt                 track the blocks written to the mount\n"
+        "    -o cbt_file=FILE       keep changed blocks in FILE across mounts\n"
+        "    -o cbt_block=NBYTES    bytes per tracked block (default: 64k)\n"
+        "    -o cbt_export=FILE     write the changed blocks to FILE and exit\n"
+        "    -o kernel_cache        keep cached data between opens\n"
+        "    -o mmap                serve I/O from a memory map of SOURCE\n"
+        "    -o qcow2               SOURCE is a qcow2 image (read-only)\n"
+        "    -o chunks              SOURCE is the first of numbered chunks\n"
+        "    -o extents=FILE        mount the SOURCE extents listed in FILE\n"
+        "    -o fiemap=FILE         mount FILE's extents, as mapped in SOURCE\n"
+        "    -o control             manage files through MOUNT/.control\n"
+        "    -o max_windows=NUM     files that .control can add (default: 64)"
+#ifdef ENABLE_URING
+        "\n\n"
+        "    -o uring               queue SOURCE I/O through io_uring\n"
+        "    -o uring_depth=NREQS   io_uring queue depth (default: 64)\n"
+        "    -o uring_fixed         register SOURCE and I/O buffers up-front"
+#endif
+#ifdef ENABLE_HASHES
+        "\n\n"
+        "    -o hash_file=FILE      keep block hashes of the mount in FILE\n"
+        "    -o hash_block=NBYTES   bytes per hashed block (default: 1M)"
+#endif
+#ifdef ENABLE_ZSTD
+        "\n\n"
+        "    -o zstd                SOURCE is a seekable zstd image (read-only)"
+#endif
         "\n\n"
         "    -o partition=PARTNUM   partition to mount from SOURCE\n"
+        "    -o partlabel=NAME      partition to mount, by its GPT name\n"
+        "    -o partuuid=UUID       partition to mount, by its PARTUUID\n"
+        "    -o all_partitions      mount all partitions into directory MOUNT\n"
         "    -p/--print-partitions  print partition table and exit"
-#endif
         ;
 
     fprintf(stderr, partfs_help, progname);
     fprintf(stderr, "\n\n");
-    fuse_main(2, argv, &dummy_ops, NULL);
+    fflush(stderr);
+
+    /* libfuse prints its own help on stdout. */
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    printf("FUSE options:\n");
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
     exit(1);
 }
 
@@ -291,7 +581,6 @@ static int partfs_opt_proc(void *data, const char *arg, int key,
                            struct fuse_args *outargs)
 {
     struct partfs_config *config = (struct partfs_config *) data;
-    const struct fuse_operations dummy_ops = {0};
 
     switch (key) {
         case KEY_PRINT_PARTITION:
@@ -302,8 +591,12 @@ static int partfs_opt_proc(void *data, const char *arg, int key,
         case KEY_VERSION:
             fprintf(stderr, "PartFS version: %s", PACKAGE_VERSION);
             fprintf(stderr, "\n");
-            fuse_opt_add_arg(outargs, "--version");
-            fuse_main(outargs->argc, outargs->argv, &dummy_ops, NULL);
+            fprintf(stderr, "FUSE library version: %s\n", fuse_pkgversion());
+            fflush(stderr);
+
+            /* libfuse prints its version info on stdout. */
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+            fuse_lowlevel_version();
             fuse_opt_free_args(outargs);
             exit(0);
             break;
@@ -347,294 +640,2367 @@ static int partfs_opt_proc(void *data, const char *arg, int key,
     return 1;
 }
 
-static struct partfs_context * partfs_get_context(void)
+static size_t partfs_get_size(struct partfs_window *win)
 {
-    struct fuse_context *fuse_context = fuse_get_context();
-    struct partfs_context *result = NULL;
-
-    if (fuse_context == NULL) {
-        fprintf(stderr, "%s: ", progname);
-        fprintf(stderr, "%s\n", "error: couldn't retrieve FUSE context.");
-        exit(0);
-    }
+    size_t result = 0;
 
-    result = (struct partfs_context *)(fuse_context->private_data);
-
-    if (result == NULL) {
-        fprintf(stderr, "%s: ", progname);
-        fprintf(stderr, "%s\n", "error: couldn't retrieve PartFS context.");
-        exit(0);
-    }
+    pthread_mutex_lock(&win->size_lock);
+    result = win->current_size;
+    pthread_mutex_unlock(&win->size_lock);
 
     return result;
 }
 
-/*----------------------------------------------------------------------------*/
+/* MAX_SIZE only changes under SIZE_LOCK, through the control file, but can
+ * be read without it. */
+static size_t partfs_get_max_size(struct partfs_window *win)
+{
+    return __atomic_load_n(&win->max_size, __ATOMIC_ACQUIRE);
+}
 
-static int partfs_open(const char *path, struct fuse_file_info *info)
+/* Never grows the window past MAX_SIZE, which a resize may have lowered
+ * since the caller checked it. */
+static void partfs_grow_size(struct partfs_window *win, size_t stop_byte)
 {
-    (void) path;
-    (void) info;
-    struct partfs_context *ctx = partfs_get_context();
+    pthread_mutex_lock(&win->size_lock);
 
-    if (ctx->read_only && ((info->flags & O_ACCMODE) != O_RDONLY)) {
-        return -EACCES;
+    if (stop_byte > win->max_size) {
+        stop_byte = win->max_size;
     }
 
-    return 0;
+    if (stop_byte > win->current_size) {
+        win->current_size = stop_byte;
+    }
+
+    pthread_mutex_unlock(&win->size_lock);
 }
 
-static int partfs_getattr(const char *path, struct stat *stbuf)
+/* Returns the inode number for the window in SLOT. A slot that's reused by
+ * the control file gets a new number each time, so that the kernel can't
+ * mistake the new window for the old one. */
+static fuse_ino_t partfs_window_ino(struct partfs_context *ctx, size_t slot)
 {
-    (void) path;
-    struct stat source_stat = {0};
-    int result = 0;
-    struct partfs_context *ctx = partfs_get_context();
-
-    memset(stbuf, 0, sizeof(struct stat));
+    fuse_ino_t first = ctx->control ? (CONTROL_INO + 1) : FIRST_WINDOW_INO;
 
-    stbuf->st_uid = getuid();
-    stbuf->st_gid = getgid();
+    return first + (fuse_ino_t) slot +
+           ((fuse_ino_t) ctx->window_count * ctx->windows[slot].generation);
+}
 
-    stbuf->st_mode = S_IFREG | ctx->source_mode;
+static struct partfs_window * partfs_find_window(struct partfs_context *ctx,
+                                                 fuse_ino_t ino)
+{
+    fuse_ino_t first = ctx->control ? (CONTROL_INO + 1) : FIRST_WINDOW_INO;
+    struct partfs_window *win = NULL;
 
-    if (ctx->read_only) {
-        stbuf->st_mode &= DISABLE_WRITES;
+    if (ctx->directory == 0) {
+        return (ino == FUSE_ROOT_ID) ? &ctx->windows[0] : NULL;
     }
 
-    stbuf->st_nlink = 1;
-    stbuf->st_size = (off_t) ctx->current_size;
+    if ((ino < first) || (ctx->window_count == 0)) {
+        return NULL;
+    }
 
-    result = fstat(ctx->source_fd, &source_stat);
+    win = &ctx->windows[(ino - first) % ctx->window_count];
 
-    if (result < 0) {
-        return -errno;
+    /* Empty slots have an inode number of 0. */
+    if (__atomic_load_n(&win->ino, __ATOMIC_ACQUIRE) != ino) {
+        return NULL;
     }
 
-    stbuf->st_ino = source_stat.st_ino;
-    memcpy(&(stbuf->st_atim), &(source_stat.st_atim), sizeof(stbuf->st_atim));
-    memcpy(&(stbuf->st_mtim), &(source_stat.st_mtim), sizeof(stbuf->st_mtim));
-    memcpy(&(stbuf->st_ctim), &(source_stat.st_ctim), sizeof(stbuf->st_ctim));
+    return win;
+}
 
-    return 0;
+/* Returns the window called NAME, or NULL. Called with the control lock
+ * held. */
+static struct partfs_window * partfs_find_name(struct partfs_context *ctx,
+                                               const char *name)
+{
+    for (size_t x = 0; x < ctx->window_count; x++) {
+        if ((ctx->windows[x].ino != 0) &&
+            (strcmp(ctx->windows[x].name, name) == 0)) {
+            return &ctx->windows[x];
+        }
+    }
+
+    return NULL;
 }
 
-static int partfs_read(const char *path, char *buf, size_t size,
-                       off_t offset, struct fuse_file_info *info)
+/* Maps the window's part of SOURCE into memory. Empty windows are left
+ * unmapped, and fall back to regular reads and writes. */
+static int partfs_map_window(struct partfs_context *ctx,
+                             struct partfs_window *win)
 {
-    (void) path;
-    off_t lseek_result = 0;
-    ssize_t read_result = 0;
-    struct partfs_context *ctx = partfs_get_context();
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    int prot = ctx->read_only ? PROT_READ : (PROT_READ | PROT_WRITE);
+    void *map = NULL;
 
-    if (((size_t)offset + size) < (size_t)offset) {
-        /* Size + offset overflowed */
-        return -EINVAL;
+    if (win->max_size == 0) {
+        return 0;
     }
 
-    if (((size_t)offset + size) > ctx->current_size) {
-        size = ctx->current_size - (size_t) offset;
+    win->map_skew = win->source_offset % page_size;
+    win->map_length = win->map_skew + win->max_size;
+    map = mmap(NULL, win->map_length, prot, MAP_SHARED, ctx->source_fd,
+               (off_t) (win->source_offset - win->map_skew));
+
+    if (map == MAP_FAILED) {
+        return -1;
     }
 
-    if (size == 0) {
-        return 0;
+    win->map = (char *) map;
+    win->advice = MADV_NORMAL;
+    return 0;
+}
+
+/* Picks SEQUENTIAL or RANDOM for the whole map, based on whether this read
+ * picks up where the last one left off. Sequential readers also get the
+ * next stretch of the window prefetched. */
+static void partfs_map_advise(struct partfs_window *win, size_t offset,
+                              size_t size)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t expected = __atomic_exchange_n(&win->next_read, offset + size,
+                                          __ATOMIC_RELAXED);
+    int advice = (offset == expected) ? MADV_SEQUENTIAL : MADV_RANDOM;
+
+    if (__atomic_exchange_n(&win->advice, advice, __ATOMIC_RELAXED) !=
+        advice) {
+        madvise(win->map, win->map_length, advice);
     }
 
-    lseek_result = lseek(ctx->source_fd, offset + (off_t) ctx->source_offset,
-                         SEEK_SET);
+    if (advice == MADV_SEQUENTIAL) {
+        size_t start = win->map_skew + offset + size;
+        size_t length = 4 * size;
+
+        start -= (start % page_size);
+
+        if (start < win->map_length) {
+            if (length > (win->map_length - start)) {
+                length = win->map_length - start;
+            }
 
-    if (lseek_result < 0) {
-        if (info->direct_io) {
-            return (int) lseek_result;
+            madvise(win->map + start, length, MADV_WILLNEED);
         }
-        return -errno;
     }
+}
 
-    if (info->direct_io) {
-        return (int) read(ctx->source_fd, buf, size);
-    }
+/*----------------------------------------------------------------------------*/
 
-    read_result = read_count(ctx->source_fd, buf, size);
+static int partfs_fill_stat(struct partfs_context *ctx,
+                            struct partfs_window *win, struct stat *stbuf)
+{
+    struct stat source_stat = {0};
+    int result = 0;
 
-    if (read_result < 0) {
+    memset(stbuf, 0, sizeof(struct stat));
+
+    result = fstat(ctx->source_fd, &source_stat);
+
+    if (result < 0) {
         return -errno;
     }
 
-    return (int) read_result;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+
+    if (win == NULL) {
+        stbuf->st_ino = FUSE_ROOT_ID;
+        stbuf->st_mode = S_IFDIR | DEFAULT_DIR_PERMS;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_ino = ctx->directory ? win->ino : source_stat.st_ino;
+        stbuf->st_mode = S_IFREG | (ctx->source_mode & ~S_IFMT);
+        stbuf->st_nlink = 1;
+        stbuf->st_size = (off_t) partfs_get_size(win);
+    }
+
+    if (ctx->read_only) {
+        stbuf->st_mode &= DISABLE_WRITES;
+    }
+
+    memcpy(&(stbuf->st_atim), &(source_stat.st_atim), sizeof(stbuf->st_atim));
+    memcpy(&(stbuf->st_mtim), &(source_stat.st_mtim), sizeof(stbuf->st_mtim));
+    memcpy(&(stbuf->st_ctim), &(source_stat.st_ctim), sizeof(stbuf->st_ctim));
+
+    return 0;
 }
 
-static int partfs_write(const char *path, const char *buf, size_t size,
-                        off_t offset, struct fuse_file_info *info)
+static int partfs_clamp_read(struct partfs_window *win, off_t offset,
+                             size_t *size)
 {
-    (void) path;
-    off_t lseek_result = 0;
-    ssize_t write_result = 0;
-    size_t stop_byte = 0;
-
-    struct partfs_context *ctx = partfs_get_context();
+    size_t current_size = 0;
 
-    if (((size_t)offset + size) < (size_t)offset) {
+    if (((size_t)offset + *size) < (size_t)offset) {
         /* Size + offset overflowed */
         return -EINVAL;
     }
 
-    if ((size_t)offset > ctx->max_size) {
-        return -EIO;
-    }
+    current_size = partfs_get_size(win);
 
-    if (((size_t)offset == ctx->max_size) && (size != 0)) {
-        return -EIO;
+    if ((size_t)offset >= current_size) {
+        *size = 0;
+    } else if (((size_t)offset + *size) > current_size) {
+        *size = current_size - (size_t) offset;
     }
 
-    if (((size_t)offset + size) > ctx->max_size) {
-        size = ctx->max_size - (size_t) offset;
-    }
+    return 0;
+}
 
-    stop_byte = (size_t) offset + size;
+static int partfs_clamp_write(struct partfs_window *win, off_t offset,
+                              size_t *size)
+{
+    int result = 0;
 
-    if (stop_byte > ctx->current_size) {
-        ctx->current_size = stop_byte;
+    if (((size_t)offset + *size) < (size_t)offset) {
+        /* Size + offset overflowed */
+        return -EINVAL;
     }
 
-    lseek_result = lseek(ctx->source_fd, offset + (off_t) ctx->source_offset,
-                         SEEK_SET);
+    /* The limit is checked and the size grown in one go, so that a resize
+     * can't come in between. */
+    pthread_mutex_lock(&win->size_lock);
 
-    if (lseek_result < 0) {
-        if (info->direct_io) {
-            return (int) lseek_result;
+    if (((size_t)offset > win->max_size) ||
+        (((size_t)offset == win->max_size) && (*size != 0))) {
+        result = -EIO;
+    } else {
+        if (((size_t)offset + *size) > win->max_size) {
+            *size = win->max_size - (size_t) offset;
+        }
+
+        if (((size_t)offset + *size) > win->current_size) {
+            win->current_size = (size_t) offset + *size;
         }
-        return -errno;
     }
 
-    if (info->direct_io) {
-        return (int) write(ctx->source_fd, buf, size);
+    pthread_mutex_unlock(&win->size_lock);
+    return result;
+}
+
+/* Writes out any combined writes that haven't reached SOURCE yet. Returns 0,
+ * or a negative errno value if this or an earlier background flush failed. */
+static int partfs_flush_pending(struct partfs_context *ctx)
+{
+    if ((ctx->combine != NULL) && (combine_flush(ctx->combine) != 0)) {
+        return -errno;
     }
 
-    write_result = write_count(ctx->source_fd, buf, size);
+    return 0;
+}
 
-    if (write_result < 0) {
+/* Tells the changed-block bitmap (if any) that [OFFSET, OFFSET + NBYTE) of
+ * SOURCE is about to be written. It goes first, so that no write can reach
+ * SOURCE without the bitmap on disk either listing it or being flagged in
+ * use. Returns 0, or a negative errno value. */
+static int partfs_mark_write(struct partfs_context *ctx, size_t nbyte,
+                             off_t offset)
+{
+    if ((ctx->dirty != NULL) &&
+        (dirty_map_mark(ctx->dirty, nbyte, offset) != 0)) {
         return -errno;
     }
 
-    return (int) write_result;
+    return 0;
 }
 
-static int partfs_access(const char *path, int amode)
+/* Tells the block hashes (if any) that [OFFSET, OFFSET + NBYTE) of SOURCE
+ * was just written. */
+static void partfs_note_write(struct partfs_context *ctx, size_t nbyte,
+                              off_t offset)
 {
-    (void) path;
-    struct partfs_context *ctx = partfs_get_context();
+#ifdef ENABLE_HASHES
+    if (ctx->hashes != NULL) {
+        block_hash_invalidate(ctx->hashes, nbyte, offset);
+    }
+#else
+    (void) ctx;
+    (void) nbyte;
+    (void) offset;
+#endif
+}
 
-    if ((amode & W_OK) && ctx->read_only) {
-        return -EACCES;
+/* Reads SOURCE through whichever translation the mount uses (O_DIRECT, a
+ * compressed or qcow2 image, chunks or an extent list), below the overlay,
+ * the cache and combined writes. With DIRECT_IO, a raw SOURCE is read with a
+ * single pread(), so that a short read reaches the caller as it is. */
+static ssize_t partfs_translated_read(struct partfs_context *ctx, char *buf,
+                                      size_t nbyte, off_t offset,
+                                      int direct_io)
+{
+    if (ctx->direct) {
+        return aligned_io_pread(ctx->direct, buf, nbyte, offset);
+#ifdef ENABLE_ZSTD
+    } else if (ctx->zstd) {
+        return zstd_source_pread(ctx->zstd, buf, nbyte, offset);
+#endif
+    } else if (ctx->qcow2) {
+        return qcow2_source_pread(ctx->qcow2, buf, nbyte, offset);
+    } else if (ctx->chunks) {
+        return chunk_source_pread(ctx->chunks, buf, nbyte, offset);
+    } else if (ctx->extents) {
+        return extent_map_pread(ctx->extents, buf, nbyte, offset);
+    } else if (direct_io) {
+        return pread_noeintr(ctx->source_fd, buf, nbyte, offset);
     }
 
-    if (amode & X_OK) {
-        return -EACCES;
+    return pread_count(ctx->source_fd, buf, nbyte, offset);
+}
+
+/* Writes SOURCE through its translation, like partfs_translated_read(). */
+static ssize_t partfs_translated_write(struct partfs_context *ctx,
+                                       const char *buf, size_t nbyte,
+                                       off_t offset, int direct_io)
+{
+    if (ctx->direct) {
+        return aligned_io_pwrite(ctx->direct, buf, nbyte, offset);
+    } else if (ctx->chunks) {
+        return chunk_source_pwrite(ctx->chunks, buf, nbyte, offset);
+    } else if (ctx->extents) {
+        return extent_map_pwrite(ctx->extents, buf, nbyte, offset);
+    } else if (direct_io) {
+        return pwrite_noeintr(ctx->source_fd, buf, nbyte, offset);
     }
 
-    return 0;
+    return pwrite_count(ctx->source_fd, buf, nbyte, offset);
 }
 
-static int partfs_utimens(const char *path, const struct timespec tv[2])
+/* The operation that each thread is handling, so that the reply can be
+ * counted against it. */
+struct partfs_op {
+    enum stats_op op;
+    uint64_t start;
+};
+
+static __thread struct partfs_op partfs_current_op;
+
+static void partfs_op_begin(enum stats_op op)
 {
-    (void) path;
-    struct partfs_context *ctx = partfs_get_context();
+    partfs_current_op.op = op;
+    partfs_current_op.start = stats_now();
+}
 
-    int result = futimens(ctx->source_fd, tv);
+/* Counts the current operation. This has to happen before the reply, which
+ * frees REQ. */
+static void partfs_op_end(fuse_req_t req, int error, size_t nbyte)
+{
+    struct partfs_context *ctx = fuse_req_userdata(req);
 
-    if (result < 0) {
-        return -errno;
-    }
-    return 0;
+    stats_record(ctx->stats, partfs_current_op.op, partfs_current_op.start,
+                 error, nbyte);
 }
 
-static int partfs_truncate(const char *path, off_t length)
+static void partfs_reply_err(fuse_req_t req, int error)
 {
-    (void) path;
-    struct partfs_context *ctx = partfs_get_context();
+    partfs_op_end(req, error, 0);
+    fuse_reply_err(req, error);
+}
 
-    ctx->current_size = (size_t) length;
-    return 0;
+static void partfs_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+    partfs_op_end(req, 0, size);
+    fuse_reply_buf(req, buf, size);
 }
 
-static int partfs_chown(const char *path, uid_t uid, gid_t gid)
+static void partfs_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
+                              enum fuse_buf_copy_flags flags)
 {
-    (void) path;
-    (void) uid;
-    (void) gid;
-    return -EPERM;
+    partfs_op_end(req, 0, fuse_buf_size(bufv));
+    fuse_reply_data(req, bufv, flags);
 }
 
-static int partfs_chmod(const char *path, mode_t mode)
+static void partfs_reply_write(fuse_req_t req, size_t count)
 {
-    (void) path;
-    (void) mode;
-    return 0;
+    partfs_op_end(req, 0, count);
+    fuse_reply_write(req, count);
 }
 
-static int partfs_fsync(const char *path, int datasync,
-                        struct fuse_file_info *info)
+static void partfs_reply_xattr(fuse_req_t req, size_t count)
 {
-    (void) path;
-    (void) datasync;
-    (void) info;
-    struct partfs_context *ctx = partfs_get_context();
+    partfs_op_end(req, 0, 0);
+    fuse_reply_xattr(req, count);
+}
 
-    int result = fsync(ctx->source_fd);
+static void partfs_reply_attr(fuse_req_t req, const struct stat *attr,
+                              double attr_timeout)
+{
+    partfs_op_end(req, 0, 0);
+    fuse_reply_attr(req, attr, attr_timeout);
+}
 
-    if (result < 0) {
-        return -errno;
-    }
+static void partfs_reply_entry(fuse_req_t req,
+                               const struct fuse_entry_param *entry)
+{
+    partfs_op_end(req, 0, 0);
+    fuse_reply_entry(req, entry);
+}
 
-    return result;
+static void partfs_reply_open(fuse_req_t req,
+                              const struct fuse_file_info *info)
+{
+    partfs_op_end(req, 0, 0);
+    fuse_reply_open(req, info);
 }
 
-/*----------------------------------------------------------------------------*/
+static void partfs_reply_lseek(fuse_req_t req, off_t offset)
+{
+    partfs_op_end(req, 0, 0);
+    fuse_reply_lseek(req, offset);
+}
 
-static struct fuse_operations partfs_operations = {
-    .getattr = partfs_getattr,
-    .open = partfs_open,
-    .read = partfs_read,
-    .write = partfs_write,
-    .access = partfs_access,
-    .utimens = partfs_utimens,
-    .truncate = partfs_truncate,
-    .chown = partfs_chown,
-    .chmod = partfs_chmod,
-    .fsync = partfs_fsync,
-};
+/*----------------------------------------------------------------------------*/
 
-int main(int argc, char *argv[])
+static void partfs_init(void *userdata, struct fuse_conn_info *conn)
 {
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    struct partfs_config config = {.size = (size_t) -1};
-    struct partfs_context context = {.source_fd = -1, .args = &args};
+    struct partfs_context *ctx = (struct partfs_context *) userdata;
+    unsigned int splice_caps = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE;
 
-    char arg_buffer[sizeof("-ofsname=") + NAME_MAX + 2] = "-ofsname=";
-    unsigned int arg_offset = sizeof("-ofsname=") - 1;
-    unsigned int arg_maxlen = (unsigned int) sizeof(arg_buffer) - arg_offset;
+    /* libfuse trims this down to its own buffer size if it needs to. */
+    conn->max_write = MAX_IO_SIZE;
 
-    struct stat stat_buffer = {0};
-    size_t partition = (size_t) -1;
-    int result = 0;
+    if (ctx->splice) {
+        conn->want |= (conn->capable & splice_caps);
+    }
 
-    safecopy(progname, basename(argv[0]), sizeof(progname));
+    if (ctx->writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
 
-    for (int x = 1; x < argc; x++) {
+    /* Background threads are started here rather than in main(), so that
+     * they belong to the daemonized process. Statistics are only dumped to
+     * a file, since a daemon's stderr is /dev/null. */
+    if ((ctx->stats_file != NULL) &&
+        (stats_start(ctx->stats, ctx->dir_fd, ctx->stats_file) != 0)) {
+        fprintf(stderr, "%s: ", progname);
+        fprintf(stderr, "warning: couldn't start statistics dumper");
+        fprintf(stderr, " (%s)\n", strerror(errno));
+    }
+
+    if ((ctx->combine != NULL) && (combine_start(ctx->combine) != 0)) {
+        fprintf(stderr, "%s: ", progname);
+        fprintf(stderr, "warning: couldn't start write-combine flusher");
+        fprintf(stderr, " (%s)\n", strerror(errno));
+    }
+
+#ifdef ENABLE_URING
+    if (ctx->uring_depth != 0) {
+        if (uring_engine_start(&ctx->uring, ctx->source_fd,
+                               (unsigned int) ctx->uring_depth, MAX_IO_SIZE,
+                               ctx->uring_fixed) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "warning: couldn't set up io_uring");
+            fprintf(stderr, " (%s), using blocking I/O\n", strerror(errno));
+            ctx->uring = NULL;
+        }
+    }
+#endif
+}
+
+static void partfs_destroy(void *userdata)
+{
+    struct partfs_context *ctx = (struct partfs_context *) userdata;
+
+    if (ctx->combine != NULL) {
+        combine_stop(ctx->combine);
+    }
+
+    stats_stop(ctx->stats);
+
+#ifdef ENABLE_URING
+    uring_engine_stop(ctx->uring);
+    ctx->uring = NULL;
+#endif
+
+    if ((ctx->cbt_file != NULL) &&
+        (dirty_map_save(ctx->dirty) != 0)) {
+        fprintf(stderr, "%s: ", progname);
+        fprintf(stderr, "warning: couldn't save changed blocks to [%s]",
+                ctx->cbt_file);
+        fprintf(stderr, " (%s)\n", strerror(errno));
+    }
+
+#ifdef ENABLE_HASHES
+    /* Every write has landed by now, so SOURCE's mtime is final. */
+    if ((ctx->hashes != NULL) &&
+        (block_hash_save(ctx->hashes, ctx->dir_fd, ctx->hash_file,
+                         ctx->source_fd) != 0)) {
+        fprintf(stderr, "%s: ", progname);
+        fprintf(stderr, "warning: couldn't save block hashes to [%s]",
+                ctx->hash_file);
+        fprintf(stderr, " (%s)\n", strerror(errno));
+    }
+#endif
+}
+
+#ifdef ENABLE_URING
+/* Completions run on the engine's thread, which picks up the operation that
+ * the worker started. */
+static void partfs_uring_read_done(struct uring_request *request,
+                                   ssize_t result)
+{
+    fuse_req_t req = (fuse_req_t) request->data;
+
+    partfs_current_op.op = STATS_READ;
+    partfs_current_op.start = request->start;
+
+    if (result < 0) {
+        partfs_reply_err(req, (int) -result);
+    } else {
+        partfs_reply_buf(req, request->buffer, (size_t) result);
+    }
+}
+
+static void partfs_uring_write_done(struct uring_request *request,
+                                    ssize_t result)
+{
+    fuse_req_t req = (fuse_req_t) request->data;
+
+    partfs_current_op.op = STATS_WRITE;
+    partfs_current_op.start = request->start;
+
+    partfs_note_write(fuse_req_userdata(req), request->nbyte,
+                      request->offset);
+
+    if (result < 0) {
+        partfs_reply_err(req, (int) -result);
+    } else {
+        partfs_reply_write(req, (size_t) result);
+    }
+}
+
+/* Queues a read (BUF is NULL) or write of SIZE bytes at SOURCE offset OFFSET,
+ * and returns straight away. The reply is sent from the engine's completion
+ * thread, which leaves this worker free to pick up the next request. */
+static void partfs_uring_queue(fuse_req_t req, struct partfs_context *ctx,
+                               const char *buf, size_t size, off_t offset)
+{
+    struct uring_request *request = uring_request_get(ctx->uring, size);
+    int write = (buf != NULL);
+
+    if (request == NULL) {
+        partfs_reply_err(req, errno);
+        return;
+    }
+
+    if (write) {
+        memcpy(request->buffer, buf, size);
+    }
+
+    request->start = partfs_current_op.start;
+
+    if (uring_request_submit(ctx->uring, request, write, offset,
+                             write ? partfs_uring_write_done :
+                             partfs_uring_read_done, req) != 0) {
+        partfs_reply_err(req, errno);
+    }
+}
+#endif
+
+/* Fills in the control file's attributes. It's always empty, since what it
+ * reads back changes with every command. */
+static int partfs_fill_control_stat(struct partfs_context *ctx,
+                                    struct stat *stbuf)
+{
+    int result = partfs_fill_stat(ctx, NULL, stbuf);
+
+    stbuf->st_ino = CONTROL_INO;
+    stbuf->st_mode = S_IFREG | 0600U;
+    stbuf->st_nlink = 1;
+    return result;
+}
+
+/* Adds the window NAME over [OFFSET, OFFSET + SIZE) of SOURCE. Returns 0 or
+ * an errno value. Called with the control lock held. */
+static int partfs_control_add(struct partfs_context *ctx, const char *name,
+                              const char *offset_string,
+                              const char *size_string)
+{
+    struct partfs_window *win = NULL;
+    size_t offset = 0;
+    size_t size = 0;
+    size_t slot = 0;
+
+    if ((strlen(name) > NAME_MAX) || (strchr(name, '/') != NULL) ||
+        (strcmp(name, ".") == 0) || (strcmp(name, "..") == 0) ||
+        (strcmp(name, CONTROL_NAME) == 0) ||
+        parse_number(offset_string, &offset) ||
+        parse_number(size_string, &size) || (offset > ctx->source_size) ||
+        (size > (ctx->source_size - offset))) {
+        return EINVAL;
+    }
+
+    if (partfs_find_name(ctx, name) != NULL) {
+        return EEXIST;
+    }
+
+    /* Slots are handed out in turn, so that a removed window's slot stays
+     * empty for as long as possible. */
+    for (size_t x = 0; x < ctx->window_count; x++) {
+        slot = (ctx->next_slot + x) % ctx->window_count;
+
+        if (ctx->windows[slot].ino == 0) {
+            win = &ctx->windows[slot];
+            break;
+        }
+    }
+
+    if (win == NULL) {
+        return ENOSPC;
+    }
+
+    snprintf(win->name, sizeof(win->name), "%s", name);
+    win->source_offset = offset;
+
+    pthread_mutex_lock(&win->size_lock);
+    __atomic_store_n(&win->max_size, size, __ATOMIC_RELEASE);
+    win->current_size = size;
+    pthread_mutex_unlock(&win->size_lock);
+
+    win->generation++;
+    ctx->next_slot = slot + 1;
+    __atomic_store_n(&win->ino, partfs_window_ino(ctx, slot),
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Changes the size of window NAME to SIZE bytes. Returns 0 or an errno
+ * value. Called with the control lock held. */
+static int partfs_control_resize(struct partfs_context *ctx, const char *name,
+                                 const char *size_string)
+{
+    struct partfs_window *win = partfs_find_name(ctx, name);
+    size_t size = 0;
+
+    if (win == NULL) {
+        return ENOENT;
+    }
+
+    if (parse_number(size_string, &size) ||
+        (size > (ctx->source_size - win->source_offset))) {
+        return EINVAL;
+    }
+
+    pthread_mutex_lock(&win->size_lock);
+    __atomic_store_n(&win->max_size, size, __ATOMIC_RELEASE);
+    win->current_size = size;
+    pthread_mutex_unlock(&win->size_lock);
+    return 0;
+}
+
+/* Removes window NAME, unless it's open. Returns 0 or an errno value. Called
+ * with the control lock held. */
+static int partfs_control_remove(struct partfs_context *ctx, const char *name)
+{
+    struct partfs_window *win = partfs_find_name(ctx, name);
+
+    if (win == NULL) {
+        return ENOENT;
+    }
+
+    if (__atomic_load_n(&win->open_count, __ATOMIC_ACQUIRE) != 0) {
+        return EBUSY;
+    }
+
+    __atomic_store_n(&win->ino, 0, __ATOMIC_RELEASE);
+    win->name[0] = '\x00';
+    return 0;
+}
+
+/* Runs one line written to the control file. Returns 0 or an errno value. */
+static int partfs_control_command(struct partfs_context *ctx, char *line)
+{
+    char *words[5] = {NULL};
+    char *save = NULL;
+    size_t count = 0;
+    int result = EINVAL;
+
+    for (char *word = strtok_r(line, " \t\r", &save);
+         (word != NULL) && (count < 5); word = strtok_r(NULL, " \t\r", &save)) {
+        words[count++] = word;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ctx->control_lock);
+
+    if ((strcmp(words[0], "add") == 0) && (count == 4)) {
+        result = partfs_control_add(ctx, words[1], words[2], words[3]);
+    } else if ((strcmp(words[0], "resize") == 0) && (count == 3)) {
+        result = partfs_control_resize(ctx, words[1], words[2]);
+    } else if ((strcmp(words[0], "remove") == 0) && (count == 2)) {
+        result = partfs_control_remove(ctx, words[1]);
+    }
+
+    pthread_mutex_unlock(&ctx->control_lock);
+    return result;
+}
+
+static void partfs_control_write(fuse_req_t req, struct partfs_context *ctx,
+                                 const char *buf, size_t size)
+{
+    char *commands = malloc(size + 1);
+    char *save = NULL;
+    int result = 0;
+
+    if (commands == NULL) {
+        partfs_reply_err(req, ENOMEM);
+        return;
+    }
+
+    memcpy(commands, buf, size);
+    commands[size] = '\x00';
+
+    /* Commands before a failing one stay done. */
+    for (char *line = strtok_r(commands, "\n", &save);
+         (line != NULL) && (result == 0); line = strtok_r(NULL, "\n", &save)) {
+        result = partfs_control_command(ctx, line);
+    }
+
+    free(commands);
+
+    if (result != 0) {
+        partfs_reply_err(req, result);
+    } else {
+        partfs_reply_write(req, size);
+    }
+}
+
+/* Replies with the current windows, one "NAME OFFSET SIZE" line each. */
+static void partfs_control_read(fuse_req_t req, struct partfs_context *ctx,
+                                size_t size, off_t offset)
+{
+    size_t line_max = NAME_MAX + sizeof(" 18446744073709551615") * 2 + 1;
+    char *buffer = NULL;
+    size_t length = 0;
+
+    pthread_mutex_lock(&ctx->control_lock);
+
+    if ((buffer = malloc((ctx->window_count * line_max) + 1)) == NULL) {
+        pthread_mutex_unlock(&ctx->control_lock);
+        partfs_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (size_t x = 0; x < ctx->window_count; x++) {
+        struct partfs_window *win = &ctx->windows[x];
+
+        if (win->ino != 0) {
+            length += (size_t) snprintf(buffer + length, line_max,
+                                        "%s %zu %zu\n", win->name,
+                                        win->source_offset,
+                                        partfs_get_size(win));
+        }
+    }
+
+    pthread_mutex_unlock(&ctx->control_lock);
+
+    if ((offset < 0) || ((size_t) offset >= length)) {
+        partfs_reply_buf(req, NULL, 0);
+    } else {
+        if (size > (length - (size_t) offset)) {
+            size = length - (size_t) offset;
+        }
+
+        partfs_reply_buf(req, buffer + offset, size);
+    }
+
+    free(buffer);
+}
+
+/* Files that the control file can change or remove mustn't be cached by the
+ * kernel. Telling it about each change instead could deadlock against a
+ * lookup that's waiting on this thread. */
+static double partfs_attr_timeout(struct partfs_context *ctx)
+{
+    return ctx->control ? 0.0 : ATTR_TIMEOUT;
+}
+
+static void partfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param entry = {0};
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = NULL;
+    int result = 0;
+
+    partfs_op_begin(STATS_LOOKUP);
+
+    /* In single-file mode, the mounted file is the root inode and nothing
+     * lives underneath it. */
+    if ((ctx->directory == 0) || (parent != FUSE_ROOT_ID)) {
+        partfs_reply_err(req, ENOENT);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->control_lock);
+
+    if (ctx->control && (strcmp(name, CONTROL_NAME) == 0)) {
+        result = partfs_fill_control_stat(ctx, &entry.attr);
+        entry.ino = CONTROL_INO;
+    } else if ((win = partfs_find_name(ctx, name)) != NULL) {
+        result = partfs_fill_stat(ctx, win, &entry.attr);
+        entry.ino = win->ino;
+    } else {
+        result = -ENOENT;
+    }
+
+    pthread_mutex_unlock(&ctx->control_lock);
+
+    if (result < 0) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    entry.attr_timeout = partfs_attr_timeout(ctx);
+    entry.entry_timeout = partfs_attr_timeout(ctx);
+    partfs_reply_entry(req, &entry);
+}
+
+/* Replies with the attributes of INO, as part of whichever operation is
+ * running. */
+static void partfs_reply_stat(fuse_req_t req, fuse_ino_t ino)
+{
+    struct stat stbuf;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    int result = 0;
+
+    if (ctx->control && (ino == CONTROL_INO)) {
+        result = partfs_fill_control_stat(ctx, &stbuf);
+    } else if ((win == NULL) && (ino != FUSE_ROOT_ID)) {
+        partfs_reply_err(req, ENOENT);
+        return;
+    } else {
+        result = partfs_fill_stat(ctx, win, &stbuf);
+    }
+
+    if (result < 0) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    partfs_reply_attr(req, &stbuf, partfs_attr_timeout(ctx));
+}
+
+static void partfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *info)
+{
+    (void) info;
+
+    partfs_op_begin(STATS_GETATTR);
+    partfs_reply_stat(req, ino);
+}
+
+static void partfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                           int to_set, struct fuse_file_info *info)
+{
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+
+    partfs_op_begin((to_set & FUSE_SET_ATTR_SIZE) ? STATS_TRUNCATE :
+                    STATS_SETATTR);
+
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        partfs_reply_err(req, EPERM);
+        return;
+    }
+
+    /* Shells truncate the control file before writing a command to it. */
+    if (ctx->control && (ino == CONTROL_INO)) {
+        partfs_reply_stat(req, ino);
+        return;
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (win == NULL) {
+            partfs_reply_err(req, EISDIR);
+            return;
+        }
+
+        pthread_mutex_lock(&win->size_lock);
+        win->current_size = (size_t) attr->st_size;
+        pthread_mutex_unlock(&win->size_lock);
+    }
+
+    /* Timestamps belong to SOURCE, which an overlay mount never modifies. */
+    if ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) &&
+        (ctx->overlay == NULL)) {
+        struct timespec tv[2] = {
+            {.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+            {.tv_sec = 0, .tv_nsec = UTIME_OMIT}
+        };
+
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+            tv[0].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_ATIME) {
+            tv[0] = attr->st_atim;
+        }
+
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            tv[1].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_MTIME) {
+            tv[1] = attr->st_mtim;
+        }
+
+        if (futimens(ctx->source_fd, tv) < 0) {
+            partfs_reply_err(req, errno);
+            return;
+        }
+    }
+
+    /* Mode changes are accepted, but never applied to SOURCE. */
+    partfs_reply_stat(req, ino);
+}
+
+static void partfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t offset, struct fuse_file_info *info)
+{
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    size_t first = ctx->control ? 3 : 2;
+    size_t entry_count = ctx->window_count + first;
+    size_t used = 0;
+    char *buffer = NULL;
+
+    partfs_op_begin(STATS_READDIR);
+
+    if ((ctx->directory == 0) || (ino != FUSE_ROOT_ID)) {
+        partfs_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    if ((buffer = malloc(size)) == NULL) {
+        partfs_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->control_lock);
+
+    /* Entry X lives at offset X, and reports X + 1 as the next offset. Empty
+     * slots keep their offsets, so that removing a window doesn't shift the
+     * ones after it. */
+    for (size_t x = (size_t) offset; x < entry_count; x++) {
+        struct stat stbuf = {0};
+        const char *name = NULL;
+        size_t entry_size = 0;
+
+        if (x < 2) {
+            name = (x == 0) ? "." : "..";
+            stbuf.st_ino = FUSE_ROOT_ID;
+            stbuf.st_mode = S_IFDIR;
+        } else if (x < first) {
+            name = CONTROL_NAME;
+            stbuf.st_ino = CONTROL_INO;
+            stbuf.st_mode = S_IFREG;
+        } else if (ctx->windows[x - first].ino != 0) {
+            name = ctx->windows[x - first].name;
+            stbuf.st_ino = ctx->windows[x - first].ino;
+            stbuf.st_mode = S_IFREG;
+        } else {
+            continue;
+        }
+
+        entry_size = fuse_add_direntry(req, buffer + used, size - used, name,
+                                       &stbuf, (off_t)(x + 1));
+
+        if (entry_size > (size - used)) {
+            break;
+        }
+
+        used += entry_size;
+    }
+
+    pthread_mutex_unlock(&ctx->control_lock);
+    partfs_reply_buf(req, buffer, used);
+    free(buffer);
+}
+
+static void partfs_open(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *info)
+{
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = NULL;
+
+    partfs_op_begin(STATS_OPEN);
+
+    if (ctx->control && (ino == CONTROL_INO)) {
+        /* What it reads back has nothing to do with its size. */
+        info->direct_io = 1;
+        partfs_reply_open(req, info);
+        return;
+    }
+
+    /* Held so that the window can't be removed before it's counted as
+     * open. */
+    pthread_mutex_lock(&ctx->control_lock);
+
+    if ((win = partfs_find_window(ctx, ino)) == NULL) {
+        pthread_mutex_unlock(&ctx->control_lock);
+        partfs_reply_err(req, EISDIR);
+        return;
+    }
+
+    if (ctx->read_only && ((info->flags & O_ACCMODE) != O_RDONLY)) {
+        pthread_mutex_unlock(&ctx->control_lock);
+        partfs_reply_err(req, EACCES);
+        return;
+    }
+
+    __atomic_add_fetch(&win->open_count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&ctx->control_lock);
+
+    info->direct_io = (ctx->direct_io != 0);
+    info->keep_cache = (ctx->kernel_cache != 0);
+    partfs_reply_open(req, info);
+}
+
+static void partfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t offset, struct fuse_file_info *info)
+{
+    char *buffer = NULL;
+    ssize_t read_result = 0;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    int result = 0;
+
+    partfs_op_begin(STATS_READ);
+
+    if (ctx->control && (ino == CONTROL_INO)) {
+        partfs_control_read(req, ctx, size, offset);
+        return;
+    }
+
+    if (win == NULL) {
+        partfs_reply_err(req, EISDIR);
+        return;
+    }
+
+    if ((result = partfs_clamp_read(win, offset, &size)) != 0) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    if ((win->map != NULL) &&
+        (((size_t) offset + size) <= partfs_get_max_size(win))) {
+        partfs_map_advise(win, (size_t) offset, size);
+        partfs_reply_buf(req, win->map + win->map_skew + offset, size);
+        return;
+    }
+
+    offset += (off_t) win->source_offset;
+
+    if (ctx->prefetch) {
+        prefetch_note(ctx->prefetch, offset, size,
+                      (off_t) (win->source_offset +
+                               partfs_get_max_size(win)));
+    }
+
+    if (ctx->splice && (ctx->overlay == NULL)) {
+        /* Hand FUSE a descriptor instead of data, so that it can splice
+         * straight from SOURCE into the kernel. */
+        struct fuse_bufvec bufvec = FUSE_BUFVEC_INIT(size);
+        bufvec.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufvec.buf[0].fd = ctx->source_fd;
+        bufvec.buf[0].pos = offset;
+
+        if (!info->direct_io) {
+            bufvec.buf[0].flags |= FUSE_BUF_FD_RETRY;
+        }
+
+        partfs_reply_data(req, &bufvec, (enum fuse_buf_copy_flags) 0);
+        return;
+    }
+
+    if (size == 0) {
+        partfs_reply_buf(req, NULL, 0);
+        return;
+    }
+
+#ifdef ENABLE_URING
+    if ((ctx->uring != NULL) && (size <= MAX_IO_SIZE)) {
+        partfs_uring_queue(req, ctx, NULL, size, offset);
+        return;
+    }
+#endif
+
+    buffer = malloc(size);
+
+    if (buffer == NULL) {
+        partfs_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if (ctx->overlay) {
+        read_result = overlay_pread(ctx->overlay, buffer, size, offset);
+    } else if (ctx->cache) {
+        read_result = block_cache_pread(ctx->cache, buffer, size, offset);
+    } else if (ctx->combine) {
+        read_result = combine_pread(ctx->combine, buffer, size, offset);
+    } else {
+        read_result = partfs_translated_read(ctx, buffer, size, offset,
+                                             info->direct_io);
+    }
+
+    if (read_result < 0) {
+        partfs_reply_err(req, errno);
+    } else {
+        partfs_reply_buf(req, buffer, (size_t) read_result);
+    }
+
+    free(buffer);
+}
+
+static void partfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                         size_t size, off_t offset,
+                         struct fuse_file_info *info)
+{
+    ssize_t write_result = 0;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    int result = 0;
+    int error = 0;
+
+    partfs_op_begin(STATS_WRITE);
+
+    /* Commands don't care where they were written. */
+    if (ctx->control && (ino == CONTROL_INO)) {
+        partfs_control_write(req, ctx, buf, size);
+        return;
+    }
+
+    if (win == NULL) {
+        partfs_reply_err(req, EISDIR);
+        return;
+    }
+
+    if (((result = partfs_clamp_write(win, offset, &size)) != 0) ||
+        ((result = partfs_mark_write(ctx, size, offset +
+                                     (off_t) win->source_offset)) != 0)) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    if (win->map != NULL) {
+        memcpy(win->map + win->map_skew + offset, buf, size);
+        partfs_note_write(ctx, size, offset + (off_t) win->source_offset);
+        partfs_reply_write(req, size);
+        return;
+    }
+
+    offset += (off_t) win->source_offset;
+
+#ifdef ENABLE_URING
+    if ((ctx->uring != NULL) && (size != 0) && (size <= MAX_IO_SIZE)) {
+        partfs_uring_queue(req, ctx, buf, size, offset);
+        return;
+    }
+#endif
+
+    if (ctx->overlay) {
+        write_result = overlay_pwrite(ctx->overlay, buf, size, offset);
+    } else if (ctx->combine) {
+        write_result = combine_write(ctx->combine, buf, size, offset);
+    } else {
+        write_result = partfs_translated_write(ctx, buf, size, offset,
+                                               info->direct_io);
+    }
+
+    /* Even a failed write may have changed part of the range, so a cache
+     * only keeps its blocks when all of it went through. */
+    error = errno;
+    partfs_note_write(ctx, size, offset);
+
+    if (ctx->cache) {
+        if ((write_result >= 0) && ((size_t) write_result == size)) {
+            block_cache_update(ctx->cache, buf, size, offset);
+        } else {
+            block_cache_invalidate(ctx->cache, size, offset);
+        }
+    }
+
+    if (write_result < 0) {
+        partfs_reply_err(req, error);
+        return;
+    }
+
+    partfs_reply_write(req, (size_t) write_result);
+}
+
+static void partfs_write_buf(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_bufvec *bufv, off_t offset,
+                             struct fuse_file_info *info)
+{
+    size_t size = fuse_buf_size(bufv);
+    ssize_t write_result = 0;
+    struct fuse_bufvec dest = FUSE_BUFVEC_INIT(0);
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    int result = 0;
+
+    partfs_op_begin(STATS_WRITE);
+
+    if (win == NULL) {
+        partfs_reply_err(req, EISDIR);
+        return;
+    }
+
+    if (((result = partfs_clamp_write(win, offset, &size)) != 0) ||
+        ((result = partfs_mark_write(ctx, size, offset +
+                                     (off_t) win->source_offset)) != 0)) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    dest.buf[0].size = size;
+    dest.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dest.buf[0].fd = ctx->source_fd;
+    dest.buf[0].pos = offset + (off_t) win->source_offset;
+
+    if (!info->direct_io) {
+        dest.buf[0].flags |= FUSE_BUF_FD_RETRY;
+    }
+
+    write_result = fuse_buf_copy(&dest, bufv, FUSE_BUF_SPLICE_NONBLOCK);
+    partfs_note_write(ctx, size, dest.buf[0].pos);
+
+    if (write_result < 0) {
+        partfs_reply_err(req, (int) -write_result);
+        return;
+    }
+
+    partfs_reply_write(req, (size_t) write_result);
+}
+
+static void partfs_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    int is_control = (ctx->control && (ino == CONTROL_INO));
+    int is_file = (partfs_find_window(ctx, ino) != NULL) || is_control;
+
+    partfs_op_begin(STATS_ACCESS);
+
+    if ((mask & W_OK) && !is_control && (ctx->read_only || !is_file)) {
+        partfs_reply_err(req, EACCES);
+        return;
+    }
+
+    if ((mask & X_OK) && is_file) {
+        partfs_reply_err(req, EACCES);
+        return;
+    }
+
+    partfs_reply_err(req, 0);
+}
+
+static void partfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *info)
+{
+    (void) datasync;
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    int result = 0;
+
+    partfs_op_begin(STATS_FSYNC);
+
+    if ((result = partfs_flush_pending(ctx)) != 0) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    if ((win != NULL) && (win->map != NULL)) {
+        if (msync(win->map, win->map_length, MS_SYNC) < 0) {
+            partfs_reply_err(req, errno);
+            return;
+        }
+    }
+
+    if (ctx->overlay) {
+        if (overlay_sync(ctx->overlay) < 0) {
+            partfs_reply_err(req, errno);
+            return;
+        }
+    } else if (ctx->chunks) {
+        if (chunk_source_sync(ctx->chunks) < 0) {
+            partfs_reply_err(req, errno);
+            return;
+        }
+    } else if (fsync(ctx->source_fd) < 0) {
+        partfs_reply_err(req, errno);
+        return;
+    }
+
+    /* Data that's made it to disk must not outlive the record of it. */
+    if ((ctx->cbt_file != NULL) &&
+        (dirty_map_save(ctx->dirty) != 0)) {
+        partfs_reply_err(req, errno);
+        return;
+    }
+
+    partfs_reply_err(req, 0);
+}
+
+static void partfs_flush(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *info)
+{
+    (void) ino;
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+
+    partfs_op_begin(STATS_FLUSH);
+
+    partfs_reply_err(req, -partfs_flush_pending(ctx));
+}
+
+static void partfs_release(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *info)
+{
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+
+    partfs_op_begin(STATS_RELEASE);
+
+    if (win != NULL) {
+        __atomic_sub_fetch(&win->open_count, 1, __ATOMIC_RELEASE);
+    }
+
+    partfs_reply_err(req, -partfs_flush_pending(ctx));
+}
+
+static void partfs_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                             off_t offset, off_t length,
+                             struct fuse_file_info *info)
+{
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    int clear = mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE);
+    size_t stop_byte = 0;
+    size_t max_size = 0;
+    int result = 0;
+
+    partfs_op_begin(STATS_FALLOCATE);
+
+    if (win == NULL) {
+        partfs_reply_err(req, EISDIR);
+        return;
+    }
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE |
+                 FALLOC_FL_ZERO_RANGE)) {
+        partfs_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+
+    /* SOURCE is off-limits with an overlay, and the delta can't record a
+     * hole that SOURCE doesn't have. */
+    if (ctx->overlay) {
+        partfs_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+
+    if (ctx->read_only) {
+        partfs_reply_err(req, EROFS);
+        return;
+    }
+
+    if ((offset < 0) || (length <= 0) ||
+        (((size_t) offset + (size_t) length) < (size_t) offset)) {
+        partfs_reply_err(req, EINVAL);
+        return;
+    }
+
+    stop_byte = (size_t) offset + (size_t) length;
+    max_size = partfs_get_max_size(win);
+
+    if (stop_byte > max_size) {
+        /* Space past the window isn't ours to allocate. Clearing it is a
+         * no-op, since it can never be read back through the window. */
+        if (!clear) {
+            partfs_reply_err(req, ENOSPC);
+            return;
+        }
+
+        stop_byte = max_size;
+
+        if ((size_t) offset >= stop_byte) {
+            partfs_reply_err(req, 0);
+            return;
+        }
+    }
+
+    length = (off_t) (stop_byte - (size_t) offset);
+    offset += (off_t) win->source_offset;
+
+    /* Pending writes came first, so they mustn't land on top of this. */
+    if (((result = partfs_mark_write(ctx, (size_t) length, offset)) != 0) ||
+        ((result = partfs_flush_pending(ctx)) != 0)) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    /* The window always fits inside SOURCE, so SOURCE's size never changes.
+     * Only the window's size follows the caller's KEEP_SIZE flag. */
+    if (ctx->chunks) {
+        result = chunk_source_fallocate(ctx->chunks,
+                                        mode | FALLOC_FL_KEEP_SIZE, offset,
+                                        length);
+    } else if (ctx->extents) {
+        result = extent_map_fallocate(ctx->extents,
+                                      mode | FALLOC_FL_KEEP_SIZE, offset,
+                                      length);
+    } else {
+        result = fallocate(ctx->source_fd, mode | FALLOC_FL_KEEP_SIZE,
+                           offset, length);
+    }
+
+    if (result < 0) {
+        partfs_reply_err(req, errno);
+        return;
+    }
+
+    if (ctx->cache) {
+        block_cache_invalidate(ctx->cache, (size_t) length, offset);
+    }
+
+    partfs_note_write(ctx, (size_t) length, offset);
+
+    if ((mode & FALLOC_FL_KEEP_SIZE) == 0) {
+        partfs_grow_size(win, stop_byte);
+    }
+
+    partfs_reply_err(req, 0);
+}
+
+static void partfs_copy_file_range(fuse_req_t req, fuse_ino_t ino_in,
+                                   off_t off_in,
+                                   struct fuse_file_info *info_in,
+                                   fuse_ino_t ino_out, off_t off_out,
+                                   struct fuse_file_info *info_out,
+                                   size_t len, int flags)
+{
+    (void) info_in;
+    (void) info_out;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win_in = partfs_find_window(ctx, ino_in);
+    struct partfs_window *win_out = partfs_find_window(ctx, ino_out);
+    size_t source_in = 0;
+    size_t source_out = 0;
+    size_t copied = 0;
+    int result = 0;
+
+    partfs_op_begin(STATS_COPY_FILE_RANGE);
+
+    if ((win_in == NULL) || (win_out == NULL)) {
+        partfs_reply_err(req, EISDIR);
+        return;
+    }
+
+    if ((result = partfs_clamp_read(win_in, off_in, &len)) != 0) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    source_in = (size_t) off_in + win_in->source_offset;
+    source_out = (size_t) off_out + win_out->source_offset;
+
+    /* copy_file_range(2) refuses overlapping ranges within one file, an
+     * overlay has to see the data, O_DIRECT needs aligned ranges, and a
+     * compressed, qcow2, chunked or extent-mapped SOURCE has to be
+     * translated. EOPNOTSUPP makes the kernel fall back to regular reads and
+     * writes for all of them. */
+    if ((ctx->overlay != NULL) || (ctx->direct != NULL) ||
+        (ctx->zstd != NULL) || (ctx->qcow2 != NULL) ||
+        (ctx->chunks != NULL) || (ctx->extents != NULL) ||
+        ((source_in < (source_out + len)) &&
+         (source_out < (source_in + len)))) {
+        partfs_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+
+    if ((len != 0) &&
+        ((result = partfs_clamp_write(win_out, off_out, &len)) != 0)) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    if (((result = partfs_mark_write(ctx, len, (off_t) source_out)) != 0) ||
+        ((result = partfs_flush_pending(ctx)) != 0)) {
+        partfs_reply_err(req, -result);
+        return;
+    }
+
+    off_in = (off_t) source_in;
+    off_out = (off_t) source_out;
+
+    while (copied < len) {
+        ssize_t copy_result = copy_file_range(ctx->source_fd, &off_in,
+                                              ctx->source_fd, &off_out,
+                                              len - copied,
+                                              (unsigned int) flags);
+
+        if (copy_result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (copied != 0) {
+                break;
+            }
+
+            result = errno;
+
+            if ((result == ENOSYS) || (result == EXDEV)) {
+                result = EOPNOTSUPP;
+            }
+
+            partfs_reply_err(req, result);
+            return;
+        }
+
+        if (copy_result == 0) {
+            break;
+        }
+
+        copied += (size_t) copy_result;
+    }
+
+    if (ctx->cache) {
+        block_cache_invalidate(ctx->cache, copied, (off_t) source_out);
+    }
+
+    partfs_note_write(ctx, copied, (off_t) source_out);
+
+    partfs_reply_write(req, copied);
+}
+
+static void partfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t offset,
+                         int whence, struct fuse_file_info *info)
+{
+    (void) info;
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    size_t current_size = 0;
+    off_t result = 0;
+    int error = 0;
+
+    partfs_op_begin(STATS_LSEEK);
+
+    if ((win == NULL) || ((whence != SEEK_DATA) && (whence != SEEK_HOLE))) {
+        partfs_reply_err(req, EINVAL);
+        return;
+    }
+
+    current_size = partfs_get_size(win);
+
+    if ((offset < 0) || ((size_t) offset >= current_size)) {
+        partfs_reply_err(req, ENXIO);
+        return;
+    }
+
+    if ((error = partfs_flush_pending(ctx)) != 0) {
+        partfs_reply_err(req, -error);
+        return;
+    }
+
+    /* The overlay can fill in SOURCE's holes, and a compressed, qcow2,
+     * chunked or extent-mapped SOURCE's holes are at the wrong offsets, so
+     * report the whole window as data. That's always a valid answer, just not
+     * a sparse one. */
+    if (ctx->overlay || ctx->zstd || ctx->qcow2 || ctx->chunks ||
+        ctx->extents) {
+        partfs_reply_lseek(req, (whence == SEEK_DATA) ? offset :
+                           (off_t) current_size);
+        return;
+    }
+
+    result = lseek(ctx->source_fd, offset + (off_t) win->source_offset,
+                   whence);
+
+    if (result < 0) {
+        if ((errno == ENXIO) && (whence == SEEK_HOLE)) {
+            /* Past the end of SOURCE - the rest of the window is a hole. */
+            partfs_reply_lseek(req, offset);
+        } else {
+            partfs_reply_err(req, errno);
+        }
+        return;
+    }
+
+    result -= (off_t) win->source_offset;
+
+    if ((size_t) result >= current_size) {
+        if (whence == SEEK_DATA) {
+            partfs_reply_err(req, ENXIO);
+            return;
+        }
+
+        result = (off_t) current_size;
+    }
+
+    partfs_reply_lseek(req, result);
+}
+
+#ifdef ENABLE_HASHES
+/* Replies with the digest of window WIN, as 16 hex digits. */
+static void partfs_reply_digest(fuse_req_t req, struct partfs_context *ctx,
+                                struct partfs_window *win, size_t size)
+{
+    char digest_string[sizeof("0123456789abcdef")];
+    uint64_t digest = 0;
+
+    if (size == 0) {
+        partfs_reply_xattr(req, sizeof(digest_string) - 1);
+        return;
+    }
+
+    if (size < (sizeof(digest_string) - 1)) {
+        partfs_reply_err(req, ERANGE);
+        return;
+    }
+
+    if (block_hash_digest(ctx->hashes, (size_t) (win - ctx->windows),
+                          partfs_get_size(win), &digest) != 0) {
+        partfs_reply_err(req, errno);
+        return;
+    }
+
+    snprintf(digest_string, sizeof(digest_string), "%016" PRIx64, digest);
+    partfs_reply_buf(req, digest_string, sizeof(digest_string) - 1);
+}
+#endif
+
+/* Replies with window WIN's changed blocks, one "OFFSET LENGTH" line each. */
+static void partfs_reply_changes(fuse_req_t req, struct partfs_context *ctx,
+                                 struct partfs_window *win, size_t size)
+{
+    size_t index = (size_t) (win - ctx->windows);
+    char *buffer = NULL;
+    size_t length = 0;
+
+    if (size == 0) {
+        partfs_reply_xattr(req, dirty_map_format(ctx->dirty, index, NULL, 0));
+        return;
+    }
+
+    if ((buffer = malloc(size + 1)) == NULL) {
+        partfs_reply_err(req, ENOMEM);
+        return;
+    }
+
+    length = dirty_map_format(ctx->dirty, index, buffer, size + 1);
+
+    if (length > size) {
+        partfs_reply_err(req, ERANGE);
+    } else {
+        partfs_reply_buf(req, buffer, length);
+    }
+
+    free(buffer);
+}
+
+static void partfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                            size_t size)
+{
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    char *buffer = NULL;
+    size_t length = 0;
+
+    partfs_op_begin(STATS_GETXATTR);
+
+    if ((ctx->dirty != NULL) && (win != NULL) &&
+        (strcmp(name, CHANGES_XATTR) == 0)) {
+        partfs_reply_changes(req, ctx, win, size);
+        return;
+    }
+
+#ifdef ENABLE_HASHES
+    if ((ctx->hashes != NULL) && (win != NULL) &&
+        (strcmp(name, DIGEST_XATTR) == 0)) {
+        partfs_reply_digest(req, ctx, win, size);
+        return;
+    }
+#endif
+
+    if (!ctx->stats_xattr || (strcmp(name, STATS_XATTR) != 0)) {
+        partfs_reply_err(req, ENODATA);
+        return;
+    }
+
+    if (size == 0) {
+        /* Leave room for the counters to grow before the caller comes back
+         * for the value. */
+        partfs_reply_xattr(req, stats_format(ctx->stats, NULL, 0) +
+                           STATS_XATTR_SLACK);
+        return;
+    }
+
+    if ((buffer = malloc(size + 1)) == NULL) {
+        partfs_reply_err(req, ENOMEM);
+        return;
+    }
+
+    length = stats_format(ctx->stats, buffer, size + 1);
+
+    if (length > size) {
+        partfs_reply_err(req, ERANGE);
+    } else {
+        partfs_reply_buf(req, buffer, length);
+    }
+
+    free(buffer);
+}
+
+static void partfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    struct partfs_context *ctx = fuse_req_userdata(req);
+    struct partfs_window *win = partfs_find_window(ctx, ino);
+    char names[sizeof(STATS_XATTR) + sizeof(DIGEST_XATTR) +
+               sizeof(CHANGES_XATTR)];
+    size_t length = 0;
+
+    partfs_op_begin(STATS_LISTXATTR);
+
+    if (ctx->stats_xattr) {
+        memcpy(names, STATS_XATTR, sizeof(STATS_XATTR));
+        length += sizeof(STATS_XATTR);
+    }
+
+    if ((ctx->hashes != NULL) && (win != NULL)) {
+        memcpy(names + length, DIGEST_XATTR, sizeof(DIGEST_XATTR));
+        length += sizeof(DIGEST_XATTR);
+    }
+
+    if ((ctx->dirty != NULL) && (win != NULL)) {
+        memcpy(names + length, CHANGES_XATTR, sizeof(CHANGES_XATTR));
+        length += sizeof(CHANGES_XATTR);
+    }
+
+    if (size == 0) {
+        partfs_reply_xattr(req, length);
+    } else if (size < length) {
+        partfs_reply_err(req, ERANGE);
+    } else {
+        partfs_reply_buf(req, names, length);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+
+static struct fuse_lowlevel_ops partfs_operations = {
+    .init = partfs_init,
+    .destroy = partfs_destroy,
+    .lookup = partfs_lookup,
+    .getattr = partfs_getattr,
+    .setattr = partfs_setattr,
+    .readdir = partfs_readdir,
+    .open = partfs_open,
+    .read = partfs_read,
+    .write = partfs_write,
+    .access = partfs_access,
+    .fsync = partfs_fsync,
+    .flush = partfs_flush,
+    .release = partfs_release,
+    .fallocate = partfs_fallocate,
+    .copy_file_range = partfs_copy_file_range,
+    .lseek = partfs_lseek,
+};
+
+/*----------------------------------------------------------------------------*/
+
+struct partfs_workers {
+    struct fuse_session *session;
+    sem_t finished;
+};
+
+static void partfs_free_buf(void *data)
+{
+    struct fuse_buf *buf = (struct fuse_buf *) data;
+    free(buf->mem);
+    buf->mem = NULL;
+}
+
+static void * partfs_worker(void *data)
+{
+    struct partfs_workers *workers = (struct partfs_workers *) data;
+    struct fuse_session *se = workers->session;
+    struct fuse_buf fbuf = {.mem = NULL};
+
+    pthread_cleanup_push(partfs_free_buf, &fbuf);
+
+    while (!fuse_session_exited(se)) {
+        int result = 0;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        result = fuse_session_receive_buf(se, &fbuf);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (result == -EINTR) {
+            continue;
+        }
+
+        if (result <= 0) {
+            if (result < 0) {
+                fuse_session_exit(se);
+            }
+            break;
+        }
+
+        fuse_session_process_buf(se, &fbuf);
+    }
+
+    sem_post(&workers->finished);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+static int partfs_loop_mt(struct fuse_session *se, size_t threads)
+{
+    struct partfs_workers workers = {.session = se};
+    pthread_t thread_ids[MAX_THREADS];
+    sigset_t oldset;
+    sigset_t newset;
+    size_t started = 0;
+    int result = 0;
+
+    sem_init(&workers.finished, 0, 0);
+
+    /* Workers shouldn't receive the signals that FUSE uses to exit. */
+    sigemptyset(&newset);
+    sigaddset(&newset, SIGTERM);
+    sigaddset(&newset, SIGINT);
+    sigaddset(&newset, SIGHUP);
+    sigaddset(&newset, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+
+    for (started = 0; started < threads; started++) {
+        result = pthread_create(&thread_ids[started], NULL, partfs_worker,
+                                &workers);
+
+        if (result != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't start worker thread");
+            fprintf(stderr, " (%s)\n", strerror(result));
+            fuse_session_exit(se);
+            break;
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (started != 0) {
+        while (sem_wait(&workers.finished) != 0) {
+            if ((errno != EINTR) || fuse_session_exited(se)) {
+                break;
+            }
+        }
+    }
+
+    fuse_session_exit(se);
+
+    for (size_t x = 0; x < started; x++) {
+        pthread_cancel(thread_ids[x]);
+    }
+
+    for (size_t x = 0; x < started; x++) {
+        pthread_join(thread_ids[x], NULL);
+    }
+
+    sem_destroy(&workers.finished);
+    fuse_session_reset(se);
+
+    return (result == 0) ? 0 : -1;
+}
+
+static int partfs_run(struct fuse_args *args, struct partfs_context *ctx,
+                      size_t threads)
+{
+    struct fuse_cmdline_opts opts = {0};
+    struct fuse_session *se = NULL;
+    int result = -1;
+
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        return 1;
+    }
+
+    se = fuse_session_new(args, &partfs_operations,
+                          sizeof(partfs_operations), ctx);
+
+    if (se == NULL) {
+        goto cleanup;
+    }
+
+    if (fuse_set_signal_handlers(se) != 0) {
+        goto cleanup;
+    }
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0) {
+        goto remove_handlers;
+    }
+
+    fuse_daemonize(opts.foreground);
+
+    if (opts.singlethread || (threads <= 1)) {
+        result = fuse_session_loop(se);
+    } else {
+        result = partfs_loop_mt(se, threads);
+    }
+
+    fuse_session_unmount(se);
+
+remove_handlers:
+    fuse_remove_signal_handlers(se);
+
+cleanup:
+    if (se) {
+        fuse_session_destroy(se);
+    }
+
+    free(opts.mountpoint);
+    return (result == 0) ? 0 : 1;
+}
+
+/* Reads the image that partitions are looked up in: SOURCE as translated,
+ * but without the overlay, as libfdisk would see it. */
+static ssize_t partfs_image_read(void *data, char *buf, size_t nbyte,
+                                 off_t offset)
+{
+    return partfs_translated_read((struct partfs_context *) data, buf, nbyte,
+                                  offset, 0);
+}
+
+#ifdef ENABLE_PARTITIONS
+/* Reads SOURCE, which is SIZE bytes once translated, through libfdisk. An
+ * image that isn't stored raw is read through a copy of just the parts of it
+ * that partition tables live in. */
+static int partfs_fdisk_table(struct partfs_context *ctx, const char *source,
+                              uint64_t size, struct part_info **table)
+{
+    char view_path[sizeof("/proc/self/fd/") + 16];
+    int view_fd = -1;
+    int result = 0;
+
+    if ((ctx->zstd == NULL) && (ctx->qcow2 == NULL) &&
+        (ctx->chunks == NULL) && (ctx->extents == NULL)) {
+        return partition_read_table(source, table);
+    }
+
+    view_fd = table_view_create(partfs_image_read, ctx, size);
+
+    if (view_fd < 0) {
+        return FDISK_INVALID_FILE;
+    }
+
+    snprintf(view_path, sizeof(view_path), "/proc/self/fd/%d", view_fd);
+    result = partition_read_table(view_path, table);
+    close(view_fd);
+    return result;
+}
+#endif
+
+/* Reads the partition table of SOURCE, which is SIZE bytes once translated.
+ * MBR and GPT tables are parsed directly, in a few small reads. Anything
+ * else, or a table that doesn't check out, is left to libfdisk. */
+static int partfs_read_table(struct partfs_context *ctx, const char *source,
+                             uint64_t size, struct part_info **table)
+{
+    int result = disk_label_read(partfs_image_read, ctx, size, table);
+
+#ifdef ENABLE_PARTITIONS
+    if ((result < 0) && (result != FDISK_ALLOC_FAILURE)) {
+        result = partfs_fdisk_table(ctx, source, size, table);
+    }
+#else
+    (void) source;
+#endif
+
+    return result;
+}
+
+/* Reads SOURCE the way partfs_read() would, so that block hashes and exports
+ * see pending writes, the overlay and translated images as the mount does. */
+static ssize_t partfs_source_read(void *data, char *buf, size_t nbyte,
+                                  off_t offset)
+{
+    struct partfs_context *ctx = (struct partfs_context *) data;
+
+    if (ctx->overlay) {
+        return overlay_pread(ctx->overlay, buf, nbyte, offset);
+    } else if (ctx->combine) {
+        return combine_pread(ctx->combine, buf, nbyte, offset);
+    }
+
+    return partfs_translated_read(ctx, buf, nbyte, offset, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct partfs_config config = {
+        .size = (size_t) -1,
+        .threads = 1,
+        .cache_block = DEFAULT_CACHE_BLOCK,
+        .combine_age = DEFAULT_COMBINE_AGE,
+        .hash_block = DEFAULT_HASH_BLOCK,
+        .cbt_block = DEFAULT_CBT_BLOCK
+    };
+    struct partfs_context context = {
+        .source_fd = -1,
+        .args = &args,
+        .control_lock = PTHREAD_MUTEX_INITIALIZER
+    };
+
+    char arg_buffer[sizeof("-ofsname=") + NAME_MAX + 2] = "-ofsname=";
+    unsigned int arg_offset = sizeof("-ofsname=") - 1;
+    unsigned int arg_maxlen = (unsigned int) sizeof(arg_buffer) - arg_offset;
+
+    struct stat stat_buffer = {0};
+    size_t partition = (size_t) -1;
+    int result = 0;
+    int source_flags = 0;
+    struct part_info *partition_table = NULL;
+    int partition_count = 0;
+
+    safecopy(progname, basename(argv[0]), sizeof(progname));
+
+    for (int x = 1; x < argc; x++) {
         if ((strcmp(argv[x], "--help") == 0) || (strcmp(argv[x], "-h") == 0)) {
             fuse_opt_free_args(&args);
             exit_help();
         }
     }
 
-    fuse_opt_parse(&args, &config, partfs_opts, partfs_opt_proc);
+    fuse_opt_parse(&args, &config, partfs_opts, partfs_opt_proc);
+
+    if (config.all_partitions) {
+        if (config.size_string || config.offset_string ||
+            config.partition_string || config.partlabel || config.partuuid) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'all_partitions' can't be specified along with"
+                    " 'partition', 'partlabel', 'partuuid', 'offset' or"
+                    " 'sizelimit'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.mmap && (config.splice || config.overlay_string)) {
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: 'mmap' can't be specified along with 'splice' or"
+                " 'overlay'");
+        controlled_exit(&context, 1);
+    }
+
+    if (config.uring || config.uring_fixed ||
+        (config.uring_depth_string != NULL)) {
+#ifndef ENABLE_URING
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: not compiled with io_uring support.");
+        controlled_exit(&context, 1);
+#endif
+        if (config.splice || config.overlay_string || config.mmap) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'uring' can't be specified along with 'splice',"
+                    " 'overlay' or 'mmap'");
+            controlled_exit(&context, 1);
+        }
+
+        context.uring_depth = DEFAULT_URING_DEPTH;
+        context.uring_fixed = config.uring_fixed;
+    }
+
+    if (config.uring_depth_string != NULL) {
+        if (parse_number(config.uring_depth_string, &context.uring_depth) ||
+            (context.uring_depth == 0) ||
+            (context.uring_depth > MAX_URING_DEPTH)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid io_uring depth",
+                    config.uring_depth_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if ((config.cache_size_string != NULL) ||
+        (config.cache_block_string != NULL)) {
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'cache_size' can't be specified along with"
+                    " 'splice', 'overlay', 'mmap' or 'uring'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.cache_size_string != NULL) {
+        if (parse_number(config.cache_size_string, &config.cache_size)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid cache size", config.cache_size_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.cache_block_string != NULL) {
+        if (parse_number(config.cache_block_string, &config.cache_block) ||
+            (config.cache_block == 0)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid cache block size",
+                    config.cache_block_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if ((config.combine_size_string != NULL) ||
+        (config.combine_age_string != NULL)) {
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string ||
+            config.cache_size_string) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'combine' can't be specified along with"
+                    " 'splice', 'overlay', 'mmap', 'uring' or 'cache_size'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.combine_size_string != NULL) {
+        if (parse_number(config.combine_size_string, &config.combine_size)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid combine size",
+                    config.combine_size_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.combine_age_string != NULL) {
+        if (parse_number(config.combine_age_string, &config.combine_age) ||
+            (config.combine_age == 0) ||
+            (config.combine_age > MAX_COMBINE_AGE)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid combine age", config.combine_age_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if ((config.hash_file != NULL) || (config.hash_block_string != NULL)) {
+#ifndef ENABLE_HASHES
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: not compiled with block hash support.");
+        controlled_exit(&context, 1);
+#endif
+        if (config.hash_file == NULL) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'hash_block' requires 'hash_file'");
+            controlled_exit(&context, 1);
+        }
+
+        /* The delta changes without SOURCE's mtime moving, so a sidecar
+         * could never tell that it's out of date. */
+        if (config.overlay_string) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'hash_file' can't be specified along with"
+                    " 'overlay'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.hash_block_string != NULL) {
+        if (parse_number(config.hash_block_string, &config.hash_block) ||
+            (config.hash_block == 0) || (config.hash_block > MAX_HASH_BLOCK)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid hash block size",
+                    config.hash_block_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if ((config.cbt_file != NULL) || (config.cbt_export != NULL)) {
+        config.cbt = 1;
+    }
+
+    if ((config.max_windows_string != NULL) && !config.control) {
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: 'max_windows' requires 'control'");
+        controlled_exit(&context, 1);
+    }
+
+    if (config.control) {
+        /* Windows that come and go can't be mapped up front or given their
+         * own hashes or block maps, and there's no single window to place. */
+        if (config.mmap || config.splice || (config.hash_file != NULL) ||
+            config.cbt || config.size_string || config.offset_string ||
+            config.partition_string || config.partlabel || config.partuuid) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'control' can't be specified along with 'mmap',"
+                    " 'splice', 'hash_file', 'cbt', 'partition', 'partlabel',"
+                    " 'partuuid', 'offset' or 'sizelimit'");
+            controlled_exit(&context, 1);
+        }
+
+        config.max_windows = DEFAULT_MAX_WINDOWS;
+
+        if ((config.max_windows_string != NULL) &&
+            (parse_number(config.max_windows_string, &config.max_windows) ||
+             (config.max_windows == 0) ||
+             (config.max_windows > MAX_WINDOWS))) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid max_windows", config.max_windows_string);
+            controlled_exit(&context, 1);
+        }
+
+        context.control = 1;
+    }
+
+    if ((config.cbt_block_string != NULL) && !config.cbt) {
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: 'cbt_block' requires 'cbt'");
+        controlled_exit(&context, 1);
+    }
+
+    /* Without a file, nothing has been tracked that could be exported. */
+    if ((config.cbt_export != NULL) && (config.cbt_file == NULL)) {
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: 'cbt_export' requires 'cbt_file'");
+        controlled_exit(&context, 1);
+    }
+
+    if (config.cbt_block_string != NULL) {
+        if (parse_number(config.cbt_block_string, &config.cbt_block) ||
+            (config.cbt_block == 0) || (config.cbt_block > MAX_CBT_BLOCK)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid cbt block size",
+                    config.cbt_block_string);
+            controlled_exit(&context, 1);
+        }
+    }
 
-    if ((config.partition_string != NULL) || (config.print_table != 0)) {
-#ifndef ENABLE_PARTITIONS
+    if (config.zstd) {
+#ifndef ENABLE_ZSTD
         fprintf(stderr, "%s: %s\n", progname,
-                "error: not compiled with partition-table support.");
+                "error: not compiled with zstd support.");
         controlled_exit(&context, 1);
 #endif
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string ||
+            config.cache_size_string || config.combine_size_string ||
+            config.source_direct || config.readahead_string) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'zstd' can't be specified along with 'splice',"
+                    " 'overlay', 'mmap', 'uring', 'cache_size', 'combine',"
+                    " 'source_direct' or 'readahead'");
+            controlled_exit(&context, 1);
+        }
+
+        /* There's no way to write into the middle of a compressed frame. */
+        config.read_only = 1;
+    }
+
+    if (config.qcow2) {
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string ||
+            config.cache_size_string || config.combine_size_string ||
+            config.source_direct || config.readahead_string || config.zstd) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'qcow2' can't be specified along with 'splice',"
+                    " 'overlay', 'mmap', 'uring', 'cache_size', 'combine',"
+                    " 'source_direct', 'readahead' or 'zstd'");
+            controlled_exit(&context, 1);
+        }
+
+        /* Writes would need clusters and refcounts allocated. */
+        config.read_only = 1;
+    }
+
+    if (config.chunks) {
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string ||
+            config.cache_size_string || config.combine_size_string ||
+            config.source_direct || config.readahead_string || config.zstd ||
+            config.qcow2) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'chunks' can't be specified along with 'splice',"
+                    " 'overlay', 'mmap', 'uring', 'cache_size', 'combine',"
+                    " 'source_direct', 'readahead', 'zstd' or 'qcow2'");
+            controlled_exit(&context, 1);
+        }
+
+        /* Only the first chunk's mtime would be checked. */
+        if (config.hash_file != NULL) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'hash_file' can't be specified along with"
+                    " 'chunks'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if ((config.extents != NULL) || (config.fiemap != NULL)) {
+        if ((config.extents != NULL) && (config.fiemap != NULL)) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'extents' can't be specified along with"
+                    " 'fiemap'");
+            controlled_exit(&context, 1);
+        }
+
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string ||
+            config.cache_size_string || config.combine_size_string ||
+            config.source_direct || config.readahead_string || config.zstd ||
+            config.qcow2 || config.chunks) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'extents' and 'fiemap' can't be specified along"
+                    " with 'splice', 'overlay', 'mmap', 'uring', 'cache_size',"
+                    " 'combine', 'source_direct', 'readahead', 'zstd', 'qcow2'"
+                    " or 'chunks'");
+            controlled_exit(&context, 1);
+        }
+
+        /* The sidecars record SOURCE's layout, not the extent table, so a
+         * changed table would be taken for the old one. */
+        if ((config.hash_file != NULL) || (config.cbt_file != NULL)) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'hash_file' and 'cbt_file' can't be specified"
+                    " along with 'extents' or 'fiemap'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.source_direct) {
+        if (config.splice || config.overlay_string || config.mmap ||
+            config.uring || config.uring_fixed || config.uring_depth_string ||
+            config.cache_size_string || config.combine_size_string ||
+            config.readahead_string) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'source_direct' can't be specified along with"
+                    " 'splice', 'overlay', 'mmap', 'uring', 'cache_size',"
+                    " 'combine' or 'readahead'");
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.readahead_string != NULL) {
+        if (parse_number(config.readahead_string, &config.readahead)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid readahead", config.readahead_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if ((config.cache_size != 0) && (config.cache_size < config.cache_block)) {
+        fprintf(stderr, "%s: %s\n", progname,
+                "error: 'cache_size' must hold at least one 'cache_block'");
+        controlled_exit(&context, 1);
+    }
+
+    if ((config.partlabel != NULL) || (config.partuuid != NULL)) {
+        if (config.size_string || config.offset_string ||
+            config.partition_string ||
+            ((config.partlabel != NULL) && (config.partuuid != NULL))) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: 'partlabel' and 'partuuid' can't be specified"
+                    " along with each other, 'partition', 'offset' or"
+                    " 'sizelimit'");
+            controlled_exit(&context, 1);
+        }
     }
 
     if (config.partition_string != NULL) {
@@ -674,6 +3040,15 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (config.threads_string != NULL) {
+        if (parse_number(config.threads_string, &config.threads) ||
+            (config.threads == 0) || (config.threads > MAX_THREADS)) {
+            fprintf(stderr, "%s: %s [%s]\n", progname,
+                    "error: invalid thread count", config.threads_string);
+            controlled_exit(&context, 1);
+        }
+    }
+
     if (config.source[0] == '\x00') {
         fprintf(stderr, "%s: %s\n", progname,
                 "error: source not specified.");
@@ -697,7 +3072,20 @@ int main(int argc, char *argv[])
 
     result = faccessat(context.dir_fd, config.mountpoint, F_OK, AT_EACCESS);
 
-    if (result != 0) {
+    if ((result != 0) && (config.all_partitions || config.control)) {
+        result = mkdirat(context.dir_fd, config.mountpoint, DEFAULT_DIR_PERMS);
+
+        if (result < 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't create mount-point [%s]",
+                    config.mountpoint);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+
+        context.created_file = config.mountpoint;
+        context.created_flags = AT_REMOVEDIR;
+    } else if (result != 0) {
         result = openat(context.dir_fd, config.mountpoint,
                         O_CREAT | O_WRONLY | O_TRUNC, DEFAULT_PERMS);
 
@@ -724,7 +3112,15 @@ int main(int argc, char *argv[])
         controlled_exit(&context, 1);
     }
 
-    if (strcmp(config.mountpoint, "/dev/null") != 0) {
+    if (config.all_partitions || config.control) {
+        if ((S_ISDIR(stat_buffer.st_mode) == 0) ||
+            ((config.nonempty == 0) &&
+             !directory_is_empty(context.dir_fd, config.mountpoint))) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: mount-point is not an empty directory.");
+            controlled_exit(&context, 1);
+        }
+    } else if (strcmp(config.mountpoint, "/dev/null") != 0) {
         if (((stat_buffer.st_size != 0) && (config.nonempty == 0)) ||
             (S_ISREG(stat_buffer.st_mode) == 0)) {
             fprintf(stderr, "%s: %s\n", progname,
@@ -733,12 +3129,18 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (config.read_only) {
-        context.source_fd = openat(context.dir_fd, config.source, O_RDONLY);
+    if (config.read_only || (config.overlay_string != NULL)) {
+        source_flags = O_RDONLY;
     } else {
-        context.source_fd = openat(context.dir_fd, config.source, O_RDWR);
+        source_flags = O_RDWR;
     }
 
+    if (config.source_direct) {
+        source_flags |= O_DIRECT;
+    }
+
+    context.source_fd = openat(context.dir_fd, config.source, source_flags);
+
     if (context.source_fd < 0) {
         fprintf(stderr, "%s: ", progname);
         fprintf(stderr, "error: couldn't open file [%s]",
@@ -757,104 +3159,403 @@ int main(int argc, char *argv[])
         controlled_exit(&context, 1);
     }
 
-#ifdef ENABLE_PARTITIONS
-    if (config.print_table) {
-        result = partition_count(config.source);
-        struct part_info *info = NULL;
+#ifdef ENABLE_ZSTD
+    if (config.zstd) {
+        if (zstd_source_open(&context.zstd, context.source_fd) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't load seek table of [%s]",
+                    config.source);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
 
-        if (result < 0) {
+        /* Everything from here on works on the decompressed image. */
+        stat_buffer.st_size = (off_t) zstd_source_size(context.zstd);
+    }
+#endif
+
+    if (config.qcow2) {
+        if (qcow2_source_open(&context.qcow2, context.source_fd) != 0) {
             fprintf(stderr, "%s: ", progname);
-            fprintf(stderr, "error: couldn't find partition table in [%s]\n",
+            fprintf(stderr, "error: couldn't load qcow2 header of [%s]",
                     config.source);
+            fprintf(stderr, " (%s)\n", strerror(errno));
             controlled_exit(&context, 1);
         }
 
-        printf("Number:Name:UUID:Type:Offset:Size\n");
+        /* Everything from here on works on the guest image. */
+        stat_buffer.st_size = (off_t) qcow2_source_size(context.qcow2);
+    }
 
-        for (unsigned int x = 0; x < (unsigned int) result; x++) {
-            int prev_errno = errno;
-            errno = 0;
-            if (partition_get_info(config.source, x, &info) != 0) {
-                fprintf(stderr, "%s: ", progname);
-                fprintf(stderr, "error: couldn't read partition %u in [%s]\n",
-                        x, config.source);
-                if (errno) {
-                    fprintf(stderr, "%s\n", strerror(errno));
-                }
-                errno = prev_errno;
-                partition_dealloc_info(info);
-                controlled_exit(&context, 1);
+    if (config.chunks) {
+        if (chunk_source_open(&context.chunks, context.dir_fd, config.source,
+                              source_flags) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't open the chunks of [%s]",
+                    config.source);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+
+        /* Everything from here on works on the chunks laid end to end. */
+        stat_buffer.st_size = (off_t) chunk_source_size(context.chunks);
+    }
+
+    if ((config.extents != NULL) || (config.fiemap != NULL)) {
+        const char *list = (config.extents != NULL) ? config.extents :
+                           config.fiemap;
+
+        result = extent_map_create(&context.extents, context.source_fd,
+                                   (uint64_t) stat_buffer.st_size);
+
+        if (result == 0) {
+            if (config.extents != NULL) {
+                result = extent_map_load(context.extents, context.dir_fd,
+                                         config.extents);
+            } else {
+                result = extent_map_fiemap(context.extents, context.dir_fd,
+                                           config.fiemap);
             }
-            printf("%u:%s:%s:%s:%zd:%zd\n", x+1, info->name,
-                   info->uuid, info->type, info->start, info->length);
+        }
 
-            partition_dealloc_info(info);
+        if (result != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't read the extents of [%s]", list);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
         }
 
-        controlled_exit(&context, 0);
+        /* Everything from here on works on the extents laid end to end. */
+        stat_buffer.st_size = (off_t) extent_map_size(context.extents);
     }
 
-    if (partition != (size_t) -1) {
-        result = partition_count(config.source);
-        struct part_info *info = NULL;
+    if (config.overlay_string != NULL) {
+        result = overlay_open(&context.overlay, context.dir_fd,
+                              config.overlay_string, context.source_fd);
 
-        if (result < 0) {
+        if (result != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't open overlay [%s]",
+                    config.overlay_string);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.cache_size != 0) {
+        result = block_cache_create(&context.cache, context.source_fd,
+                                    config.cache_size, config.cache_block);
+
+        if (result != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't set up block cache");
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.source_direct) {
+        if (aligned_io_create(&context.direct, context.source_fd,
+                              config.threads) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't set up aligned I/O for [%s]",
+                    config.source);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.combine_size != 0) {
+        if (combine_create(&context.combine, context.source_fd,
+                           config.combine_size,
+                           (unsigned int) config.combine_age) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't set up write combining");
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.readahead != 0) {
+        if (prefetch_create(&context.prefetch, context.source_fd,
+                            config.readahead) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't set up readahead");
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.print_table || config.all_partitions ||
+        (partition != (size_t) -1) || (config.partlabel != NULL) ||
+        (config.partuuid != NULL)) {
+        partition_count = partfs_read_table(&context, config.source,
+                                            (uint64_t) stat_buffer.st_size,
+                                            &partition_table);
+
+        if (partition_count < 0) {
             fprintf(stderr, "%s: ", progname);
             fprintf(stderr, "error: couldn't find partition table in [%s]\n",
                     config.source);
             controlled_exit(&context, 1);
         }
+    }
+
+    if (config.print_table) {
+        printf("Number:Name:UUID:Type:Offset:Size\n");
+
+        for (int x = 0; x < partition_count; x++) {
+            struct part_info *info = &partition_table[x];
+            printf("%d:%s:%s:%s:%zd:%zd\n", x + 1, info->name,
+                   info->uuid, info->type, info->start, info->length);
+        }
+
+        partition_dealloc_table(partition_table);
+        controlled_exit(&context, 0);
+    }
+
+    if ((config.partlabel != NULL) || (config.partuuid != NULL)) {
+        int found = disk_label_find(partition_table, partition_count,
+                                    config.partlabel, config.partuuid);
+
+        if (found < 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: partition [%s] not found in [%s]\n",
+                    (config.partlabel != NULL) ? config.partlabel :
+                    config.partuuid, config.source);
+            partition_dealloc_table(partition_table);
+            controlled_exit(&context, 1);
+        }
+
+        partition = (size_t) found + 1;
+    }
 
-        if (result < (int) partition) {
+    if (partition != (size_t) -1) {
+        if ((size_t) partition_count < partition) {
             fprintf(stderr, "%s: ", progname);
             fprintf(stderr, "error: partition %d not found in [%s]\n",
                     (int)(partition), config.source);
+            partition_dealloc_table(partition_table);
             controlled_exit(&context, 1);
         }
 
-        if (partition_get_info(config.source, (unsigned int) partition - 1,
-                               &info) != 0) {
+        config.offset = (size_t) partition_table[partition - 1].start;
+        config.size = (size_t) partition_table[partition - 1].length;
+    }
+
+    /* Slots for the windows that the control file adds come after the
+     * partitions. */
+    if (config.all_partitions &&
+        ((partition_count > 0) || (config.max_windows > 0))) {
+        context.windows = calloc((size_t) partition_count + config.max_windows,
+                                 sizeof(struct partfs_window));
+
+        if (context.windows == NULL) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: couldn't allocate memory.");
+            partition_dealloc_table(partition_table);
+            controlled_exit(&context, 1);
+        }
+    }
+
+    for (int x = 0; config.all_partitions && (x < partition_count); x++) {
+        struct partfs_window *win = &context.windows[x];
+        size_t start = (size_t) partition_table[x].start;
+        size_t length = (size_t) partition_table[x].length;
+
+        if ((start + length) > (size_t) stat_buffer.st_size) {
             fprintf(stderr, "%s: ", progname);
-            fprintf(stderr, "error: couldn't detect position of partition %d"
-                    "in [%s]\n", (int) partition, config.source);
-            partition_dealloc_info(info);
+            fprintf(stderr, "error: partition %d extends past the"
+                    " end of [%s]\n", x + 1, basename(config.source));
+            partition_dealloc_table(partition_table);
             controlled_exit(&context, 1);
         }
 
-        config.offset = (size_t) info->start;
-        config.size = (size_t) info->length;
-        partition_dealloc_info(info);
+        window_make_name(win->name, sizeof(win->name), (unsigned int) x + 1,
+                         partition_table[x].name);
+        win->ino = partfs_window_ino(&context, (size_t) x);
+        win->max_size = length;
+        win->current_size = length;
+        win->source_offset = start;
+        pthread_mutex_init(&win->size_lock, NULL);
+        context.window_count++;
     }
-#endif
 
-    if (config.size == (size_t) -1) {
-        config.size = (size_t) stat_buffer.st_size - config.offset;
+    partition_dealloc_table(partition_table);
+
+    if (config.control) {
+        if ((context.windows == NULL) &&
+            ((context.windows = calloc(config.max_windows,
+                                       sizeof(struct partfs_window))) ==
+             NULL)) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: couldn't allocate memory.");
+            controlled_exit(&context, 1);
+        }
+
+        for (size_t x = 0; x < config.max_windows; x++) {
+            pthread_mutex_init(&context.windows[context.window_count].size_lock,
+                               NULL);
+            context.window_count++;
+        }
+    } else if (config.all_partitions == 0) {
+        if (config.size == (size_t) -1) {
+            config.size = (size_t) stat_buffer.st_size - config.offset;
+        }
+
+        if ((config.offset + config.size) > (size_t) stat_buffer.st_size) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: requested size or offset extends past the"
+                              " end of [%s]", basename(config.source));
+            fprintf(stderr, "\n");
+            controlled_exit(&context, 1);
+        }
+
+        context.windows = calloc(1, sizeof(struct partfs_window));
+
+        if (context.windows == NULL) {
+            fprintf(stderr, "%s: %s\n", progname,
+                    "error: couldn't allocate memory.");
+            controlled_exit(&context, 1);
+        }
+
+        context.window_count = 1;
+        context.windows[0].ino = FUSE_ROOT_ID;
+        context.windows[0].max_size = config.size;
+        context.windows[0].current_size = config.size;
+        context.windows[0].source_offset = config.offset;
+        pthread_mutex_init(&context.windows[0].size_lock, NULL);
     }
 
-    if ((config.offset + config.size) > (size_t) stat_buffer.st_size) {
+    context.source_mode = stat_buffer.st_mode;
+    context.directory = config.all_partitions || config.control;
+    context.source_size = (uint64_t) stat_buffer.st_size;
+    context.read_only = config.read_only;
+    context.splice = config.splice;
+    context.writeback = config.writeback;
+    context.direct_io = config.direct_io;
+    context.kernel_cache = config.kernel_cache;
+    context.stats_file = config.stats_file;
+    context.stats_xattr = config.stats_xattr;
+    context.hash_file = config.hash_file;
+    context.cbt_file = config.cbt_file;
+
+    if (stats_create(&context.stats) != 0) {
         fprintf(stderr, "%s: ", progname);
-        fprintf(stderr, "error: requested size or offset extends past the"
-                          " end of [%s]", basename(config.source));
-        fprintf(stderr, "\n");
+        fprintf(stderr, "error: couldn't set up statistics");
+        fprintf(stderr, " (%s)\n", strerror(errno));
         controlled_exit(&context, 1);
     }
 
-    context.source_mode = stat_buffer.st_mode;
-    context.read_only = config.read_only;
-    context.max_size = config.size;
-    context.current_size = config.size;
-    context.source_offset = config.offset;
+    for (size_t x = 0; config.mmap && (x < context.window_count); x++) {
+        if (partfs_map_window(&context, &context.windows[x]) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't map [%s] into memory",
+                    config.source);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+
+#ifdef ENABLE_HASHES
+    if (config.hash_file != NULL) {
+        result = block_hash_create(&context.hashes, context.window_count,
+                                   config.hash_block, partfs_source_read,
+                                   &context);
+
+        for (size_t x = 0; (result == 0) && (x < context.window_count); x++) {
+            result = block_hash_set_region(context.hashes, x,
+                                           context.windows[x].source_offset,
+                                           context.windows[x].max_size);
+        }
+
+        if (result != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't set up block hashes");
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+
+        if (block_hash_load(context.hashes, context.dir_fd, config.hash_file,
+                            context.source_fd) != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't read block hashes from [%s]",
+                    config.hash_file);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+    }
+#endif
+
+    if (config.cbt) {
+        result = dirty_map_create(&context.dirty, context.window_count,
+                                  config.cbt_block);
+
+        for (size_t x = 0; (result == 0) && (x < context.window_count); x++) {
+            result = dirty_map_set_region(context.dirty, x,
+                                          context.windows[x].source_offset,
+                                          context.windows[x].max_size);
+        }
+
+        if (result != 0) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't set up changed block tracking");
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+
+        if ((config.cbt_file != NULL) &&
+            (dirty_map_load(context.dirty, context.dir_fd,
+                            config.cbt_file) != 0)) {
+            fprintf(stderr, "%s: ", progname);
 
-    fuse_opt_add_arg(&args, "-s");
+            if (errno == EINVAL) {
+                fprintf(stderr, "error: [%s] doesn't match the mount's"
+                        " windows or 'cbt_block'\n", config.cbt_file);
+            } else {
+                fprintf(stderr, "error: couldn't read changed blocks from"
+                        " [%s] (%s)\n", config.cbt_file, strerror(errno));
+            }
+
+            controlled_exit(&context, 1);
+        }
+    }
+
+    if (config.cbt_export != NULL) {
+        int export_fd = openat(context.dir_fd, config.cbt_export,
+                               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                               0644);
+
+        if ((export_fd < 0) ||
+            (dirty_map_export(context.dirty, export_fd, partfs_source_read,
+                              &context) != 0) ||
+            (close(export_fd) != 0)) {
+            fprintf(stderr, "%s: ", progname);
+            fprintf(stderr, "error: couldn't export changed blocks to [%s]",
+                    config.cbt_export);
+            fprintf(stderr, " (%s)\n", strerror(errno));
+            controlled_exit(&context, 1);
+        }
+
+        controlled_exit(&context, 0);
+    }
+
+    /* Overlay writes need the data in memory to split it around SOURCE. */
+    if (config.splice && (context.overlay == NULL)) {
+        partfs_operations.write_buf = partfs_write_buf;
+    }
 
-    if (config.nonempty) {
-        fuse_opt_add_arg(&args, "-ononempty");
+    /* Once getxattr is implemented, the kernel asks for security attributes
+     * on every write, so our own attributes are opt-in. */
+    if (config.stats_xattr || (config.hash_file != NULL) || config.cbt) {
+        partfs_operations.getxattr = partfs_getxattr;
+        partfs_operations.listxattr = partfs_listxattr;
     }
 
     safecopy(arg_buffer + arg_offset, config.source, arg_maxlen);
     fuse_opt_add_arg(&args, arg_buffer);
 
-    result = fuse_main(args.argc, args.argv, &partfs_operations, &context);
+    result = partfs_run(&args, &context, config.threads);
     controlled_exit(&context, result);
 
     return result;
@@ -0,0 +1,173 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#include "prefetch.h"
+
+#define STREAM_COUNT (8U)
+#define MIN_WINDOW (128U * 1024U)
+#define MIN_HITS (2U)
+
+struct prefetch_stream {
+    uint64_t next;
+    uint64_t prefetched;
+    uint64_t window;
+    uint64_t last_use;
+    unsigned int hits;
+};
+
+struct prefetch {
+    int fd;
+    uint64_t max_window;
+    uint64_t clock;
+    struct prefetch_stream streams[STREAM_COUNT];
+    pthread_mutex_t lock;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Finds the stream that a read at OFFSET continues. Requests from several
+ * FUSE workers can arrive slightly out of order, so anything close to where
+ * a stream left off counts. */
+static struct prefetch_stream * prefetch_match(struct prefetch *pf,
+                                               uint64_t offset)
+{
+    for (unsigned int x = 0; x < STREAM_COUNT; x++) {
+        struct prefetch_stream *stream = &pf->streams[x];
+        uint64_t low = (stream->next > MIN_WINDOW) ?
+                       (stream->next - MIN_WINDOW) : 0;
+
+        if ((stream->last_use != 0) && (offset >= low) &&
+            (offset <= (stream->next + MIN_WINDOW))) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+static struct prefetch_stream * prefetch_oldest(struct prefetch *pf)
+{
+    struct prefetch_stream *result = &pf->streams[0];
+
+    for (unsigned int x = 1; x < STREAM_COUNT; x++) {
+        if (pf->streams[x].last_use < result->last_use) {
+            result = &pf->streams[x];
+        }
+    }
+
+    return result;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int prefetch_create(struct prefetch **pf, int fd, size_t max_window)
+{
+    struct prefetch *result = NULL;
+
+    if ((pf == NULL) || (max_window == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct prefetch))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    result->max_window = max_window;
+    pthread_mutex_init(&result->lock, NULL);
+
+    *pf = result;
+    return 0;
+}
+
+void prefetch_destroy(struct prefetch *pf)
+{
+    if (pf == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&pf->lock);
+    free(pf);
+}
+
+void prefetch_note(struct prefetch *pf, off_t offset, size_t nbyte,
+                   off_t limit)
+{
+    struct prefetch_stream *stream = NULL;
+    uint64_t start = (uint64_t) offset;
+    uint64_t stop = start + nbyte;
+    uint64_t advise_start = 0;
+    uint64_t advise_stop = 0;
+    int progress = 0;
+
+    pthread_mutex_lock(&pf->lock);
+    pf->clock++;
+
+    if ((stream = prefetch_match(pf, start)) == NULL) {
+        /* Possibly the start of a new stream. Random readers never get
+         * past this point, so they never trigger any prefetching. */
+        stream = prefetch_oldest(pf);
+        stream->next = stop;
+        stream->prefetched = stop;
+        stream->window = 0;
+        stream->hits = 0;
+        stream->last_use = pf->clock;
+        pthread_mutex_unlock(&pf->lock);
+        return;
+    }
+
+    stream->last_use = pf->clock;
+
+    /* Only a read that gets past where the stream was counts towards it, or
+     * tops it up, so that one that hops around the same spot never keeps
+     * prefetching. */
+    if (stop > stream->next) {
+        stream->next = stop;
+        stream->hits++;
+        progress = 1;
+    }
+
+    if (stream->prefetched < stream->next) {
+        stream->prefetched = stream->next;
+    }
+
+    if (progress && (stream->hits >= MIN_HITS)) {
+        if (stream->window == 0) {
+            stream->window = (MIN_WINDOW < pf->max_window) ?
+                             MIN_WINDOW : pf->max_window;
+        }
+
+        /* Top the window up once the reader is halfway through what was
+         * prefetched, and double it each time, for as long as the stream
+         * keeps going. */
+        if ((stream->prefetched - stream->next) <= (stream->window / 2)) {
+            advise_start = stream->prefetched;
+            advise_stop = stream->next + stream->window;
+
+            if (advise_stop > (uint64_t) limit) {
+                advise_stop = (uint64_t) limit;
+            }
+
+            if (advise_stop > advise_start) {
+                stream->prefetched = advise_stop;
+                stream->window = ((stream->window * 2) > pf->max_window) ?
+                                 pf->max_window : (stream->window * 2);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&pf->lock);
+
+    if (advise_stop > advise_start) {
+        posix_fadvise(pf->fd, (off_t) advise_start,
+                      (off_t) (advise_stop - advise_start),
+                      POSIX_FADV_WILLNEED);
+    }
+}
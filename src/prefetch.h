@@ -0,0 +1,20 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <sys/types.h>
+
+struct prefetch;
+
+/* Creates a sequential-stream detector for FD that prefetches up to
+ * MAX_WINDOW bytes ahead of each stream it finds. Returns 0 on success, or
+ * -1 with errno set. */
+int prefetch_create(struct prefetch **pf, int fd, size_t max_window);
+
+void prefetch_destroy(struct prefetch *pf);
+
+/* Records a read of NBYTE bytes at OFFSET in FD. If it continues a stream,
+ * asks the kernel to start reading ahead of it, without going past LIMIT. */
+void prefetch_note(struct prefetch *pf, off_t offset, size_t nbyte,
+                   off_t limit);
+
+#endif
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "qcow2_source.h"
+
+#define QCOW2_MAGIC (0x514649FBU)
+#define HEADER_V2_SIZE (72U)
+#define HEADER_V3_SIZE (104U)
+
+#define MIN_CLUSTER_BITS (9U)
+#define MAX_CLUSTER_BITS (21U)
+
+/* Same limit as QEMU's, so that nothing it wrote is refused. */
+#define MAX_L1_BYTES (32U * 1024U * 1024U)
+
+#define INCOMPAT_DIRTY (1ULL << 0)
+#define INCOMPAT_COMPRESSION (1ULL << 3)
+#define INCOMPAT_SUPPORTED (INCOMPAT_DIRTY | INCOMPAT_COMPRESSION)
+
+#define L1_OFFSET_MASK (0x00FFFFFFFFFFFE00ULL)
+#define L2_OFFSET_MASK (0x00FFFFFFFFFFFE00ULL)
+#define L2_COMPRESSED (1ULL << 62)
+#define L2_ZERO (1ULL << 0)
+
+/* Each L2 table maps one cluster's worth of entries, so with the default
+ * 64k clusters this covers 16GiB of the image. */
+#define CACHE_TABLES (32U)
+
+struct qcow2_cache_entry {
+    uint64_t offset;
+    uint64_t last_use;
+    unsigned char *table;
+};
+
+struct qcow2_source {
+    int fd;
+    uint64_t size;
+    unsigned int cluster_bits;
+    unsigned int l2_bits;
+    uint64_t *l1;
+    uint64_t l1_size;
+    struct qcow2_cache_entry cache[CACHE_TABLES];
+    uint64_t clock;
+    pthread_mutex_t lock;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Reads guest data from the host clusters at OFFSET. A file that ends part
+ * way through a cluster reads as zeros past its end, as it does in QEMU. */
+static int qcow2_read_data(struct qcow2_source *qs, char *buf, size_t nbyte,
+                           uint64_t offset)
+{
+    ssize_t result = pread_count(qs->fd, buf, nbyte, (off_t) offset);
+
+    if (result < 0) {
+        return -1;
+    }
+
+    memset(buf + result, 0, nbyte - (size_t) result);
+    return 0;
+}
+
+static int qcow2_load_header(struct qcow2_source *qs)
+{
+    unsigned char header[HEADER_V3_SIZE];
+    uint64_t l1_offset = 0;
+    uint64_t l1_needed = 0;
+    uint32_t version = 0;
+    unsigned char *l1 = NULL;
+    int result = -1;
+
+    if (pread_exact(qs->fd, header, HEADER_V2_SIZE, 0) != 0) {
+        goto invalid;
+    }
+
+    version = get_be32(header + 4);
+
+    if (get_be32(header) != QCOW2_MAGIC) {
+        goto invalid;
+    }
+
+    if ((version != 2) && (version != 3)) {
+        goto unsupported;
+    }
+
+    if ((version == 3) &&
+        ((pread_exact(qs->fd, header + HEADER_V2_SIZE,
+                     HEADER_V3_SIZE - HEADER_V2_SIZE, HEADER_V2_SIZE) != 0) ||
+         (get_be64(header + 72) & ~INCOMPAT_SUPPORTED))) {
+        goto unsupported;
+    }
+
+    /* Backing files and encryption: no backing offset, no crypt method. */
+    if ((get_be64(header + 8) != 0) || (get_be32(header + 32) != 0)) {
+        goto unsupported;
+    }
+
+    qs->cluster_bits = get_be32(header + 20);
+    qs->size = get_be64(header + 24);
+    qs->l1_size = get_be32(header + 36);
+    l1_offset = get_be64(header + 40);
+
+    if ((qs->cluster_bits < MIN_CLUSTER_BITS) ||
+        (qs->cluster_bits > MAX_CLUSTER_BITS) ||
+        (qs->size > (uint64_t) INT64_MAX) ||
+        (qs->l1_size > (MAX_L1_BYTES / sizeof(uint64_t)))) {
+        goto invalid;
+    }
+
+    /* An L2 table is one cluster of 8-byte entries. */
+    qs->l2_bits = qs->cluster_bits - 3;
+    l1_needed = (qs->size + (1ULL << (qs->cluster_bits + qs->l2_bits)) - 1) >>
+                (qs->cluster_bits + qs->l2_bits);
+
+    if (qs->l1_size < l1_needed) {
+        goto invalid;
+    }
+
+    /* One spare entry, so that an empty image doesn't allocate 0 bytes. */
+    l1 = calloc((size_t) qs->l1_size + 1, sizeof(uint64_t));
+    qs->l1 = calloc((size_t) qs->l1_size + 1, sizeof(uint64_t));
+
+    if ((l1 == NULL) || (qs->l1 == NULL)) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    if (pread_exact(qs->fd, l1, (size_t) (qs->l1_size * sizeof(uint64_t)),
+                   (off_t) l1_offset) != 0) {
+        goto cleanup;
+    }
+
+    for (uint64_t x = 0; x < qs->l1_size; x++) {
+        qs->l1[x] = get_be64(l1 + (x * sizeof(uint64_t))) & L1_OFFSET_MASK;
+    }
+
+    result = 0;
+    goto cleanup;
+
+unsupported:
+    errno = ENOTSUP;
+    goto cleanup;
+
+invalid:
+    errno = EINVAL;
+
+cleanup:
+    free(l1);
+    return result;
+}
+
+/* Looks up entry INDEX of the cached L2 table at OFFSET. Returns 0, or -1 if
+ * the table isn't cached. Called with the lock held. */
+static int qcow2_cache_lookup(struct qcow2_source *qs, uint64_t offset,
+                              size_t index, uint64_t *entry)
+{
+    for (unsigned int x = 0; x < CACHE_TABLES; x++) {
+        struct qcow2_cache_entry *cached = &qs->cache[x];
+
+        if ((cached->table != NULL) && (cached->offset == offset)) {
+            cached->last_use = ++qs->clock;
+            *entry = get_be64(cached->table + (index * sizeof(uint64_t)));
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Hands TABLE over to the cache, evicting the least-recently used table.
+ * Called with the lock held. */
+static void qcow2_cache_insert(struct qcow2_source *qs, uint64_t offset,
+                               unsigned char *table)
+{
+    struct qcow2_cache_entry *victim = &qs->cache[0];
+
+    for (unsigned int x = 0; x < CACHE_TABLES; x++) {
+        struct qcow2_cache_entry *cached = &qs->cache[x];
+
+        if ((cached->table != NULL) && (cached->offset == offset)) {
+            /* Another thread got there first. */
+            free(table);
+            return;
+        }
+
+        if ((cached->table == NULL) ||
+            ((victim->table != NULL) &&
+             (cached->last_use < victim->last_use))) {
+            victim = cached;
+        }
+    }
+
+    free(victim->table);
+    victim->offset = offset;
+    victim->table = table;
+    victim->last_use = ++qs->clock;
+}
+
+/* Finds the host offset of the cluster holding guest offset OFFSET. Sets
+ * *host to 0 if the cluster reads as zeros. */
+static int qcow2_map(struct qcow2_source *qs, uint64_t offset, uint64_t *host)
+{
+    uint64_t l1_index = offset >> (qs->cluster_bits + qs->l2_bits);
+    size_t l2_index = (size_t) ((offset >> qs->cluster_bits) &
+                                ((1ULL << qs->l2_bits) - 1));
+    size_t table_size = (size_t) 1 << qs->cluster_bits;
+    uint64_t l2_offset = qs->l1[l1_index];
+    unsigned char *table = NULL;
+    uint64_t entry = 0;
+    int cached = 0;
+
+    *host = 0;
+
+    if (l2_offset == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&qs->lock);
+    cached = (qcow2_cache_lookup(qs, l2_offset, l2_index, &entry) == 0);
+    pthread_mutex_unlock(&qs->lock);
+
+    if (!cached) {
+        /* Read without the lock, so that other threads can carry on with
+         * tables that are already cached. */
+        if ((table = malloc(table_size)) == NULL) {
+            return -1;
+        }
+
+        if (pread_exact(qs->fd, table, table_size, (off_t) l2_offset) != 0) {
+            free(table);
+            return -1;
+        }
+
+        entry = get_be64(table + (l2_index * sizeof(uint64_t)));
+
+        pthread_mutex_lock(&qs->lock);
+        qcow2_cache_insert(qs, l2_offset, table);
+        pthread_mutex_unlock(&qs->lock);
+    }
+
+    if (entry & L2_COMPRESSED) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (!(entry & L2_ZERO)) {
+        *host = entry & L2_OFFSET_MASK;
+    }
+
+    if (*host & (table_size - 1)) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int qcow2_source_open(struct qcow2_source **qs, int fd)
+{
+    struct qcow2_source *result = NULL;
+
+    if (qs == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct qcow2_source))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    pthread_mutex_init(&result->lock, NULL);
+
+    if (qcow2_load_header(result) != 0) {
+        int error = errno;
+        qcow2_source_close(result);
+        errno = error;
+        return -1;
+    }
+
+    *qs = result;
+    return 0;
+}
+
+void qcow2_source_close(struct qcow2_source *qs)
+{
+    if (qs == NULL) {
+        return;
+    }
+
+    for (unsigned int x = 0; x < CACHE_TABLES; x++) {
+        free(qs->cache[x].table);
+    }
+
+    pthread_mutex_destroy(&qs->lock);
+    free(qs->l1);
+    free(qs);
+}
+
+uint64_t qcow2_source_size(struct qcow2_source *qs)
+{
+    return qs->size;
+}
+
+ssize_t qcow2_source_pread(struct qcow2_source *qs, char *buf, size_t nbyte,
+                           off_t offset)
+{
+    uint64_t cluster_size = 1ULL << qs->cluster_bits;
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+    uint64_t run_host = 0;
+    char *run_buf = NULL;
+    size_t run_length = 0;
+
+    if (stop > qs->size) {
+        stop = qs->size;
+    }
+
+    /* Clusters that sit back-to-back in the file are read with one pread. */
+    while (pos < stop) {
+        uint64_t skip = pos & (cluster_size - 1);
+        size_t wanted = (size_t) (cluster_size - skip);
+        char *dest = buf + (pos - (uint64_t) offset);
+        uint64_t host = 0;
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        if (qcow2_map(qs, pos, &host) != 0) {
+            return -1;
+        }
+
+        if ((run_length > 0) && (host != 0) &&
+            ((run_host + run_length) == (host + skip))) {
+            run_length += wanted;
+        } else {
+            if ((run_length > 0) &&
+                (qcow2_read_data(qs, run_buf, run_length, run_host) != 0)) {
+                return -1;
+            }
+
+            run_length = 0;
+
+            if (host == 0) {
+                memset(dest, 0, wanted);
+            } else {
+                run_host = host + skip;
+                run_buf = dest;
+                run_length = wanted;
+            }
+        }
+
+        pos += wanted;
+    }
+
+    if ((run_length > 0) &&
+        (qcow2_read_data(qs, run_buf, run_length, run_host) != 0)) {
+        return -1;
+    }
+
+    return (ssize_t) (stop > (uint64_t) offset ? stop - (uint64_t) offset : 0);
+}
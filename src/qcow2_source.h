@@ -0,0 +1,26 @@
+#ifndef QCOW2_SOURCE_H
+#define QCOW2_SOURCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct qcow2_source;
+
+/* Loads the header and L1 table of FD, which has to be a qcow2 image (version
+ * 2 or 3) with no backing file or encryption. Returns 0 on success, or -1
+ * with errno set (EINVAL if FD isn't qcow2, ENOTSUP if it uses a feature
+ * that isn't supported). */
+int qcow2_source_open(struct qcow2_source **qs, int fd);
+
+void qcow2_source_close(struct qcow2_source *qs);
+
+/* Returns the size of the guest image. */
+uint64_t qcow2_source_size(struct qcow2_source *qs);
+
+/* Reads like pread_count() from the guest image. Unallocated and zero
+ * clusters read as zeros without touching FD. Compressed clusters fail with
+ * EIO. */
+ssize_t qcow2_source_pread(struct qcow2_source *qs, char *buf, size_t nbyte,
+                           off_t offset);
+
+#endif
@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "stats.h"
+
+/* Bucket N counts calls that took less than 2^N microseconds (and at least
+ * half that), with the last one catching everything slower. */
+#define STATS_BUCKETS (32U)
+
+struct stats_counter {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats {
+    struct stats_counter counters[STATS_OP_COUNT];
+    int dir_fd;
+    char *path;
+    int pipe_fds[2];
+    pthread_t dumper;
+    int dumper_started;
+};
+
+static const char *stats_op_names[STATS_OP_COUNT] = {
+    [STATS_LOOKUP] = "lookup",
+    [STATS_GETATTR] = "getattr",
+    [STATS_SETATTR] = "setattr",
+    [STATS_TRUNCATE] = "truncate",
+    [STATS_READDIR] = "readdir",
+    [STATS_OPEN] = "open",
+    [STATS_READ] = "read",
+    [STATS_WRITE] = "write",
+    [STATS_ACCESS] = "access",
+    [STATS_FSYNC] = "fsync",
+    [STATS_FLUSH] = "flush",
+    [STATS_RELEASE] = "release",
+    [STATS_FALLOCATE] = "fallocate",
+    [STATS_COPY_FILE_RANGE] = "copy_file_range",
+    [STATS_LSEEK] = "lseek",
+    [STATS_GETXATTR] = "getxattr",
+    [STATS_LISTXATTR] = "listxattr"
+};
+
+/* Signal handlers can't carry any context, so there's one of these per
+ * process. */
+static int stats_signal_fd = -1;
+
+/*----------------------------------------------------------------------------*/
+
+static void stats_signal(int signum)
+{
+    int prev_errno = errno;
+    char byte = 0;
+
+    (void) signum;
+
+    if (write(stats_signal_fd, &byte, 1) < 0) {
+        /* Nothing can be done about it here. */
+    }
+
+    errno = prev_errno;
+}
+
+static void stats_append(char *buf, size_t size, size_t *length,
+                         const char *format, ...)
+{
+    va_list args;
+    int result = 0;
+
+    va_start(args, format);
+
+    if (*length < size) {
+        result = vsnprintf(buf + *length, size - *length, format, args);
+    } else {
+        result = vsnprintf(NULL, 0, format, args);
+    }
+
+    va_end(args);
+
+    if (result > 0) {
+        *length += (size_t) result;
+    }
+}
+
+/* What stats_fill() writes out. */
+struct stats_dump {
+    const char *buf;
+    size_t length;
+};
+
+static int stats_fill(void *data, int fd)
+{
+    struct stats_dump *dump = (struct stats_dump *) data;
+
+    return write_all(fd, dump->buf, dump->length);
+}
+
+/* Writes the counters out in full, replacing PATH in one go so that readers
+ * never see half a dump. */
+static int stats_dump(struct stats *st)
+{
+    struct stats_dump dump = {NULL, stats_format(st, NULL, 0)};
+    char *buf = malloc(dump.length + 1);
+    int result = -1;
+
+    if (buf != NULL) {
+        dump.buf = buf;
+        dump.length = stats_format(st, buf, dump.length + 1);
+        result = file_replace(st->dir_fd, st->path, stats_fill, &dump);
+    }
+
+    free(buf);
+    return result;
+}
+
+static void * stats_dumper(void *data)
+{
+    struct stats *st = (struct stats *) data;
+    char byte = 0;
+    ssize_t result = 0;
+
+    /* Each byte is one SIGUSR1. End-of-file means stats_stop(). */
+    while ((result = read(st->pipe_fds[0], &byte, 1)) != 0) {
+        if (result > 0) {
+            stats_dump(st);
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int stats_create(struct stats **st)
+{
+    struct stats *result = NULL;
+
+    if (st == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct stats))) == NULL) {
+        return -1;
+    }
+
+    result->dir_fd = -1;
+    result->pipe_fds[0] = -1;
+    result->pipe_fds[1] = -1;
+
+    *st = result;
+    return 0;
+}
+
+void stats_destroy(struct stats *st)
+{
+    if (st == NULL) {
+        return;
+    }
+
+    stats_stop(st);
+    free(st);
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+void stats_record(struct stats *st, enum stats_op op, uint64_t start,
+                  int error, size_t nbyte)
+{
+    struct stats_counter *counter = &st->counters[op];
+    uint64_t elapsed = stats_now() - start;
+    uint64_t micros = elapsed / 1000U;
+    unsigned int bucket = 0;
+
+    if (micros != 0) {
+        bucket = 64U - (unsigned int) __builtin_clzll(micros);
+    }
+
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&counter->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counter->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counter->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    if (error != 0) {
+        __atomic_add_fetch(&counter->errors, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&counter->bytes, nbyte, __ATOMIC_RELAXED);
+    }
+}
+
+size_t stats_format(struct stats *st, char *buf, size_t size)
+{
+    size_t length = 0;
+
+    stats_append(buf, size, &length, "{\"ops\":{");
+
+    for (unsigned int x = 0; x < STATS_OP_COUNT; x++) {
+        struct stats_counter *counter = &st->counters[x];
+
+        stats_append(buf, size, &length,
+                     "%s\"%s\":{\"calls\":%llu,\"errors\":%llu,"
+                     "\"bytes\":%llu,\"total_ns\":%llu,\"latency_us\":[",
+                     (x == 0) ? "" : ",", stats_op_names[x],
+                     (unsigned long long) __atomic_load_n(&counter->calls,
+                                                          __ATOMIC_RELAXED),
+                     (unsigned long long) __atomic_load_n(&counter->errors,
+                                                          __ATOMIC_RELAXED),
+                     (unsigned long long) __atomic_load_n(&counter->bytes,
+                                                          __ATOMIC_RELAXED),
+                     (unsigned long long) __atomic_load_n(&counter->total_ns,
+                                                          __ATOMIC_RELAXED));
+
+        for (unsigned int y = 0; y < STATS_BUCKETS; y++) {
+            stats_append(buf, size, &length, "%s%llu", (y == 0) ? "" : ",",
+                         (unsigned long long)
+                         __atomic_load_n(&counter->buckets[y],
+                                         __ATOMIC_RELAXED));
+        }
+
+        stats_append(buf, size, &length, "]}");
+    }
+
+    stats_append(buf, size, &length, "}}\n");
+    return length;
+}
+
+int stats_start(struct stats *st, int dir_fd, const char *path)
+{
+    struct sigaction action = {0};
+    sigset_t oldset;
+    sigset_t newset;
+    int result = 0;
+
+    if (stats_signal_fd >= 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((st->path = strdup(path)) == NULL) {
+        return -1;
+    }
+
+    st->dir_fd = dir_fd;
+
+    if (pipe2(st->pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+        goto cleanup;
+    }
+
+    /* Only the write end may drop signals when full; the dumper blocks. */
+    if (fcntl(st->pipe_fds[0], F_SETFL, 0) != 0) {
+        goto cleanup;
+    }
+
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    result = pthread_create(&st->dumper, NULL, stats_dumper, st);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (result != 0) {
+        errno = result;
+        goto cleanup;
+    }
+
+    st->dumper_started = 1;
+    stats_signal_fd = st->pipe_fds[1];
+
+    action.sa_handler = stats_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGUSR1, &action, NULL) != 0) {
+        result = errno;
+        stats_stop(st);
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+
+cleanup:
+    result = errno;
+    stats_stop(st);
+    errno = result;
+    return -1;
+}
+
+void stats_stop(struct stats *st)
+{
+    struct sigaction action = {0};
+
+    if (st->dumper_started) {
+        action.sa_handler = SIG_IGN;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+        stats_signal_fd = -1;
+
+        close(st->pipe_fds[1]);
+        st->pipe_fds[1] = -1;
+        pthread_join(st->dumper, NULL);
+        st->dumper_started = 0;
+
+        stats_dump(st);
+    }
+
+    for (unsigned int x = 0; x < 2; x++) {
+        if (st->pipe_fds[x] >= 0) {
+            close(st->pipe_fds[x]);
+            st->pipe_fds[x] = -1;
+        }
+    }
+
+    free(st->path);
+    st->path = NULL;
+}
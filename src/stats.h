@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+enum stats_op {
+    STATS_LOOKUP,
+    STATS_GETATTR,
+    STATS_SETATTR,
+    STATS_TRUNCATE,
+    STATS_READDIR,
+    STATS_OPEN,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_ACCESS,
+    STATS_FSYNC,
+    STATS_FLUSH,
+    STATS_RELEASE,
+    STATS_FALLOCATE,
+    STATS_COPY_FILE_RANGE,
+    STATS_LSEEK,
+    STATS_GETXATTR,
+    STATS_LISTXATTR,
+    STATS_OP_COUNT
+};
+
+struct stats;
+
+/* Creates an empty set of counters. Returns 0 on success, or -1 with errno
+ * set. */
+int stats_create(struct stats **st);
+
+/* Stops the dump thread (if running) and frees ST. */
+void stats_destroy(struct stats *st);
+
+/* Returns a monotonic timestamp in nanoseconds, for stats_record(). */
+uint64_t stats_now(void);
+
+/* Counts one call to OP that started at START, and either failed with
+ * ERROR or moved NBYTE bytes. Lock-free, so it's safe from any thread. */
+void stats_record(struct stats *st, enum stats_op op, uint64_t start,
+                  int error, size_t nbyte);
+
+/* Writes the counters to BUF as a single JSON object. Returns the length of
+ * the whole object, which is only all there if it's less than SIZE. */
+size_t stats_format(struct stats *st, char *buf, size_t size);
+
+/* Starts a thread that dumps the counters to PATH (relative to DIR_FD)
+ * whenever the process gets SIGUSR1. Returns 0 on success, or -1 with errno
+ * set. */
+int stats_start(struct stats *st, int dir_fd, const char *path);
+
+/* Stops the dump thread, after one last dump. */
+void stats_stop(struct stats *st);
+
+#endif
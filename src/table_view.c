@@ -0,0 +1,129 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "file_io.h"
+#include "table_view.h"
+
+#define SECTOR_SIZE (512U)
+#define TABLE_AREA (1024U * 1024U)
+#define MAX_EBRS (1024U)
+
+struct table_view_image {
+    source_read_fn read_fn;
+    void *data;
+    uint64_t size;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Copies [OFFSET, OFFSET + LENGTH) of the image into FD. */
+static int table_view_copy(const struct table_view_image *image, int fd,
+                           uint64_t offset, uint64_t length)
+{
+    char buffer[64 * 1024];
+
+    while (length > 0) {
+        size_t chunk = (length < sizeof(buffer)) ? (size_t) length :
+                       sizeof(buffer);
+        ssize_t result = image->read_fn(image->data, buffer, chunk,
+                                        (off_t) offset);
+
+        if (result <= 0) {
+            return (result < 0) ? -1 : 0;
+        }
+
+        if (pwrite(fd, buffer, (size_t) result, (off_t) offset) != result) {
+            return -1;
+        }
+
+        offset += (uint64_t) result;
+        length -= (uint64_t) result;
+    }
+
+    return 0;
+}
+
+/* Copies every EBR in the extended partition that starts at sector BASE. */
+static int table_view_copy_ebrs(const struct table_view_image *image, int fd,
+                                uint64_t base)
+{
+    unsigned char sector[SECTOR_SIZE];
+    uint64_t current = base;
+
+    for (unsigned int x = 0; x < MAX_EBRS; x++) {
+        const unsigned char *link = sector + 446 + 16;
+        uint64_t offset = current * SECTOR_SIZE;
+
+        if ((offset + SECTOR_SIZE) > image->size) {
+            break;
+        }
+
+        if ((image->read_fn(image->data, (char *) sector, SECTOR_SIZE,
+                            (off_t) offset) != SECTOR_SIZE) ||
+            (pwrite(fd, sector, SECTOR_SIZE, (off_t) offset) !=
+             SECTOR_SIZE)) {
+            return -1;
+        }
+
+        if ((sector[510] != 0x55) || (sector[511] != 0xAA) ||
+            (get_le32(link + 8) == 0)) {
+            break;
+        }
+
+        current = base + get_le32(link + 8);
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int table_view_create(source_read_fn read_fn, void *data, uint64_t size)
+{
+    struct table_view_image image = {read_fn, data, size};
+    unsigned char mbr[SECTOR_SIZE];
+    uint64_t head = (size < TABLE_AREA) ? size : TABLE_AREA;
+    uint64_t tail = (size > TABLE_AREA) ? (size - TABLE_AREA) : 0;
+    int error = 0;
+    int fd = memfd_create("partfs-tables", MFD_CLOEXEC);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    if ((ftruncate(fd, (off_t) size) != 0) ||
+        (table_view_copy(&image, fd, 0, head) != 0) ||
+        (table_view_copy(&image, fd, tail, size - tail) != 0)) {
+        goto fail;
+    }
+
+    /* Logical partitions are chained through EBRs, which can be anywhere
+     * inside their extended partition. */
+    if ((size >= SECTOR_SIZE) &&
+        (read_fn(data, (char *) mbr, SECTOR_SIZE, 0) == SECTOR_SIZE) &&
+        (mbr[510] == 0x55) && (mbr[511] == 0xAA)) {
+        for (unsigned int x = 0; x < 4; x++) {
+            const unsigned char *entry = mbr + 446 + (x * 16);
+
+            if (((entry[4] == 0x05) || (entry[4] == 0x0F) ||
+                 (entry[4] == 0x85)) &&
+                (table_view_copy_ebrs(&image, fd,
+                                      get_le32(entry + 8)) != 0)) {
+                goto fail;
+            }
+        }
+    }
+
+    return fd;
+
+fail:
+    error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
@@ -0,0 +1,16 @@
+#ifndef TABLE_VIEW_H
+#define TABLE_VIEW_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "file_io.h"
+
+/* Returns a sparse memfd the size of a SIZE-byte image, holding only the
+ * parts that partition tables live in: the first and last megabyte (MBR,
+ * both GPT copies), and every EBR of an extended partition. That's enough
+ * for libfdisk, without translating the whole image. Returns -1 with errno
+ * set on failure. */
+int table_view_create(source_read_fn read_fn, void *data, uint64_t size);
+
+#endif
@@ -0,0 +1,486 @@
+/*
+ *  bench: Throughput and latency benchmark for PartFS.
+ *
+ *  Runs sequential and random reads and writes against a region of FILE, at
+ *  each combination of block size and queue depth, and prints the results
+ *  as one JSON object. The queue depth is the number of threads with a
+ *  request in flight at once. Every case starts with the region's pages
+ *  (and those of another file, such as the SOURCE under a mount) dropped
+ *  from the page cache, so that one case doesn't read what the last wrote.
+ *
+ *  Usage: bench [-t SECONDS] [-b SIZE,...] [-q DEPTH,...] [-o OFFSET]
+ *               [-l LENGTH] [-d FILE] [-r] FILE
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_LIST (16U)
+#define MAX_SAMPLES (1U << 22U)
+
+struct bench_list {
+    size_t values[MAX_LIST];
+    size_t count;
+};
+
+struct bench_case {
+    int fd;
+    int write;
+    int random;
+    size_t block_size;
+    uint64_t offset;
+    uint64_t blocks;
+    uint64_t cursor;
+    int stop;
+};
+
+struct bench_thread {
+    struct bench_case *bc;
+    pthread_t thread;
+    char *buffer;
+    unsigned int seed;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t *samples;
+    size_t sample_count;
+    size_t sample_alloc;
+};
+
+static const char *progname = "bench";
+
+/*----------------------------------------------------------------------------*/
+
+static uint64_t now_ns(void)
+{
+    struct timespec now = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+static int parse_size(const char *string, size_t *output)
+{
+    char *end = NULL;
+    unsigned long long value = 0;
+
+    errno = 0;
+    value = strtoull(string, &end, 0);
+
+    if ((errno != 0) || (end == string)) {
+        return -1;
+    }
+
+    switch (*end) {
+        case 'k': case 'K': value <<= 10U; end++; break;
+        case 'm': case 'M': value <<= 20U; end++; break;
+        case 'g': case 'G': value <<= 30U; end++; break;
+        default: break;
+    }
+
+    if (*end != '\x00') {
+        return -1;
+    }
+
+    *output = (size_t) value;
+    return 0;
+}
+
+static int parse_list(const char *string, struct bench_list *list)
+{
+    char *copy = strdup(string);
+    char *save = NULL;
+    int result = 0;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    list->count = 0;
+
+    for (char *item = strtok_r(copy, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        if ((list->count == MAX_LIST) ||
+            parse_size(item, &list->values[list->count]) ||
+            (list->values[list->count] == 0)) {
+            result = -1;
+            break;
+        }
+
+        list->count++;
+    }
+
+    free(copy);
+    return ((result == 0) && (list->count != 0)) ? 0 : -1;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *) a;
+    uint64_t right = *(const uint64_t *) b;
+
+    return (left > right) - (left < right);
+}
+
+static double percentile(const uint64_t *sorted, size_t count, double rank)
+{
+    size_t index = (size_t) (rank * (double) (count - 1));
+
+    return (count == 0) ? 0.0 : (double) sorted[index] / 1000.0;
+}
+
+/* Writes back and drops FD's cached pages in [OFFSET, OFFSET + LENGTH), or
+ * all of them if LENGTH is 0. */
+static int drop_cache(int fd, off_t offset, off_t length)
+{
+    int result = 0;
+
+    if (fdatasync(fd) != 0) {
+        return -1;
+    }
+
+    if ((result = posix_fadvise(fd, offset, length,
+                                POSIX_FADV_DONTNEED)) != 0) {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static void * bench_worker(void *data)
+{
+    struct bench_thread *bt = (struct bench_thread *) data;
+    struct bench_case *bc = bt->bc;
+
+    while (__atomic_load_n(&bc->stop, __ATOMIC_RELAXED) == 0) {
+        uint64_t block = 0;
+        uint64_t start = 0;
+        ssize_t result = 0;
+        off_t offset = 0;
+
+        if (bc->random) {
+            block = ((uint64_t) rand_r(&bt->seed) << 31U) ^
+                    (uint64_t) rand_r(&bt->seed);
+            block %= bc->blocks;
+        } else {
+            block = __atomic_fetch_add(&bc->cursor, 1, __ATOMIC_RELAXED) %
+                    bc->blocks;
+        }
+
+        offset = (off_t) (bc->offset + (block * bc->block_size));
+        start = now_ns();
+
+        if (bc->write) {
+            result = pwrite(bc->fd, bt->buffer, bc->block_size, offset);
+        } else {
+            result = pread(bc->fd, bt->buffer, bc->block_size, offset);
+        }
+
+        if ((result < 0) || ((size_t) result != bc->block_size)) {
+            bt->errors++;
+            continue;
+        }
+
+        bt->ops++;
+
+        if (bt->sample_count == bt->sample_alloc) {
+            size_t alloc = (bt->sample_alloc == 0) ? 4096 :
+                           (bt->sample_alloc * 2);
+            void *samples = NULL;
+
+            if ((alloc > MAX_SAMPLES) ||
+                ((samples = realloc(bt->samples, alloc * sizeof(uint64_t)))
+                 == NULL)) {
+                continue;
+            }
+
+            bt->samples = samples;
+            bt->sample_alloc = alloc;
+        }
+
+        bt->samples[bt->sample_count++] = now_ns() - start;
+    }
+
+    return NULL;
+}
+
+/* Runs one case for SECONDS, and prints its JSON object. */
+static int bench_run(struct bench_case *bc, size_t depth,
+                     unsigned int seconds, int first)
+{
+    struct bench_thread *threads = calloc(depth, sizeof(struct bench_thread));
+    uint64_t *samples = NULL;
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    size_t sample_count = 0;
+    size_t started = 0;
+    uint64_t elapsed = 0;
+    double elapsed_s = 0.0;
+    int result = -1;
+
+    if (threads == NULL) {
+        return -1;
+    }
+
+    bc->cursor = 0;
+    bc->stop = 0;
+    elapsed = now_ns();
+
+    for (; started < depth; started++) {
+        struct bench_thread *bt = &threads[started];
+
+        bt->bc = bc;
+        bt->seed = (unsigned int) (started + 1);
+
+        if (posix_memalign((void **) &bt->buffer, 4096, bc->block_size)) {
+            goto cleanup;
+        }
+
+        memset(bt->buffer, (int) (started + 'a'), bc->block_size);
+
+        if (pthread_create(&bt->thread, NULL, bench_worker, bt) != 0) {
+            free(bt->buffer);
+            bt->buffer = NULL;
+            goto cleanup;
+        }
+    }
+
+    sleep(seconds);
+    result = 0;
+
+cleanup:
+    __atomic_store_n(&bc->stop, 1, __ATOMIC_RELAXED);
+
+    for (size_t x = 0; x < started; x++) {
+        pthread_join(threads[x].thread, NULL);
+        ops += threads[x].ops;
+        errors += threads[x].errors;
+        sample_count += threads[x].sample_count;
+    }
+
+    elapsed = now_ns() - elapsed;
+    elapsed_s = (double) elapsed / 1e9;
+
+    if ((result == 0) && (sample_count != 0) &&
+        ((samples = malloc(sample_count * sizeof(uint64_t))) == NULL)) {
+        result = -1;
+    }
+
+    sample_count = 0;
+
+    for (size_t x = 0; x < started; x++) {
+        if (samples != NULL) {
+            memcpy(samples + sample_count, threads[x].samples,
+                   threads[x].sample_count * sizeof(uint64_t));
+            sample_count += threads[x].sample_count;
+        }
+
+        free(threads[x].samples);
+        free(threads[x].buffer);
+    }
+
+    if (result == 0) {
+        qsort(samples, sample_count, sizeof(uint64_t), compare_u64);
+
+        printf("%s\n    {\"pattern\": \"%s\", \"op\": \"%s\", "
+               "\"block_size\": %zu, \"queue_depth\": %zu,\n"
+               "     \"seconds\": %.3f, \"ops\": %llu, \"errors\": %llu, "
+               "\"iops\": %.1f, \"mib_per_s\": %.2f,\n"
+               "     \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, "
+               "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+               first ? "" : ",", bc->random ? "random" : "sequential",
+               bc->write ? "write" : "read", bc->block_size, depth,
+               elapsed_s, (unsigned long long) ops,
+               (unsigned long long) errors, (double) ops / elapsed_s,
+               ((double) ops * (double) bc->block_size) /
+               (elapsed_s * 1024.0 * 1024.0),
+               percentile(samples, sample_count, 0.50),
+               percentile(samples, sample_count, 0.90),
+               percentile(samples, sample_count, 0.99),
+               percentile(samples, sample_count, 0.999),
+               percentile(samples, sample_count, 1.0));
+        fflush(stdout);
+    }
+
+    free(samples);
+    free(threads);
+    return result;
+}
+
+static void exit_help(int exit_code)
+{
+    fprintf((exit_code == 0) ? stdout : stderr,
+            "Usage: %s [options] FILE\n"
+            "\n"
+            "    -t SECONDS     time per case (default: 2)\n"
+            "    -b SIZE,...    block sizes (default: 4k,64k,1M)\n"
+            "    -q DEPTH,...   queue depths (default: 1,8)\n"
+            "    -o OFFSET      start of the region in FILE (default: 0)\n"
+            "    -l LENGTH      length of the region (default: to EOF)\n"
+            "    -d FILE        also drop FILE's cached pages before each"
+            " case\n"
+            "    -r             reads only; leave FILE untouched\n",
+            progname);
+    exit(exit_code);
+}
+
+/*----------------------------------------------------------------------------*/
+
+int main(int argc, char *argv[])
+{
+    struct bench_list sizes = {{4096, 64 * 1024, 1024 * 1024}, 3};
+    struct bench_list depths = {{1, 8}, 2};
+    struct bench_case bc = {.fd = -1};
+    struct stat stat_buffer = {0};
+    const char *drop_path = NULL;
+    int drop_fd = -1;
+    size_t seconds = 2;
+    size_t offset = 0;
+    size_t length = 0;
+    int read_only = 0;
+    int first = 1;
+    int option = 0;
+
+    while ((option = getopt(argc, argv, "t:b:q:o:l:d:rh")) != -1) {
+        switch (option) {
+            case 't':
+                if (parse_size(optarg, &seconds) || (seconds == 0)) {
+                    exit_help(1);
+                }
+                break;
+
+            case 'b':
+                if (parse_list(optarg, &sizes)) {
+                    exit_help(1);
+                }
+                break;
+
+            case 'q':
+                if (parse_list(optarg, &depths)) {
+                    exit_help(1);
+                }
+                break;
+
+            case 'o':
+                if (parse_size(optarg, &offset)) {
+                    exit_help(1);
+                }
+                break;
+
+            case 'l':
+                if (parse_size(optarg, &length)) {
+                    exit_help(1);
+                }
+                break;
+
+            case 'd':
+                drop_path = optarg;
+                break;
+
+            case 'r':
+                read_only = 1;
+                break;
+
+            case 'h':
+                exit_help(0);
+                break;
+
+            default:
+                exit_help(1);
+        }
+    }
+
+    if (optind != (argc - 1)) {
+        exit_help(1);
+    }
+
+    bc.fd = open(argv[optind], read_only ? O_RDONLY : O_RDWR);
+
+    if ((bc.fd < 0) || (fstat(bc.fd, &stat_buffer) != 0)) {
+        fprintf(stderr, "%s: error: couldn't open [%s] (%s)\n", progname,
+                argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if ((drop_path != NULL) &&
+        ((drop_fd = open(drop_path, O_RDONLY)) < 0)) {
+        fprintf(stderr, "%s: error: couldn't open [%s] (%s)\n", progname,
+                drop_path, strerror(errno));
+        close(bc.fd);
+        return 1;
+    }
+
+    if (length == 0) {
+        length = ((size_t) stat_buffer.st_size > offset) ?
+                 ((size_t) stat_buffer.st_size - offset) : 0;
+    }
+
+    bc.offset = offset;
+    printf("{\"file\": \"%s\", \"offset\": %zu, \"length\": %zu, "
+           "\"results\": [", argv[optind], offset, length);
+
+    for (int write = 0; write <= !read_only; write++) {
+        for (int random = 0; random <= 1; random++) {
+            for (size_t x = 0; x < sizes.count; x++) {
+                bc.block_size = sizes.values[x];
+                bc.blocks = length / bc.block_size;
+
+                if (bc.blocks == 0) {
+                    continue;
+                }
+
+                for (size_t y = 0; y < depths.count; y++) {
+                    bc.write = write;
+                    bc.random = random;
+
+                    if ((drop_cache(bc.fd, (off_t) offset,
+                                    (off_t) length) != 0) ||
+                        ((drop_fd >= 0) && (drop_cache(drop_fd, 0, 0) != 0)) ||
+                        (bench_run(&bc, depths.values[y],
+                                   (unsigned int) seconds, first) != 0)) {
+                        fprintf(stderr, "%s: error: couldn't run case (%s)\n",
+                                progname, strerror(errno));
+                        close(bc.fd);
+                        return 1;
+                    }
+
+                    first = 0;
+                }
+            }
+        }
+    }
+
+    printf("\n]}\n");
+    close(bc.fd);
+
+    if (drop_fd >= 0) {
+        close(drop_fd);
+    }
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Benchmarks a PartFS mount against the same region of the raw SOURCE, and
+# writes both sets of results to one JSON file.
+#
+# Usage: bench.sh [OUTPUT]
+#
+# Environment:
+#     BENCH           path to the bench driver (default: bench)
+#     BENCH_ARGS      extra arguments for the driver (e.g. "-t 5 -q 1,4,16")
+#     BENCH_SIZE_MB   size of the mounted region, in MiB (default: 256)
+#     BENCH_OPTIONS   extra PartFS mount options (e.g. "direct_io,threads=8")
+#     BENCH_VERSION   version string to record with the results
+
+set -euo pipefail
+
+OUTPUT="${1:-bench.json}"
+BENCH="${BENCH:-bench}"
+SIZE=$(( ${BENCH_SIZE_MB:-256} * 1024 * 1024 ))
+OFFSET=$(( 1024 * 1024 ))
+OPTIONS="offset=${OFFSET},sizelimit=${SIZE}${BENCH_OPTIONS:+,${BENCH_OPTIONS}}"
+
+SOURCE_FILE="bench_source.img"
+MOUNT_FILE="bench_mount"
+UNMOUNT="fusermount3 -u"
+
+cleanup() {
+    (${UNMOUNT} "${MOUNT_FILE}" || true) 1>/dev/null 2>&1
+    rm -f "${SOURCE_FILE}" "${MOUNT_FILE}" "${OUTPUT}.tmp"
+}
+
+trap cleanup INT TERM EXIT
+
+cleanup
+touch "${MOUNT_FILE}"
+
+# Leave some data either side of the region, so that a wrong offset shows.
+# The driver drops SOURCE's cached pages before every case, so neither pass
+# starts out reading what dd just wrote.
+dd if=/dev/urandom of="${SOURCE_FILE}" bs=1M \
+    count=$(( (SIZE / 1024 / 1024) + 2 )) status=none
+
+partfs "${SOURCE_FILE}" "${MOUNT_FILE}" -o "${OPTIONS}"
+
+{
+    printf '{"version": "%s", "partfs_options": "%s",\n"raw": ' \
+        "${BENCH_VERSION:-unknown}" "${OPTIONS}"
+    "${BENCH}" ${BENCH_ARGS:-} -o "${OFFSET}" -l "${SIZE}" "${SOURCE_FILE}"
+    printf ',\n"partfs": '
+    "${BENCH}" ${BENCH_ARGS:-} -d "${SOURCE_FILE}" "${MOUNT_FILE}"
+    printf '}\n'
+} > "${OUTPUT}.tmp"
+
+mv "${OUTPUT}.tmp" "${OUTPUT}"
+echo "Results written to ${OUTPUT}"
@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <liburing.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring_io.h"
+
+#define REAP_BATCH (64U)
+
+struct uring_engine {
+    struct io_uring ring;
+    int ring_ready;
+    int fd;
+    int fixed;
+    unsigned int depth;
+    size_t max_io;
+    char *pool;
+    struct uring_request *requests;
+    struct uring_request **free_list;
+    unsigned int free_count;
+    pthread_mutex_t free_lock;
+    pthread_mutex_t submit_lock;
+    sem_t slots;
+    pthread_t reaper;
+    int reaper_started;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Places the unfinished part of REQUEST on the submission queue. */
+static int uring_queue(struct uring_engine *engine,
+                       struct uring_request *request)
+{
+    struct io_uring_sqe *sqe = NULL;
+    char *buffer = request->buffer + request->done;
+    size_t nbyte = request->nbyte - request->done;
+    uint64_t offset = (uint64_t) request->offset + request->done;
+    int fd = engine->fixed ? 0 : engine->fd;
+    int result = 0;
+
+    pthread_mutex_lock(&engine->submit_lock);
+
+    /* In-flight requests are capped at the ring size, so there's always a
+     * free entry once the previous ones have been handed to the kernel. */
+    if ((sqe = io_uring_get_sqe(&engine->ring)) == NULL) {
+        io_uring_submit(&engine->ring);
+        sqe = io_uring_get_sqe(&engine->ring);
+    }
+
+    if (sqe == NULL) {
+        pthread_mutex_unlock(&engine->submit_lock);
+        return -EBUSY;
+    }
+
+    if (request->write && (request->buf_index >= 0)) {
+        io_uring_prep_write_fixed(sqe, fd, buffer, (unsigned int) nbyte,
+                                  offset, request->buf_index);
+    } else if (request->write) {
+        io_uring_prep_write(sqe, fd, buffer, (unsigned int) nbyte, offset);
+    } else if (request->buf_index >= 0) {
+        io_uring_prep_read_fixed(sqe, fd, buffer, (unsigned int) nbyte,
+                                 offset, request->buf_index);
+    } else {
+        io_uring_prep_read(sqe, fd, buffer, (unsigned int) nbyte, offset);
+    }
+
+    if (engine->fixed) {
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    }
+
+    io_uring_sqe_set_data(sqe, request);
+    result = io_uring_submit(&engine->ring);
+    pthread_mutex_unlock(&engine->submit_lock);
+
+    return (result < 0) ? result : 0;
+}
+
+static void uring_complete(struct uring_engine *engine,
+                           struct uring_request *request, int cqe_result)
+{
+    ssize_t result = 0;
+
+    if ((cqe_result == -EINTR) || (cqe_result == -EAGAIN)) {
+        cqe_result = uring_queue(engine, request);
+
+        if (cqe_result == 0) {
+            return;
+        }
+    } else if (cqe_result > 0) {
+        request->done += (size_t) cqe_result;
+
+        if (request->done < request->nbyte) {
+            cqe_result = uring_queue(engine, request);
+
+            if (cqe_result == 0) {
+                return;
+            }
+        }
+    }
+
+    if ((cqe_result < 0) && (request->done == 0)) {
+        result = cqe_result;
+    } else {
+        result = (ssize_t) request->done;
+    }
+
+    request->callback(request, result);
+    uring_request_put(engine, request);
+}
+
+static void * uring_reaper(void *data)
+{
+    struct uring_engine *engine = (struct uring_engine *) data;
+    struct io_uring_cqe *cqes[REAP_BATCH];
+    int stop = 0;
+
+    while (stop == 0) {
+        unsigned int count = 0;
+        int result = io_uring_wait_cqe(&engine->ring, &cqes[0]);
+
+        if (result < 0) {
+            continue;
+        }
+
+        count = io_uring_peek_batch_cqe(&engine->ring, cqes, REAP_BATCH);
+
+        for (unsigned int x = 0; x < count; x++) {
+            struct uring_request *request = io_uring_cqe_get_data(cqes[x]);
+
+            /* A request-less entry is the shutdown marker. */
+            if (request == NULL) {
+                stop = 1;
+                continue;
+            }
+
+            uring_complete(engine, request, cqes[x]->res);
+        }
+
+        io_uring_cq_advance(&engine->ring, count);
+    }
+
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+
+static int uring_register(struct uring_engine *engine)
+{
+    struct iovec *iovecs = NULL;
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    int result = 0;
+
+    result = posix_memalign((void **) &engine->pool, page_size,
+                            engine->depth * engine->max_io);
+
+    if (result != 0) {
+        engine->pool = NULL;
+        return -result;
+    }
+
+    if ((iovecs = calloc(engine->depth, sizeof(struct iovec))) == NULL) {
+        return -ENOMEM;
+    }
+
+    for (unsigned int x = 0; x < engine->depth; x++) {
+        iovecs[x].iov_base = engine->pool + (x * engine->max_io);
+        iovecs[x].iov_len = engine->max_io;
+        engine->requests[x].buffer = iovecs[x].iov_base;
+        engine->requests[x].buf_index = (int) x;
+    }
+
+    result = io_uring_register_buffers(&engine->ring, iovecs, engine->depth);
+    free(iovecs);
+
+    if (result < 0) {
+        return result;
+    }
+
+    return io_uring_register_files(&engine->ring, &engine->fd, 1);
+}
+
+int uring_engine_start(struct uring_engine **engine, int fd,
+                       unsigned int depth, size_t max_io, int fixed)
+{
+    struct uring_engine *result = NULL;
+    sigset_t oldset;
+    sigset_t newset;
+    int error = 0;
+
+    if ((engine == NULL) || (depth == 0) || (max_io == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct uring_engine))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    result->fixed = fixed;
+    result->depth = depth;
+    result->max_io = max_io;
+    pthread_mutex_init(&result->free_lock, NULL);
+    pthread_mutex_init(&result->submit_lock, NULL);
+    sem_init(&result->slots, 0, depth);
+
+    result->requests = calloc(depth, sizeof(struct uring_request));
+    result->free_list = calloc(depth, sizeof(struct uring_request *));
+
+    if ((result->requests == NULL) || (result->free_list == NULL)) {
+        error = ENOMEM;
+        goto cleanup;
+    }
+
+    for (unsigned int x = 0; x < depth; x++) {
+        result->requests[x].buf_index = -1;
+        result->free_list[x] = &result->requests[x];
+    }
+
+    result->free_count = depth;
+
+    if ((error = -io_uring_queue_init(depth, &result->ring, 0)) != 0) {
+        goto cleanup;
+    }
+
+    result->ring_ready = 1;
+
+    if (fixed && ((error = -uring_register(result)) != 0)) {
+        goto cleanup;
+    }
+
+    /* Leave signal handling to the threads that FUSE expects. */
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    error = pthread_create(&result->reaper, NULL, uring_reaper, result);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (error != 0) {
+        goto cleanup;
+    }
+
+    result->reaper_started = 1;
+    *engine = result;
+    return 0;
+
+cleanup:
+    uring_engine_stop(result);
+    errno = error;
+    return -1;
+}
+
+void uring_engine_stop(struct uring_engine *engine)
+{
+    if (engine == NULL) {
+        return;
+    }
+
+    if (engine->reaper_started) {
+        struct io_uring_sqe *sqe = NULL;
+
+        /* Holding every slot means nothing is left in flight. */
+        for (unsigned int x = 0; x < engine->depth; x++) {
+            while (sem_wait(&engine->slots) != 0) {
+                continue;
+            }
+        }
+
+        pthread_mutex_lock(&engine->submit_lock);
+        sqe = io_uring_get_sqe(&engine->ring);
+        io_uring_prep_nop(sqe);
+        io_uring_sqe_set_data(sqe, NULL);
+        io_uring_submit(&engine->ring);
+        pthread_mutex_unlock(&engine->submit_lock);
+
+        pthread_join(engine->reaper, NULL);
+    }
+
+    if (engine->ring_ready) {
+        io_uring_queue_exit(&engine->ring);
+    }
+
+    sem_destroy(&engine->slots);
+    pthread_mutex_destroy(&engine->submit_lock);
+    pthread_mutex_destroy(&engine->free_lock);
+    free(engine->pool);
+    free(engine->free_list);
+    free(engine->requests);
+    free(engine);
+}
+
+struct uring_request * uring_request_get(struct uring_engine *engine,
+                                         size_t nbyte)
+{
+    struct uring_request *request = NULL;
+
+    if (nbyte > engine->max_io) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    while (sem_wait(&engine->slots) != 0) {
+        continue;
+    }
+
+    pthread_mutex_lock(&engine->free_lock);
+    request = engine->free_list[--engine->free_count];
+    pthread_mutex_unlock(&engine->free_lock);
+
+    if (request->buf_index < 0) {
+        if ((request->buffer = malloc(nbyte)) == NULL) {
+            uring_request_put(engine, request);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    request->nbyte = nbyte;
+    request->done = 0;
+    return request;
+}
+
+void uring_request_put(struct uring_engine *engine,
+                       struct uring_request *request)
+{
+    if (request->buf_index < 0) {
+        free(request->buffer);
+        request->buffer = NULL;
+    }
+
+    pthread_mutex_lock(&engine->free_lock);
+    engine->free_list[engine->free_count++] = request;
+    pthread_mutex_unlock(&engine->free_lock);
+
+    sem_post(&engine->slots);
+}
+
+int uring_request_submit(struct uring_engine *engine,
+                         struct uring_request *request, int write,
+                         off_t offset, uring_callback callback, void *data)
+{
+    int result = 0;
+
+    request->write = write;
+    request->offset = offset;
+    request->callback = callback;
+    request->data = data;
+
+    if ((result = uring_queue(engine, request)) != 0) {
+        uring_request_put(engine, request);
+        errno = -result;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct uring_engine;
+
+struct uring_request;
+
+/* Called from the engine's completion thread when a request finishes.
+ * RESULT is the number of bytes transferred (short only at end-of-file), or
+ * a negative errno value. REQUEST (and its buffer) is only valid until the
+ * callback returns. */
+typedef void (*uring_callback)(struct uring_request *request, ssize_t result);
+
+struct uring_request {
+    char *buffer;
+    size_t nbyte;
+    size_t done;
+    off_t offset;
+    int write;
+    int buf_index;
+    uring_callback callback;
+    void *data;
+    uint64_t start;     /* Not used by the engine; free for the caller. */
+};
+
+/* Sets up a ring of DEPTH entries for I/O on FD, along with a completion
+ * thread. No request may be larger than MAX_IO bytes. With FIXED set, FD
+ * and a pool of DEPTH buffers are registered with the kernel up-front.
+ * Returns 0 on success, or -1 with errno set. */
+int uring_engine_start(struct uring_engine **engine, int fd,
+                       unsigned int depth, size_t max_io, int fixed);
+
+/* Waits for every in-flight request to complete, then tears down the ring
+ * and its completion thread. */
+void uring_engine_stop(struct uring_engine *engine);
+
+/* Reserves one of the engine's DEPTH request slots, with a buffer of at least
+ * NBYTE bytes. Blocks while the queue is full. Returns NULL with errno set if
+ * NBYTE is too large or no buffer could be allocated. */
+struct uring_request * uring_request_get(struct uring_engine *engine,
+                                         size_t nbyte);
+
+/* Releases a request that was never submitted. Submitted requests are
+ * released by the engine after their callback runs. */
+void uring_request_put(struct uring_engine *engine,
+                       struct uring_request *request);
+
+/* Queues REQUEST to read or write its NBYTE bytes at OFFSET. Short transfers
+ * are resubmitted until done or end-of-file. Returns 0 on success. On
+ * failure, releases REQUEST and returns -1 with errno set. */
+int uring_request_submit(struct uring_engine *engine,
+                         struct uring_request *request, int write,
+                         off_t offset, uring_callback callback, void *data);
+
+#endif
@@ -0,0 +1,340 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "file_io.h"
+#include "zstd_source.h"
+
+#define SEEKABLE_MAGIC (0x8F92EAB1U)
+#define SKIPPABLE_MAGIC (0x184D2A5EU)
+#define SKIPPABLE_HEADER_SIZE (8U)
+#define FOOTER_SIZE (9U)
+#define CHECKSUM_FLAG (0x80U)
+#define RESERVED_BITS (0x7CU)
+
+/* Frames are decompressed whole, so anything bigger than this is refused
+ * rather than allocated. */
+#define MAX_FRAME_SIZE (1024U * 1024U * 1024U)
+#define CACHE_FRAMES (16U)
+
+struct zstd_frame {
+    uint64_t compressed_offset;
+    uint64_t offset;
+    uint32_t compressed_size;
+    uint32_t size;
+};
+
+struct zstd_cache_entry {
+    size_t frame;
+    uint64_t last_use;
+    char *data;
+};
+
+struct zstd_source {
+    int fd;
+    struct zstd_frame *frames;
+    size_t frame_count;
+    uint64_t size;
+    struct zstd_cache_entry cache[CACHE_FRAMES];
+    uint64_t clock;
+    pthread_mutex_t lock;
+};
+
+/*----------------------------------------------------------------------------*/
+
+/* Parses the seek table at the end of a FILE_SIZE-byte FD. */
+static int zstd_load_table(struct zstd_source *zs, uint64_t file_size)
+{
+    unsigned char footer[FOOTER_SIZE];
+    unsigned char header[SKIPPABLE_HEADER_SIZE];
+    unsigned char *entries = NULL;
+    uint64_t compressed_offset = 0;
+    uint64_t offset = 0;
+    uint64_t table_size = 0;
+    size_t entry_size = 0;
+    uint32_t count = 0;
+    int result = -1;
+
+    if ((file_size < (FOOTER_SIZE + SKIPPABLE_HEADER_SIZE)) ||
+        (pread_exact(zs->fd, footer, FOOTER_SIZE,
+                    (off_t) (file_size - FOOTER_SIZE)) != 0)) {
+        goto invalid;
+    }
+
+    count = get_le32(footer);
+
+    if ((get_le32(footer + 5) != SEEKABLE_MAGIC) ||
+        (footer[4] & RESERVED_BITS) || (count == 0)) {
+        goto invalid;
+    }
+
+    entry_size = (footer[4] & CHECKSUM_FLAG) ? 12U : 8U;
+    table_size = SKIPPABLE_HEADER_SIZE + ((uint64_t) count * entry_size) +
+                 FOOTER_SIZE;
+
+    if ((table_size > file_size) ||
+        (pread_exact(zs->fd, header, SKIPPABLE_HEADER_SIZE,
+                    (off_t) (file_size - table_size)) != 0) ||
+        (get_le32(header) != SKIPPABLE_MAGIC) ||
+        (get_le32(header + 4) != (table_size - SKIPPABLE_HEADER_SIZE))) {
+        goto invalid;
+    }
+
+    entries = malloc((size_t) count * entry_size);
+    zs->frames = calloc(count, sizeof(struct zstd_frame));
+
+    if ((entries == NULL) || (zs->frames == NULL)) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    if (pread_exact(zs->fd, entries, (size_t) count * entry_size,
+                   (off_t) (file_size - table_size +
+                            SKIPPABLE_HEADER_SIZE)) != 0) {
+        goto cleanup;
+    }
+
+    for (uint32_t x = 0; x < count; x++) {
+        struct zstd_frame *frame = &zs->frames[x];
+        const unsigned char *entry = entries + ((size_t) x * entry_size);
+
+        frame->compressed_offset = compressed_offset;
+        frame->offset = offset;
+        frame->compressed_size = get_le32(entry);
+        frame->size = get_le32(entry + 4);
+
+        if ((frame->size == 0) || (frame->size > MAX_FRAME_SIZE)) {
+            goto invalid;
+        }
+
+        compressed_offset += frame->compressed_size;
+        offset += frame->size;
+    }
+
+    if (compressed_offset > (file_size - table_size)) {
+        goto invalid;
+    }
+
+    zs->frame_count = count;
+    zs->size = offset;
+    result = 0;
+    goto cleanup;
+
+invalid:
+    errno = EINVAL;
+
+cleanup:
+    free(entries);
+    return result;
+}
+
+static size_t zstd_find_frame(const struct zstd_source *zs, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = zs->frame_count;
+
+    while ((high - low) > 1) {
+        size_t mid = low + ((high - low) / 2);
+
+        if (zs->frames[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static char * zstd_decompress_frame(struct zstd_source *zs, size_t index)
+{
+    struct zstd_frame *frame = &zs->frames[index];
+    char *compressed = malloc(frame->compressed_size);
+    char *data = malloc(frame->size);
+    size_t result = 0;
+
+    if ((compressed == NULL) || (data == NULL)) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    if (pread_exact(zs->fd, compressed, frame->compressed_size,
+                   (off_t) frame->compressed_offset) != 0) {
+        goto fail;
+    }
+
+    result = ZSTD_decompress(data, frame->size, compressed,
+                             frame->compressed_size);
+
+    if (ZSTD_isError(result) || (result != frame->size)) {
+        errno = EIO;
+        goto fail;
+    }
+
+    free(compressed);
+    return data;
+
+fail:
+    free(compressed);
+    free(data);
+    return NULL;
+}
+
+/* Copies the cached frame INDEX from SKIP onwards into BUF. Returns 0, or -1
+ * if it isn't cached. Called with the lock held. */
+static int zstd_cache_copy(struct zstd_source *zs, size_t index, char *buf,
+                           size_t skip, size_t wanted)
+{
+    for (unsigned int x = 0; x < CACHE_FRAMES; x++) {
+        struct zstd_cache_entry *entry = &zs->cache[x];
+
+        if ((entry->data != NULL) && (entry->frame == index)) {
+            entry->last_use = ++zs->clock;
+            memcpy(buf, entry->data + skip, wanted);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Hands DATA over to the cache, evicting the least-recently used frame.
+ * Called with the lock held. */
+static void zstd_cache_insert(struct zstd_source *zs, size_t index,
+                              char *data)
+{
+    struct zstd_cache_entry *victim = &zs->cache[0];
+
+    for (unsigned int x = 0; x < CACHE_FRAMES; x++) {
+        struct zstd_cache_entry *entry = &zs->cache[x];
+
+        if ((entry->data != NULL) && (entry->frame == index)) {
+            /* Another thread got there first. */
+            free(data);
+            return;
+        }
+
+        if ((entry->data == NULL) ||
+            ((victim->data != NULL) &&
+             (entry->last_use < victim->last_use))) {
+            victim = entry;
+        }
+    }
+
+    free(victim->data);
+    victim->frame = index;
+    victim->data = data;
+    victim->last_use = ++zs->clock;
+}
+
+/*----------------------------------------------------------------------------*/
+
+int zstd_source_open(struct zstd_source **zs, int fd)
+{
+    struct zstd_source *result = NULL;
+    struct stat stat_buffer = {0};
+
+    if (zs == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fstat(fd, &stat_buffer) != 0) {
+        return -1;
+    }
+
+    if ((result = calloc(1, sizeof(struct zstd_source))) == NULL) {
+        return -1;
+    }
+
+    result->fd = fd;
+    pthread_mutex_init(&result->lock, NULL);
+
+    if (zstd_load_table(result, (uint64_t) stat_buffer.st_size) != 0) {
+        int error = errno;
+        zstd_source_close(result);
+        errno = error;
+        return -1;
+    }
+
+    *zs = result;
+    return 0;
+}
+
+void zstd_source_close(struct zstd_source *zs)
+{
+    if (zs == NULL) {
+        return;
+    }
+
+    for (unsigned int x = 0; x < CACHE_FRAMES; x++) {
+        free(zs->cache[x].data);
+    }
+
+    pthread_mutex_destroy(&zs->lock);
+    free(zs->frames);
+    free(zs);
+}
+
+uint64_t zstd_source_size(struct zstd_source *zs)
+{
+    return zs->size;
+}
+
+ssize_t zstd_source_pread(struct zstd_source *zs, char *buf, size_t nbyte,
+                          off_t offset)
+{
+    uint64_t pos = (uint64_t) offset;
+    uint64_t stop = pos + nbyte;
+
+    if (stop > zs->size) {
+        stop = zs->size;
+    }
+
+    while (pos < stop) {
+        size_t index = zstd_find_frame(zs, pos);
+        struct zstd_frame *frame = &zs->frames[index];
+        size_t skip = (size_t) (pos - frame->offset);
+        size_t wanted = frame->size - skip;
+        char *dest = buf + (pos - (uint64_t) offset);
+        char *data = NULL;
+        int cached = 0;
+
+        if (wanted > (stop - pos)) {
+            wanted = (size_t) (stop - pos);
+        }
+
+        pthread_mutex_lock(&zs->lock);
+        cached = (zstd_cache_copy(zs, index, dest, skip, wanted) == 0);
+        pthread_mutex_unlock(&zs->lock);
+
+        if (!cached) {
+            /* Decompress without the lock, so that other threads can carry
+             * on reading frames that are already cached. */
+            if ((data = zstd_decompress_frame(zs, index)) == NULL) {
+                if (pos == (uint64_t) offset) {
+                    return -1;
+                }
+                break;
+            }
+
+            memcpy(dest, data + skip, wanted);
+
+            pthread_mutex_lock(&zs->lock);
+            zstd_cache_insert(zs, index, data);
+            pthread_mutex_unlock(&zs->lock);
+        }
+
+        pos += wanted;
+    }
+
+    return (ssize_t) (pos - (uint64_t) offset);
+}
@@ -0,0 +1,24 @@
+#ifndef ZSTD_SOURCE_H
+#define ZSTD_SOURCE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct zstd_source;
+
+/* Loads the seek table of FD, which has to be in zstd's seekable format (a
+ * series of independent frames followed by a frame index). Returns 0 on
+ * success, or -1 with errno set (EINVAL if FD isn't seekable zstd). */
+int zstd_source_open(struct zstd_source **zs, int fd);
+
+void zstd_source_close(struct zstd_source *zs);
+
+/* Returns the size of the decompressed image. */
+uint64_t zstd_source_size(struct zstd_source *zs);
+
+/* Reads like pread_count() from the decompressed image, decompressing only
+ * the frames that the read covers. */
+ssize_t zstd_source_pread(struct zstd_source *zs, char *buf, size_t nbyte,
+                          off_t offset);
+
+#endif